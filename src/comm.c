@@ -1,24 +1,199 @@
 #include "header.h"
-#include <windows.h>
-#include <xpsprint.h>
+#include "serial.c"
+#include "compact.c"
+#include "rt.c"
+#include <semaphore.h>
+#include <errno.h>
+#include <time.h>
 
-#define NEXT_MSGS_COUNT 4
+#define COMM_MAX_STASHED 4
+#define COMM_CMD_QUEUE_SIZE 256           // Power of 2 - the comm thread empties the queue at least every MSG_TIMEOUT (the longest a probe or a wait for a reply takes), in which the UI can't queue up nearly as many commands
+#define COMM_REPLY_QUEUE_SIZE 64          // Power of 2 - the Arduino only sends a few replies per message, so the reader thread practically never finds the queue full
 #define SEND_MSG_MAX_RETRIES 8
 #define MAX_BYTES_TO_SEND_AT_ONCE 16
-#define READING_CHUNK_SIZE 8
-#define MAX_CLIENT_MSG_SIZE (4 + 1 + 3*12*(1<<4) + 2 + 4*(1<<16))
-
-typedef struct NextMsgRing {
-    ClientMsgType data[NEXT_MSGS_COUNT];
-    u8 start;
-    u8 end;
-} NextMsgRing;
-AIL_STATIC_ASSERT(NEXT_MSGS_COUNT <= UINT8_MAX);
+#define READING_CHUNK_SIZE SERIAL_READ_CHUNK_MAX // Everything the OS has ready is read at once
+#define COMM_FRAME_HEAD_SIZE (4 + 1 + 1 + SPPP_PK_ENCODED_SIZE*UINT8_MAX + 2) // Magic & type, seq, pks_count, played keys and cmds_count - payloads of music chunks aren't copied into the frame
+#define COMM_WRITE_BLOCK_SIZE 256         // Frames are handed to the transport in blocks of at most this size, which are filled from the frame's parts
+#define COMM_KEEPALIVE_MS (2*MSG_TIMEOUT) // Idle time after which a PING checks whether the Arduino is still connected
+#define COMM_RECONNECT_MS MSG_TIMEOUT     // Time between attempts at finding the Arduino while disconnected
+#define COMM_PREPARED_CHUNKS 2            // Amount of music chunks, that are encoded ahead of time
+#define COMM_CHUNK_RTTS      8            // A chunk should play for at least this many round trips, so that the next one arrives in time
+#define COMM_MIN_CHUNK_MS    250          // Lower bound for a chunk's play time, that covers scheduling hiccups on our side
+#define COMM_LINK_HEADROOM   0.75         // Fraction of the measured link throughput, that music chunks may use up
+#define COMM_MIN_SCORED_BYTES 64          // Messages smaller than this are dominated by latency and don't tell us the link's throughput
+#define COMM_MUSIC_FRAME_OVERHEAD (4 + 1 + 2 + SPPP_CRC_SIZE) // Magic & type, seq, cmds_count and CRC
+#define COMM_BAUD_SWITCH_MS  10           // Time for the last bytes at the old baud rate to arrive, before we switch to the new one
+#define COMM_CONTROL_INTERVAL_MS 100      // Minimum time between two messages with control values, so that dragging a slider only sends a few of them
+#define COMM_RESUME_POINTS   8            // Amount of chunk ends, that are remembered for continuing the song after reconnecting
+#define COMM_CLOCK_SAMPLES   8            // Amount of round trips to the Arduino, from which the offset between both clocks is estimated
+#define COMM_CLOCK_FAST_MS   SPPP_CLOCK_INTERVAL_MS // Time between clock queries, until COMM_CLOCK_SAMPLES of them were answered
+#define COMM_CLOCK_QUERY_MS  1000         // Time between clock queries afterwards
+#define COMM_CLOCK_RTT_SLACK 0.0005       // Samples are trusted, if their round trip took at most twice as long as the shortest one plus this many seconds
+#define COMM_CLOCK_MIN_SPAN  2.0          // Minimum time in seconds covered by the samples, before the clocks' drift is estimated from them
+#define COMM_CLOCK_MAX_DRIFT 0.001        // Even cheap resonators are more precise than this
+#define COMM_DIRECT_ENV      "SAM_DIRECT" // Setting this environment variable plays songs in the direct-drive mode on Arduinos with SPPP_FEATURE_DIRECT
+#define COMM_DIRECT_QUEUE_SIZE 1024       // Power of 2 - only holds the key events of the next COMM_DIRECT_AHEAD_MS
+#define COMM_DIRECT_AHEAD_MS 200          // How far ahead keys are scheduled, which is also how long it takes until a new volume or speed is heard
+#define COMM_DIRECT_START_MS 30           // Time between starting a song and its first keys, so that they aren't late right away
+#define COMM_DIRECT_POLL_MS  10           // Longest time the scheduler thread sleeps, before it checks whether the scheduled keys are still valid
+#define COMM_DIRECT_BATCH_US 200          // Keys, that are due within this time, are sent in the same frame
+#define COMM_DIRECT_MAX_KEYS 32           // Keys per CMSG_KEYS frame
+#define COMM_DIRECT_MAX_HELD 128          // Keys, that can be held at the same time - more than a piano has
+
+typedef enum CommCmdType {
+    COMM_CMD_SONG,
+    COMM_CMD_SEEK,
+    COMM_CMD_VOLUME,
+    COMM_CMD_SPEED,
+    COMM_CMD_PAUSE,
+} CommCmdType;
+
+// Command from the UI to the communication thread
+typedef struct CommCmd {
+    CommCmdType type;
+    union {
+        struct {
+            AIL_DA(PidiCmd) cmds; // The communication thread takes ownership of the commands
+            AIL_Buffer pidi;      // Contents of the song's PIDI-file or empty - owned by the communication thread as well
+            u32 start_time;
+        } song;
+        u32  seek_time; // Time in the current song, from which on to play it
+        f32  volume;
+        f32  speed;
+        bool paused;
+    } data;
+} CommCmd;
+
+// Payload of a CMSG_MUSIC message (cmds_count & encoded commands), that was encoded ahead of time
+typedef struct PreparedChunk {
+    u8 *data;
+    u32 len;
+    u32 cap;
+    u16 cmds_count;
+    u32 span_ms; // Time it takes to play this chunk at a speed of 1
+    u32 end_idx; // Index in comm_cmds after the last command of this chunk
+    bool compact; // Whether the payload is meant for CMSG_MUSIC_COMPACT
+} PreparedChunk;
+
+// Encoded frame, that is written in parts, so that the payload of a music chunk never needs to be copied
+typedef struct CommFrame {
+    u8        head[COMM_FRAME_HEAD_SIZE]; // Magic, type, seq and the complete payload of all other messages
+    u32       head_len;
+    const u8 *body; // Payload of a music chunk or NULL
+    u32       body_len;
+    u8        crc[SPPP_CRC_SIZE]; // Only written for sequenced frames
+    u8        crc_len;
+    u32       len;  // Length of the whole frame
+} CommFrame;
 AIL_DA_INIT(PlayedKeySPPP);
 
-// @Note: All communication with the Arduino is done in a single thread external from the UI's main thread.
+// End of a chunk, that was sent to the Arduino, from which the song can be continued after reconnecting (see SMSG_STATUS)
+typedef struct CommResumePoint {
+    u32 device_cmds; // Amount of commands, that the Arduino received in total, once it got this chunk
+    u32 end_idx;     // Index in comm_cmds after the chunk's last command
+    f64 song_ms;     // Time in the song, at which the chunk ends
+} CommResumePoint;
+
+// Round trip of a CMSG_CLOCK_QUERY
+typedef struct CommClockSample {
+    f64 host;   // Time on our clock, that the Arduino's timestamp corresponds to, if both directions took equally long
+    f64 offset; // Arduino's clock minus ours
+    f64 rtt;    // Time the round trip took apart from transmitting the bytes
+} CommClockSample;
+
+// Key, that is pressed or released at `time` on rt_now's clock by the scheduler thread (see comm_direct_main)
+typedef struct DirectEvent {
+    f64 time;
+    u32 gen;      // comm_direct_gen at the time the event was scheduled - events of an older generation are dropped
+    i8  octave;
+    u8  key;
+    u8  velocity; // 0 releases the key
+} DirectEvent;
+
+// Key, that is held until `song_ms`
+typedef struct DirectKey {
+    f64 song_ms;
+    i8  octave;
+    u8  key;
+} DirectKey;
+
+// Maps the time in the song to rt_now's clock: from `base_time` on, the song is at `base_ms` + the elapsed time*`speed`
+typedef struct DirectTimeline {
+    f64 base_time;
+    f64 base_ms;
+    f32 speed;
+} DirectTimeline;
+
+// Reply from the Arduino, that the reader thread parsed
+typedef struct CommReply {
+    ServerMsgType type;
+    f64 time; // Timestamp of when the reply was read from the port
+    union {
+        u16 max_cmds_per_msg; // SMSG_PONG
+        struct {
+            u16 received;
+            u16 window;
+        } credit;
+        struct {
+            u8 seq;
+            ServerMsgType reply;
+        } ack;
+        u8 nak_seq;
+        struct {
+            u8  version;
+            u32 features;
+            u16 max_frame;
+            u16 window;
+            u32 max_baud_rate;
+        } caps;
+        struct {
+            u16 session;
+            u32 received;
+            u32 buffered_ms;
+        } status;
+        struct {
+            u8   query;
+            bool playing;
+            u32  clock_us;
+            u32  received;
+            u32  buffered_us;
+        } clock;
+    } data;
+} CommReply;
+
+typedef enum SpppDecoderState {
+    SPPP_DECODE_MAGIC,   // Looking for the magic bytes - `matched` of them were found already
+    SPPP_DECODE_TYPE,
+    SPPP_DECODE_PAYLOAD,
+} SpppDecoderState;
+
+// Incremental decoder for the SPPP messages, that the Arduino sends (see sppp_decode)
+typedef struct SpppDecoder {
+    SpppDecoderState state;
+    u8 matched;
+    u8 type;
+    u8 size; // Size of the current message's payload
+    u8 have; // Amount of payload bytes received so far
+    u8 payload[SMSG_CLOCK_SIZE - 4]; // The largest payload of any message
+} SpppDecoder;
+
+// Consistent snapshot of the communication thread's state, which the UI picks up once per frame via comm_poll_state
+typedef struct CommState {
+    bool connected;
+    bool playing;     // Whether the Arduino started playing the latest song
+    bool paused;
+    bool overloaded;  // See comm_link_overloaded
+    u32  song_id;     // Amount of songs, that the communication thread got from the UI, so that the UI can tell which song this state belongs to
+    f32  speed;       // Speed, that the Arduino was told to play at
+    f64  position_ms; // Estimated time in the song, that the Arduino was at when the snapshot was taken
+    f64  buffered_ms; // Estimated time, for which the Arduino could keep playing with the music it had received by then
+    f64  time;        // Timestamp of the snapshot
+} CommState;
+
+// @Note: All communication with the Arduino is done in a single thread external from the UI's main thread (apart from reading, see comm_reader_main).
 // No other thread should write to these variables
-static void *comm_port             = 0;    // Handle to the Port that is connected to the Arduino - Only find_server_port writes this value
+static SerialTransport *comm_transport = &serial_native;
+static bool  comm_port_open        = false; // Whether comm_transport has a port open, that might be connected to the Arduino - Only find_server_port opens ports
 static bool  comm_is_music_playing = false;
 static bool  comm_is_paused        = false;
 static bool  comm_is_connected     = false;
@@ -29,35 +204,162 @@ static u32   comm_pidi_chunk_idx   = 0;
 static u32   comm_cmds_idx         = 0;
 static u16   comm_max_cmds_per_msg = 0;
 static bool  comm_ignore_requests  = false; // Indicates whether to ignore REQP messages for this loop iteration, because we just sent a new PIDI message
-static f64   last_comm_time        = 0.0f;  // Timestamp of last received message from Arduino - Only read_msg_fast write this value
+static f64   last_comm_time        = 0.0f;  // Timestamp of the last message, that was sent to the Arduino - Only resend_last_msg and send_ack_query write this value
 static ClientMsg comm_last_sent    = { 0 }; // Last message that was sent to the Arduino
-static AIL_RingBuffer comm_rb      = { 0 };
-static AIL_DA(PidiCmd) comm_cmds   = { 0 };
-static NextMsgRing comm_next_msgs  = { 0 };
+static AIL_DA(PidiCmd) comm_cmds   = { 0 }; // Owned by the communication thread - the UI hands songs over via comm_cmd_queue and never touches them again
+static AIL_Buffer comm_pidi        = { 0 }; // PIDI-file of the current song, which holds its commands already encoded like encode_cmd does
+static const u8 *comm_wire         = NULL;  // comm_cmds in the encoding of CMSG_MUSIC (inside comm_pidi) or NULL if the song wasn't loaded from a PIDI-file
+static CommCmd comm_cmd_slots[COMM_CMD_QUEUE_SIZE] = { 0 };
+static SpscQueue comm_cmd_queue    = SPSC_QUEUE_INIT(COMM_CMD_QUEUE_SIZE); // Only the UI thread pushes and only the communication thread pops
+static bool  comm_new_song_pending = false; // Set when the UI chose a new song or a new time in the current one, until the Arduino was told about it
 static AIL_DA(PlayedKeySPPP) comm_played_keys = { 0 };
+static u8    comm_retries          = 0;    // Amount of times comm_last_sent was sent again without getting a reply
+static bool  comm_credit_flow      = false; // Whether the Arduino uses credit-based flow control - set once its first SMSG_CREDIT arrived
+static u16   comm_sent_bytes       = 0;     // Bytes sent since the end of the last PING (mod 2^16) - only accessed atomically, since the scheduler thread adds its keys
+static u16   comm_acked_bytes      = 0;     // `received` from the latest SMSG_CREDIT
+static u16   comm_window           = 0;     // `window` from the latest SMSG_CREDIT
+static u64   comm_total_bytes_sent = 0;     // Only used for statistics
+static CommReply comm_stashed_replies[COMM_MAX_STASHED] = { 0 }; // Replies that arrived while send_msg waited for credit
+static u8    comm_stashed_count    = 0;
+static bool  comm_seq_frames       = false; // Whether the Arduino accepts sequenced frames - set once it announced them with an SMSG_ACK after a PONG
+static u8    comm_seq              = 0;     // `seq` of the last sequenced frame
+static bool  comm_resend_now       = false; // Set if the Arduino asked for comm_last_sent again via SMSG_NAK
+static bool  comm_queried_ack      = false; // Whether CMSG_ACK_QUERY was already sent, since comm_last_sent was sent the last time
+static CommFrame comm_frame       = { 0 }; // Frame of comm_last_sent, so that it can be sent again exactly like before
+static PreparedChunk comm_sent_chunk = { 0 }; // Chunk, whose payload is the body of comm_frame - kept until the next chunk is sent
+static PreparedChunk comm_prepared[COMM_PREPARED_CHUNKS] = { 0 };
+static u8    comm_prepared_start   = 0;
+static u8    comm_prepared_count   = 0;
+static u32   comm_prepared_idx     = 0;     // Index in comm_cmds of the first command, that wasn't prepared yet
+static bool  comm_song_prepared    = false; // Whether all commands of the current song were prepared already
+static f32   comm_srtt_ms          = 0;     // Smoothed round trip time of messages or 0 if nothing was measured yet
+static f32   comm_link_bps         = BAUD_RATE/10; // Smoothed throughput of the link in bytes per second
+static f64   comm_device_level_ms  = 0;     // Estimated time, for which the Arduino can keep playing with the chunks it already received
+static f64   comm_level_time       = 0;     // Timestamp of the last update to comm_device_level_ms
+static f32   comm_level_speed      = 1.0f;  // Speed, that the Arduino was told to play at
+static bool  comm_link_overloaded  = false; // Whether notes are skipped, because the link can't keep up with the song at the current speed - published in CommState
+static u8    comm_ext_version      = 0;     // Version of the SPPP extensions, that both sides support, or 0 if the Arduino didn't send SMSG_CAPS
+static u32   comm_features         = 0;     // SPPP_FEATURE_* flags, that both sides support
+static u16   comm_max_frame        = 0;     // Size of the largest frame, that the Arduino can receive, or 0 if unknown
+static u32   comm_max_baud_rate    = 0;     // Highest baud rate, that the Arduino can switch to
+static u32   comm_baud_rate        = BAUD_RATE;
+static bool  comm_caps_pending     = false; // Set when SMSG_CAPS arrived, so that the main loop can switch to a higher baud rate
+static bool  comm_baud_failed      = false; // Whether switching to a higher baud rate failed already - reset only when a port is opened
+static PidiCmd *comm_kept_cmds     = NULL;  // Commands of a chunk, that were kept by decimate_cmds
+static u32   comm_kept_cap         = 0;
+static u8    comm_dirty_controls   = 0;     // SPPP_CONTROL_* flags of values, that the UI changed since they were sent the last time
+static f64   comm_controls_time    = 0;     // Timestamp of the last message with control values
+static u64   comm_control_frames   = 0;     // Only used for statistics
+static u8    comm_last_control     = 0;     // SPPP_CONTROL_* flag of the last control, that was sent without batching
+static u32   comm_song_id          = 0;     // Amount of songs, that were handed over by the UI
+static f64   comm_sent_song_ms     = 0;     // Time in the song, at which the music, that was sent to the Arduino, ends
+static bool  comm_status_pending   = false; // Set when SMSG_CAPS announced SPPP_FEATURE_RESUME, until the Arduino's SMSG_STATUS arrived
+static bool  comm_session_known    = false; // Whether comm_session and comm_device_cmds belong to the Arduino, that is connected
+static u16   comm_session          = 0;     // `session` from the latest SMSG_STATUS
+static u32   comm_device_cmds      = 0;     // Amount of commands, that the Arduino received since it started, if every chunk sent to it arrived
+static CommResumePoint comm_resume_points[COMM_RESUME_POINTS] = { 0 }; // Ring of the latest chunk ends of the current song
+static u8    comm_resume_next      = 0;
+static u8    comm_resume_count     = 0;
+static CommClockSample comm_clock_samples[COMM_CLOCK_SAMPLES] = { 0 }; // Ring of the latest answered clock queries
+static u8    comm_clock_next       = 0;
+static u8    comm_clock_count      = 0;     // Amount of samples in comm_clock_samples - the clocks are only compared once there is one
+static u64   comm_device_clock_us  = 0;     // Latest timestamp of the Arduino, which doesn't wrap around like `clock_us`
+static f64   comm_clock_anchor     = 0;     // The Arduino's clock is comm_clock_offset + comm_clock_drift*(t - comm_clock_anchor) ahead of ours at time t
+static f64   comm_clock_offset     = 0;
+static f64   comm_clock_drift      = 0;
+static u8    comm_clock_query_id   = 0;     // `id` of the latest CMSG_CLOCK_QUERY
+static f64   comm_clock_query_time = 0;     // Timestamp of when the latest CMSG_CLOCK_QUERY was sent
+static bool  comm_clock_valid      = false; // Whether the latest SMSG_CLOCK tells where the Arduino is in the current song
+static bool  comm_clock_playing    = false; // `playing` from the latest SMSG_CLOCK
+static f64   comm_clock_time       = 0;     // Time on our clock, at which the latest SMSG_CLOCK was taken
+static f64   comm_clock_pos_ms     = 0;     // Time in the song, at which the Arduino was at comm_clock_time
+static f64   comm_clock_buffered_ms = 0;    // Time, for which the Arduino could keep playing from comm_clock_time on
+static bool  comm_direct_wanted    = false; // Whether COMM_DIRECT_ENV was set and the scheduler thread is running
+static bool  comm_direct           = false; // Whether the current song is played in the direct-drive mode - decided whenever a song is started
+static bool  comm_direct_paused    = false; // Whether the scheduler thread was stopped because of a pause
+static f64   comm_direct_pause_ms  = 0;     // Time in the song, at which it was paused
+static u32   comm_direct_gen       = 0;     // Incremented whenever the scheduled keys became invalid, upon which the scheduler thread releases all keys
+static f64   comm_direct_prev_ms   = 0;     // Time in the song of the command before comm_cmds_idx
+static f64   comm_direct_sched_ms  = 0;     // Time in the song, up to which all keys were scheduled
+static DirectKey comm_direct_held[COMM_DIRECT_MAX_HELD] = { 0 }; // Keys, whose release wasn't scheduled yet
+static u32   comm_direct_held_count = 0;
+static DirectTimeline comm_direct_timeline      = { 0 }; // Used for the keys, that are scheduled from now on
+static DirectTimeline comm_direct_prev_timeline = { 0 }; // Used before comm_direct_timeline's `base_time`, i.e. by the keys, that were scheduled before the last change of speed
+static DirectEvent comm_direct_slots[COMM_DIRECT_QUEUE_SIZE] = { 0 };
+static SpscQueue comm_direct_queue = SPSC_QUEUE_INIT(COMM_DIRECT_QUEUE_SIZE); // Only the communication thread pushes and only the scheduler thread pops
+static pthread_t comm_direct_thread;
+static RtJitter comm_direct_jitter = { 0 }; // How late the scheduler thread sent keys - only used for statistics
+static u64   comm_direct_frames    = 0;     // Only used for statistics
+// Held while writing to comm_transport and while changing comm_port_open or the credit, since the scheduler thread writes as well
+// @Note: write_frame only holds it while writing a frame, but not while waiting for the Arduino to have space for it (see write_frame)
+static pthread_mutex_t comm_write_lock;
+static bool  comm_frame_open       = false; // Set while the communication thread is in the middle of writing a frame, during which the scheduler thread mustn't send anything
+static CommState comm_states[3]    = { 0 }; // Only written by the communication thread (see TripleBuffer in header.h)
+static TripleBuffer comm_state_tb  = TRIPLE_BUFFER_INIT;
+static f64   comm_reply_time       = 0;     // Timestamp of when the reply, that was returned last by check_for_msg or next_reply, was read from the port
+static sem_t comm_wakeup;                   // Posted whenever the UI queued a command or the reader thread parsed replies
 
-static pthread_mutex_t comm_volume_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t comm_speed_mutex  = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t comm_song_mutex   = PTHREAD_MUTEX_INITIALIZER;
+// @Note: While a port is open, a separate reader thread reads everything the Arduino sends and parses it into replies,
+// so that replies are read right away, even while the communication thread is busy writing a long message.
+// The reader thread only uses the following variables - the communication thread only touches them while no reader thread is running.
+static CommReply comm_reply_slots[COMM_REPLY_QUEUE_SIZE] = { 0 };
+static SpscQueue comm_reply_queue  = SPSC_QUEUE_INIT(COMM_REPLY_QUEUE_SIZE); // Only the reader thread pushes and only the communication thread pops
+static pthread_t comm_reader;
+static bool  comm_reader_running   = false; // Only used by the communication thread
+static bool  comm_reader_stop      = false; // Set by the communication thread, once the reader thread should exit
+static bool  comm_reader_failed    = false; // Set by the reader thread, if the port couldn't be read from anymore
+static SerialProbe comm_probe      = { 0 };    // The bytes in `rest` are decoded by the reader thread, before it reads anything from the port
+static SerialPortName comm_last_port = { 0 };  // Port, on which the Arduino was found the last time
 
 // For writing to the communication thread, the main thread should call the following functions
-void send_new_song(AIL_DA(PidiCmd) cmds, u32 start_time);
+// None of them block - they only queue up a command, that the communication thread handles once it gets to it
+void comm_init(void); // Needs to be called before the communication thread is started
+bool send_new_song(AIL_DA(PidiCmd) cmds, AIL_Buffer pidi, u32 start_time); // Returns false if the command queue is full, in which case the caller keeps `cmds` and `pidi`
+void seek_song(u32 time);
+void set_paused(bool paused);
 void set_volume(f32 volume);
 void set_speed(f32 speed);
+const CommState *comm_poll_state(void); // Returns the latest snapshot, which stays valid until the next call
+f64 comm_state_position(const CommState *state); // Extrapolates the position in the song from a snapshot to the current time
 
 // Internal only functions
-bool comm_setup_port(void);
 bool send_msg(ClientMsg msg);
+static void encode_msg(ClientMsg msg);
+bool resend_last_msg(void);
+bool send_ack_query(void);
+bool send_prepared_chunk(void);
+static bool send_controls(void);
+void prepare_chunks(void);
+static bool switch_baud_rate(void);
+static void update_device_level(void);
+static void push_resume_point(u32 end_idx);
+static void resume_from_status(CommReply reply);
+static i32  find_resume_point(u32 device_cmds);
+static bool send_clock_query(void);
+static inline u32 clock_query_due_in_ms(void);
+static void handle_clock(CommReply reply);
+static void reset_clock(void);
+static inline f64 direct_time(f64 song_ms);
+static void direct_start(u32 prev_cmd_time);
+static void direct_fill(void);
+static void direct_apply_controls(void);
+static f64  direct_position_ms(void);
+static void *comm_direct_main(void *args);
 void find_server_port(AIL_Allocator *allocator);
-static inline void push_msg(ClientMsgType msg);
-static inline ClientMsgType pop_msg(void);
-static inline bool next_msgs_contain_pidi(void);
-static inline void listen_to_port(void);
+static bool push_cmd(CommCmd cmd);
+static void handle_cmds(void);
+static inline u32 controls_due_in_ms(void);
+static void publish_state(void);
+static void comm_wait(u32 timeout_ms);
+bool listen_to_port(void);
+static bool comm_start_reader(void);
+void comm_close_port(void);
+static void *comm_reader_main(void *args);
+static u32 sppp_decode(SpppDecoder *d, const u8 *data, u32 len, CommReply *reply, bool *complete);
 ServerMsgType check_for_msg(void);
+ServerMsgType next_reply(void);
 
 
-// @TODO: have a timer, that tells the UI the current time
-
 // Main loop for Communication Thread
 void *comm_thread_main(void *args)
 {
@@ -65,106 +367,131 @@ void *comm_thread_main(void *args)
     comm_played_keys = ail_da_new_with_cap(PlayedKeySPPP, PIANO_KEY_AMOUNT*(1<<4));
     AIL_Allocator arena = ail_alloc_arena_new(2*AIL_ALLOC_PAGE_SIZE, &ail_alloc_pager);
     AIL_ASSERT(arena.data != NULL); // @TODO: Show error message if something goes wrong
+    // The thread only wakes up when data arrived from the Arduino, the UI queued a new message or a timeout is due
     while (true) {
         comm_ignore_requests = false;
+        handle_cmds();
         // If we are not connected, find port to connect
-        if (ail_time_clock_elapsed(last_comm_time) >= MSG_TIMEOUT/1000.0f) {
+        if (!comm_is_connected) {
+            find_server_port(&arena);
+            comm_is_connected = comm_port_open;
+            comm_retries      = 0;
             if (!comm_is_connected) {
-                find_server_port(&arena);
-                comm_is_connected = comm_port != NULL;
-            } else if (comm_last_sent.type != CMSG_NONE) {
-                // @Cleanup:
-                // comm_last_sent.type = CMSG_NONE;
+                publish_state();
+                // Commands are still applied while waiting, so that e.g. a pause isn't dropped because the queue filled up
+                f64 t = ail_time_clock_start();
+                for (f64 elapsed_ms = 0; elapsed_ms < COMM_RECONNECT_MS; elapsed_ms = ail_time_clock_elapsed(t)*1000.0) {
+                    comm_wait((u32)(COMM_RECONNECT_MS - elapsed_ms) + 1);
+                    handle_cmds();
+                }
+                continue;
+            }
+        }
+
+        f64 idle_ms = ail_time_clock_elapsed(last_comm_time)*1000.0;
+        // Replies, that arrived in time, but weren't looked at yet, might be the missing one
+        bool replies_queued = comm_stashed_count || spsc_queue_peek(&comm_reply_queue) >= 0;
+        if (comm_last_sent.type != CMSG_NONE && ((idle_ms >= MSG_TIMEOUT && !replies_queued) || comm_resend_now)) {
+            if (comm_retries++ >= SEND_MSG_MAX_RETRIES) {
+                // The Arduino didn't reply for too long, so we try to find it again
+                comm_is_connected = false;
+                continue;
+            }
+            if (comm_seq_frames && !comm_resend_now && !comm_queried_ack && sppp_is_sequenced(comm_last_sent.type)) {
+                // Maybe only the reply got lost - asking for it is much cheaper than sending a whole music chunk again
+                printf("Asking for last ack\n");
+                comm_is_connected = send_ack_query();
+            } else {
                 printf("Sending msg again\n");
-                send_msg(comm_last_sent); // Send same message again, since something apparently went wrong
-                // @TODO: Potential problem here:
-                // UI sends PIDI chunk
-                // Arduino receives it, but SPPPSUCC message is lost on way
-                // UI sends same PIDI chunk again
-                // the same music is played twice
+                comm_is_connected = resend_last_msg(); // Send same message again, since something apparently went wrong
+                // @Note: Without sequenced frames, the Arduino can't tell whether it already received this message.
+                // So if only its SUCCESS got lost, it plays the same chunk twice.
             }
+        } else if (comm_last_sent.type == CMSG_NONE && idle_ms >= COMM_KEEPALIVE_MS && !comm_new_song_pending && controls_due_in_ms() == UINT32_MAX) {
+            comm_is_connected = send_msg((ClientMsg){ .type = CMSG_PING });
         }
 
-        // Send any queued up messages
-        ClientMsgType next_msg;
-        while (comm_is_connected && comm_last_sent.type == CMSG_NONE && (next_msg = pop_msg())) {
-            ClientMsg msg;
-            switch (next_msg) {
-                case CMSG_NONE:
-                    AIL_UNREACHABLE();
-                    goto skip_sending_message;
-                case CMSG_PING:
-                case CMSG_CONTINUE:
-                    msg = (ClientMsg) {
-                        .type = next_msg,
-                        .data = { .b = !comm_is_paused },
-                    };
-                    break;
-                case CMSG_VOLUME:
-                    msg = (ClientMsg) {
-                        .type = CMSG_VOLUME,
-                        .data = { .f = comm_volume },
-                    };
-                    break;
-                case CMSG_SPEED:
-                    msg = (ClientMsg) {
-                        .type = CMSG_SPEED,
-                        .data = { .f = comm_speed },
-                    };
-                    break;
-                case CMSG_NEW_MUSIC:
-                    comm_ignore_requests = true;
-                    if (next_msgs_contain_pidi()) goto skip_sending_message;
-                    u32 i = 0;
-                    u32 prev_cmd_time = 0;
-                    for (; i < comm_cmds.len && prev_cmd_time + comm_cmds.data[i].dt < comm_time; i++) {
-                        PidiCmd cmd  = comm_cmds.data[i];
-                        u32 end_time = prev_cmd_time + cmd.dt + cmd.len*LEN_FACTOR;
-                        if (comm_time < end_time) {
-                            PlayedKeySPPP pk = {
-                                .key      = cmd.key,
-                                .octave   = cmd.octave,
-                                .len      = (end_time - comm_time)/LEN_FACTOR,
-                                .velocity = cmd.velocity,
-                            };
-                            ail_da_push(&comm_played_keys, pk);
-                        }
-                        prev_cmd_time += cmd.dt;
-                    }
-                    ClientMsgPidiData pidi = {
-                        .pks_count   = comm_played_keys.len,
-                        .played_keys = comm_played_keys.data,
-                        .cmds_count  = AIL_MIN(comm_cmds.len - i, comm_max_cmds_per_msg),
-                        .cmds        = &comm_cmds.data[i],
-                    };
-                    comm_cmds_idx = i + pidi.cmds_count;
-                    msg = (ClientMsg) {
-                        .type = CMSG_MUSIC,
-                        .data = { .pidi = pidi },
+        // Control values are sent before a new song, so that e.g. it already starts at the right speed
+        if (comm_direct) {
+            direct_apply_controls();
+        } else if (comm_is_connected && comm_last_sent.type == CMSG_NONE && controls_due_in_ms() == 0) {
+            comm_is_connected = send_controls();
+        }
+
+        // Start the new song or jump to the new time in the current one
+        if (comm_is_connected && comm_last_sent.type == CMSG_NONE && comm_new_song_pending) {
+            comm_new_song_pending = false;
+            comm_ignore_requests  = true;
+            comm_played_keys.len  = 0;
+            u32 i = 0;
+            u32 prev_cmd_time = 0;
+            for (; i < comm_cmds.len && prev_cmd_time + comm_cmds.data[i].dt < comm_time; i++) {
+                PidiCmd cmd  = comm_cmds.data[i];
+                u32 end_time = prev_cmd_time + cmd.dt + cmd.len*LEN_FACTOR;
+                if (comm_time < end_time) {
+                    PlayedKeySPPP pk = {
+                        .key      = cmd.key,
+                        .octave   = cmd.octave,
+                        .len      = (end_time - comm_time)/LEN_FACTOR,
+                        .velocity = cmd.velocity,
                     };
-                    break;
-                case CMSG_MUSIC:
-                    AIL_UNREACHABLE();
-                    break;
+                    ail_da_push(&comm_played_keys, pk);
+                }
+                prev_cmd_time += cmd.dt;
+            }
+            // Chunks that were prepared for the previous song are useless now
+            comm_cmds_idx       = i;
+            comm_prepared_count = 0;
+            comm_prepared_idx   = i;
+            comm_song_prepared  = false;
+            comm_device_level_ms = 0;
+            comm_sent_song_ms   = prev_cmd_time;
+            comm_resume_count   = 0;
+            comm_clock_valid    = false;
+            comm_direct         = comm_direct_wanted && (comm_features & SPPP_FEATURE_DIRECT);
+            if (comm_direct) {
+                // The Arduino gets no music at all, just the keys right when they are played
+                direct_start(prev_cmd_time);
+                continue;
+            }
+            push_resume_point(i);
+            prepare_chunks();
+            if (comm_prepared_count) {
+                comm_is_connected = send_prepared_chunk();
+            } else {
+                ClientMsgPidiData pidi = {
+                    .pks_count   = comm_played_keys.len,
+                    .played_keys = comm_played_keys.data,
+                    .cmds_count  = 0,
+                    .cmds        = NULL,
+                };
+                comm_is_connected = send_msg((ClientMsg){ .type = CMSG_MUSIC, .data = { .pidi = pidi } });
             }
-            comm_is_connected = send_msg(msg);
-skip_sending_message:
-            AIL_UNUSED(0); // to allow the label `skip_sending_message` to exist here
         }
 
         // Read data from port into ring buffer
+        if (comm_is_connected) comm_is_connected = listen_to_port();
         if (comm_is_connected) {
-            listen_to_port();
             ServerMsgType res;
             do {
-                res = check_for_msg();
+                res = next_reply();
                 switch (res) {
                     case SMSG_PONG:
                     case SMSG_SUCCESS:
+                        // Messages that were sent more than once can't tell us the round trip time
+                        if (comm_last_sent.type != CMSG_NONE && !comm_retries) {
+                            f32 rtt_ms   = AIL_MAX(comm_reply_time - last_comm_time, 0.0)*1000.0;
+                            comm_srtt_ms = comm_srtt_ms ? (7*comm_srtt_ms + rtt_ms)/8 : rtt_ms;
+                            // This underestimates the throughput by the latency, which only leaves more headroom
+                            if (comm_frame.len >= COMM_MIN_SCORED_BYTES) comm_link_bps = (7*comm_link_bps + comm_frame.len*1000.0f/AIL_MAX(rtt_ms, 1.0f))/8;
+                        }
+                        comm_retries = 0;
                         switch (comm_last_sent.type) {
                             case CMSG_NEW_MUSIC:
                             case CMSG_MUSIC:
                                 comm_is_music_playing = true;
+                                // Any REQUEST after this reply already belongs to the new song
+                                comm_ignore_requests  = false;
                                 break;
                             default:
                                 break;
@@ -172,198 +499,707 @@ skip_sending_message:
                         comm_last_sent = (ClientMsg){0}; // indicates, that last message was received successfully by arduino
                         break;
                     case SMSG_REQUEST: {
-                        if (comm_ignore_requests) continue;
-                        while (pthread_mutex_lock(&comm_song_mutex) != 0) {}
-                        ClientMsg msg = { .type = CMSG_MUSIC };
-                        if (comm_cmds_idx < comm_cmds.len) {
-                            msg.data.pidi = (ClientMsgPidiData) {
-                                .pks_count   = 0,
-                                .played_keys = comm_played_keys.data,
-                                .cmds_count  = AIL_MIN(comm_cmds.len - comm_cmds_idx, comm_max_cmds_per_msg),
-                                .cmds        = &comm_cmds.data[comm_cmds_idx],
-                            };
-                            comm_cmds_idx += comm_max_cmds_per_msg;
-                        }
-                        else {
+                        // If a new song is about to be sent, the prepared chunks don't belong to it anymore
+                        // Neither is there any point in sending the next chunk, before we know which one the Arduino got last
+                        if (comm_ignore_requests || comm_new_song_pending || comm_status_pending || comm_direct) continue;
+                        if (!comm_prepared_count) prepare_chunks();
+                        if (comm_prepared_count) {
+                            comm_is_connected = send_prepared_chunk();
+                        } else {
+                            // The song is over, which is indicated by an empty chunk
+                            ClientMsg msg = { .type = CMSG_MUSIC };
                             msg.data.pidi = (ClientMsgPidiData) {
                                 .pks_count   = 0,
                                 .played_keys = comm_played_keys.data,
                                 .cmds_count  = 0,
                                 .cmds        = 0,
                             };
+                            comm_is_connected = send_msg(msg);
                         }
-                        send_msg(msg);
-                        while (pthread_mutex_unlock(&comm_song_mutex) != 0) {}
                     } break;
                     case SMSG_NONE: {}
                 }
             } while (res != SMSG_NONE);
         }
+        if (!comm_is_connected) continue;
+        if (comm_caps_pending && comm_last_sent.type == CMSG_NONE) {
+            // The PING after switching makes the Arduino send its capabilities again, which don't need another switch
+            comm_is_connected = switch_baud_rate();
+            comm_caps_pending = false;
+            if (!comm_is_connected) continue;
+        }
+        // After (re)connecting, the Arduino tells us which chunks it got, so that the song continues right where it is
+        if (comm_status_pending && comm_last_sent.type == CMSG_NONE) {
+            comm_is_connected = send_msg((ClientMsg){ .type = CMSG_STATUS_QUERY });
+            if (!comm_is_connected) continue;
+        }
+        // The Arduino's clock is compared with ours every now and then, so that its reports tell exactly when it was where in the song
+        if (clock_query_due_in_ms() == 0) {
+            comm_is_connected = send_clock_query();
+            if (!comm_is_connected) continue;
+        }
+        if (comm_direct) direct_fill();
+        else prepare_chunks();
+
+        // Arduinos with flow control also queue chunks, that they didn't ask for yet
+        // So if the Arduino is about to run out of music, the next chunk is sent right away instead of waiting for its REQUEST
+        u32 ahead_ms = UINT32_MAX;
+        if (comm_credit_flow && comm_is_music_playing && comm_prepared_count && comm_last_sent.type == CMSG_NONE && !comm_new_song_pending && !comm_status_pending) {
+            update_device_level();
+            PreparedChunk *next = &comm_prepared[comm_prepared_start];
+            f64 lead_ms = 2*(comm_srtt_ms + next->len*1000.0/comm_link_bps);
+            if (comm_device_level_ms <= lead_ms) {
+                comm_is_connected = send_prepared_chunk();
+                if (!comm_is_connected) continue;
+                ahead_ms = 0;
+            } else {
+                ahead_ms = (u32)(comm_device_level_ms - lead_ms) + 1;
+            }
+        }
+
+        // Sleep until the Arduino sends something, the UI queues up a message or the next timeout is due
+        u32 timeout_ms = comm_last_sent.type != CMSG_NONE ? MSG_TIMEOUT : COMM_KEEPALIVE_MS;
+        idle_ms        = ail_time_clock_elapsed(last_comm_time)*1000.0;
+        u32 wait_ms    = idle_ms >= timeout_ms || comm_resend_now ? 0 : (u32)(timeout_ms - idle_ms) + 1;
+        wait_ms = AIL_MIN(wait_ms, ahead_ms);
+        // The wake-up for a command, that was handled while waiting for a reply, was already used up by that reply
+        if (comm_last_sent.type == CMSG_NONE && comm_new_song_pending) wait_ms = 0;
+        if (comm_last_sent.type == CMSG_NONE) wait_ms = AIL_MIN(wait_ms, controls_due_in_ms());
+        wait_ms = AIL_MIN(wait_ms, clock_query_due_in_ms());
+        if (comm_direct && comm_is_music_playing && !comm_direct_paused) wait_ms = AIL_MIN(wait_ms, COMM_DIRECT_AHEAD_MS/2);
+        publish_state();
+        comm_wait(wait_ms);
     }
-    if (comm_port) CloseHandle(comm_port);
+    comm_close_port();
     return NULL;
 }
 
-void push_msg(ClientMsgType msg)
+// Queues up a command for the communication thread without ever blocking
+// Returns false if the queue is full, which only happens if the communication thread is stuck
+static bool push_cmd(CommCmd cmd)
 {
-    comm_next_msgs.data[comm_next_msgs.end] = msg;
-    comm_next_msgs.end = (comm_next_msgs.end + 1)%NEXT_MSGS_COUNT;
+    i64 slot = spsc_queue_reserve(&comm_cmd_queue);
+    if (slot < 0) {
+        printf("Command queue is full, dropping command of type %d\n", cmd.type);
+        return false;
+    }
+    comm_cmd_slots[slot] = cmd;
+    spsc_queue_publish(&comm_cmd_queue);
+    sem_post(&comm_wakeup);
+    return true;
 }
 
-ClientMsgType pop_msg(void)
+// Applies all commands, that the UI queued up, to the state of the communication thread
+// Only the latest value of every control is sent afterwards (see send_controls) and only the latest song or time is started
+// Called whenever the communication thread waits for the Arduino, so that the queue never fills up
+void handle_cmds(void)
 {
-    u8 idx = comm_next_msgs.start;
-    if (idx == comm_next_msgs.end) return CMSG_NONE;
-    else {
-        comm_next_msgs.start = (comm_next_msgs.start + 1)%NEXT_MSGS_COUNT;
-        return comm_next_msgs.data[idx];
+    i64 slot;
+    bool handled = false;
+    while ((slot = spsc_queue_peek(&comm_cmd_queue)) >= 0) {
+        handled = true;
+        CommCmd cmd = comm_cmd_slots[slot];
+        spsc_queue_pop(&comm_cmd_queue);
+        switch (cmd.type) {
+            case COMM_CMD_SONG:
+                // The previous song can be freed right away, since only this thread ever reads it
+                if (comm_cmds.data && comm_cmds.data != cmd.data.song.cmds.data) ail_da_free(&comm_cmds);
+                if (comm_pidi.data && comm_pidi.data != cmd.data.song.pidi.data) free(comm_pidi.data);
+                comm_pidi_chunk_idx = 0;
+                comm_time = cmd.data.song.start_time;
+                comm_cmds = cmd.data.song.cmds;
+                comm_pidi = cmd.data.song.pidi;
+                // Prepared chunks can be copied straight from the file, as long as it holds exactly the same commands
+                comm_wire = comm_pidi.len == PIDI_HEADER_SIZE + 4*comm_cmds.len ? &comm_pidi.data[PIDI_HEADER_SIZE] : NULL;
+                comm_song_id++;
+                comm_is_music_playing = false; // The UI shows that the song is loading until its first chunk arrived
+                comm_new_song_pending = true;
+                break;
+            case COMM_CMD_SEEK:
+                comm_time = cmd.data.seek_time;
+                comm_new_song_pending = true;
+                break;
+            case COMM_CMD_VOLUME:
+                comm_volume = cmd.data.volume;
+                comm_dirty_controls |= SPPP_CONTROL_VOLUME;
+                break;
+            case COMM_CMD_SPEED:
+                comm_speed = cmd.data.speed;
+                comm_dirty_controls |= SPPP_CONTROL_SPEED;
+                break;
+            case COMM_CMD_PAUSE:
+                update_device_level(); // The Arduino's buffer only drains while playing
+                comm_is_paused = cmd.data.paused;
+                comm_dirty_controls |= SPPP_CONTROL_PLAY;
+                break;
+        }
     }
+    // The UI sees e.g. a new time right away, even if the thread is still busy sending something
+    if (handled) publish_state();
 }
 
-// Checks whether comm_next_msgs contains any CMSG_MUSIC or CMSG_NEW_MUSIC
-bool next_msgs_contain_pidi(void)
+// Hands a snapshot of the current state over to the UI
+static void publish_state(void)
 {
-    u8 n = (comm_next_msgs.end < comm_next_msgs.start)*NEXT_MSGS_COUNT + comm_next_msgs.end - comm_next_msgs.start;
-    for (u8 i = 0, j = 0; i < n; i++, j = (j + 1)%NEXT_MSGS_COUNT) {
-        if (comm_next_msgs.data[j] == CMSG_MUSIC || comm_next_msgs.data[j] == CMSG_NEW_MUSIC) return true;
+    update_device_level();
+    // Until the Arduino has the first chunk, it is assumed to be right where the UI wanted it to start
+    f64 position_ms = comm_time;
+    f64 buffered_ms = comm_device_level_ms;
+    if (comm_direct && comm_is_music_playing && !comm_new_song_pending) {
+        // The Arduino plays the keys right when they arrive, so the song is wherever the scheduler thread is
+        position_ms = direct_position_ms();
+        buffered_ms = comm_direct_paused ? 0.0 : AIL_MAX(direct_time(comm_direct_sched_ms) - rt_now(), 0.0)*1000.0;
+    } else if (comm_is_music_playing && !comm_new_song_pending && comm_clock_valid) {
+        // The Arduino told us where it was at comm_clock_time, from where on it kept playing until it ran out of music
+        f64 elapsed_ms = comm_clock_playing ? AIL_CLAMP((comm_level_time - comm_clock_time)*1000.0, 0.0, comm_clock_buffered_ms) : 0.0;
+        position_ms    = comm_clock_pos_ms + elapsed_ms*comm_level_speed;
+    } else if (comm_is_music_playing && !comm_new_song_pending) {
+        position_ms = AIL_MAX(comm_sent_song_ms - comm_device_level_ms*comm_level_speed, comm_time);
     }
-    return false;
+    comm_states[comm_state_tb.back] = (CommState){
+        .connected   = comm_is_connected,
+        .playing     = comm_is_music_playing,
+        .paused      = comm_is_paused,
+        .overloaded  = comm_link_overloaded,
+        .song_id     = comm_song_id,
+        .speed       = comm_level_speed,
+        .position_ms = position_ms,
+        .buffered_ms = buffered_ms,
+        .time        = comm_level_time,
+    };
+    triple_buffer_publish(&comm_state_tb);
+}
+
+// Returns the time until the changed control values should be sent, or UINT32_MAX if none changed
+// Pausing and resuming are sent right away, since they are single clicks instead of slider drags
+u32 controls_due_in_ms(void)
+{
+    if (!comm_dirty_controls) return UINT32_MAX;
+    f64 elapsed_ms = ail_time_clock_elapsed(comm_controls_time)*1000.0;
+    if ((comm_dirty_controls & SPPP_CONTROL_PLAY) || elapsed_ms >= COMM_CONTROL_INTERVAL_MS) return 0;
+    return (u32)(COMM_CONTROL_INTERVAL_MS - elapsed_ms) + 1;
+}
+
+// Returns the time until the next CMSG_CLOCK_QUERY should be sent, or UINT32_MAX if the Arduino has no clock to compare with
+// The first queries are sent more often, so that the clocks are compared soon after connecting
+u32 clock_query_due_in_ms(void)
+{
+    if (!(comm_features & SPPP_FEATURE_CLOCK)) return UINT32_MAX;
+    u32 interval_ms = comm_clock_count < COMM_CLOCK_SAMPLES ? COMM_CLOCK_FAST_MS : COMM_CLOCK_QUERY_MS;
+    f64 elapsed_ms  = ail_time_clock_elapsed(comm_clock_query_time)*1000.0;
+    if (elapsed_ms >= interval_ms) return 0;
+    return (u32)(interval_ms - elapsed_ms) + 1;
+}
+
+const CommState *comm_poll_state(void)
+{
+    triple_buffer_acquire(&comm_state_tb);
+    return &comm_states[comm_state_tb.front];
 }
 
-void send_new_song(AIL_DA(PidiCmd) cmds, u32 start_time)
+// The Arduino keeps playing at the same speed, until it runs out of music
+f64 comm_state_position(const CommState *state)
 {
-    while (pthread_mutex_lock(&comm_song_mutex) != 0) {}
-    // printf("\033[33mSENDING NEW SONG at time %f\033[0m\n", start_time);
-    if (comm_cmds.data) ail_da_free(&comm_cmds);
-    comm_pidi_chunk_idx = 0;
-    comm_time = start_time;
-    comm_cmds = cmds;
-    push_msg(CMSG_NEW_MUSIC);
-    while (pthread_mutex_unlock(&comm_song_mutex) != 0) {}
+    if (!state->playing || state->paused) return state->position_ms;
+    f64 elapsed_ms = ail_time_clock_elapsed(state->time)*1000.0;
+    return state->position_ms + AIL_MIN(elapsed_ms, state->buffered_ms)*state->speed;
+}
+
+void comm_init(void)
+{
+    sem_init(&comm_wakeup, 0, 0);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+#if defined(_POSIX_THREAD_PRIO_INHERIT) && _POSIX_THREAD_PRIO_INHERIT > 0
+    // While the communication thread holds the lock, it runs at the scheduler thread's priority, so that no other thread can keep it from releasing it
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+#endif
+    pthread_mutex_init(&comm_write_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    bool res = comm_transport->init(comm_transport->data);
+    AIL_ASSERT(res); // @TODO: Show error message if something goes wrong
+    if (getenv(COMM_DIRECT_ENV)) comm_direct_wanted = pthread_create(&comm_direct_thread, NULL, comm_direct_main, NULL) == 0;
+}
+
+bool send_new_song(AIL_DA(PidiCmd) cmds, AIL_Buffer pidi, u32 start_time)
+{
+    return push_cmd((CommCmd){ .type = COMM_CMD_SONG, .data = { .song = { .cmds = cmds, .pidi = pidi, .start_time = start_time } } });
+}
+
+void seek_song(u32 time)
+{
+    push_cmd((CommCmd){ .type = COMM_CMD_SEEK, .data = { .seek_time = time } });
 }
 
 void set_paused(bool paused)
 {
-    while (pthread_mutex_lock(&comm_volume_mutex) != 0) {}
-    comm_is_paused = paused;
-    push_msg(CMSG_CONTINUE);
-    while (pthread_mutex_unlock(&comm_volume_mutex) != 0) {}
+    push_cmd((CommCmd){ .type = COMM_CMD_PAUSE, .data = { .paused = paused } });
 }
 
 void set_volume(f32 volume)
 {
-    while (pthread_mutex_lock(&comm_volume_mutex) != 0) {}
-    comm_volume = volume;
-    push_msg(CMSG_VOLUME);
-    while (pthread_mutex_unlock(&comm_volume_mutex) != 0) {}
+    push_cmd((CommCmd){ .type = COMM_CMD_VOLUME, .data = { .volume = volume } });
 }
 
 void set_speed(f32 speed)
 {
-    while (pthread_mutex_lock(&comm_speed_mutex) != 0) {}
-    comm_speed = speed;
-    push_msg(CMSG_SPEED);
-    while (pthread_mutex_unlock(&comm_speed_mutex) != 0) {}
+    push_cmd((CommCmd){ .type = COMM_CMD_SPEED, .data = { .speed = speed } });
 }
 
 void close_comm(void)
 {
-    if (comm_port) {
+    if (comm_port_open) {
         send_msg((ClientMsg) {
             .type = CMSG_CONTINUE,
             .data = { .b = false },
         });
-        CloseHandle(comm_port);
-        comm_port = NULL;
+        comm_close_port();
         comm_is_connected = false;
     }
 }
 
-bool comm_setup_port(void) {
-    COMMTIMEOUTS timeouts = {
-        .ReadIntervalTimeout         = 50,
-        .ReadTotalTimeoutConstant    = 50,
-        .ReadTotalTimeoutMultiplier  = 10,
-        .WriteTotalTimeoutConstant   = 50,
-        .WriteTotalTimeoutMultiplier = 10,
-    };
-    if (!SetCommTimeouts(comm_port, &timeouts)) return false;
-    if (!SetCommMask(comm_port, EV_RXCHAR)) return false;
-    DCB dcb = {
-        .DCBlength       = sizeof(DCB),
-        .BaudRate        = BAUD_RATE,
-        .StopBits        = ONESTOPBIT,
-        .Parity          = (BYTE)PARITY_NONE,
-        .fOutX           = false,
-        .fInX            = false,
-        .EofChar         = EOF,
-        .ByteSize        = 8,
-        .fDtrControl     = DTR_CONTROL_DISABLE,
-        .fRtsControl     = RTS_CONTROL_DISABLE,
-        .fOutxCtsFlow    = 0,
-        .fOutxDsrFlow    = 0,
-        .fDsrSensitivity = 0,
-    };
-    if (!SetupComm(comm_port, 4096, 4096)) return false;
-    if (!SetCommState(comm_port, &dcb)) return false;
-    return true;
+// Starts a reader thread for the port, that was just found by comm_transport->probe
+// If that fails, the port is closed again
+static bool comm_start_reader(void)
+{
+    // Replies from the previous port don't mean anything anymore
+    comm_reply_queue    = (SpscQueue)SPSC_QUEUE_INIT(COMM_REPLY_QUEUE_SIZE);
+    comm_reader_stop    = false;
+    comm_reader_failed  = false;
+    comm_reader_running = pthread_create(&comm_reader, NULL, comm_reader_main, NULL) == 0;
+    if (comm_reader_running) return true;
+    comm_transport->close(comm_transport->data);
+    return false;
 }
 
-// Read all incoming data from the port into the Ring Buffer
-void listen_to_port(void)
+void comm_close_port(void)
 {
-AIL_STATIC_ASSERT(READING_CHUNK_SIZE < AIL_RING_SIZE/2);
-    u8 msg[READING_CHUNK_SIZE] = {0};
-    DWORD read;
-    bool res = ReadFile(comm_port, msg, READING_CHUNK_SIZE, &read, 0);
-    if (comm_is_connected) comm_is_connected = res;
-    ail_ring_writen(&comm_rb, (u8)read, msg);
-    for (u8 i = 0; i < read; i++) printf("%c", msg[i]);
-    // for (u8 i = 0; i < read; i++) printf("Read: %2x\n", msg[i]);
+    if (!comm_port_open) return;
+    pthread_mutex_lock(&comm_write_lock);
+    comm_port_open = false;
+    pthread_mutex_unlock(&comm_write_lock);
+    if (comm_reader_running) {
+        __atomic_store_n(&comm_reader_stop, true, __ATOMIC_RELEASE);
+        comm_transport->wake(comm_transport->data);
+        pthread_join(comm_reader, NULL);
+        comm_reader_running = false;
+    }
+    comm_transport->close(comm_transport->data);
 }
 
-// Checks the Ring Buffer for any SPPP messages
-ServerMsgType check_for_msg(void)
+// Main loop for the reader thread of an open port
+// Reads everything, that arrived, at once and pushes every complete reply to comm_reply_queue right away
+static void *comm_reader_main(void *args)
 {
-    // Go through Ring Buffer to check if any messages were received
-    while (ail_ring_len(comm_rb) >= 4 && (ail_ring_peek4msb(comm_rb) & 0xffffff00) != SPPP_MAGIC) {
-        // printf("Popping off: '%c' (%d)\n", (char)ail_ring_peek(comm_rb), (int)ail_ring_peek(comm_rb))
-        ail_ring_pop(&comm_rb);
+    AIL_UNUSED(args);
+    SpppDecoder decoder = { 0 };
+    u8  buf[READING_CHUNK_SIZE];
+    u32 idx = 0, len = comm_probe.rest_len; // Bytes in buf, that weren't decoded yet, since the queue was full
+    memcpy(buf, comm_probe.rest, len);
+    while (!__atomic_load_n(&comm_reader_stop, __ATOMIC_ACQUIRE)) {
+        i64  slot   = 0;
+        bool parsed = false;
+        while (true) {
+            if (idx == len) {
+                i32 read = comm_transport->read(comm_transport->data, buf, READING_CHUNK_SIZE);
+                if (read < 0) {
+                    __atomic_store_n(&comm_reader_failed, true, __ATOMIC_RELEASE);
+                    sem_post(&comm_wakeup);
+                    return NULL;
+                }
+                if (read == 0) break;
+                idx = 0;
+                len = read;
+                // for (i32 i = 0; i < read; i++) printf("Read: %2x\n", buf[i]);
+            }
+            if ((slot = spsc_queue_reserve(&comm_reply_queue)) < 0) break;
+            bool complete;
+            idx += sppp_decode(&decoder, &buf[idx], len - idx, &comm_reply_slots[slot], &complete);
+            if (complete) {
+                comm_reply_slots[slot].time = ail_time_clock_start();
+                spsc_queue_publish(&comm_reply_queue);
+                parsed = true;
+            }
+        }
+        if (parsed) sem_post(&comm_wakeup);
+        // If the queue is full, the communication thread is already awake and makes space soon
+        comm_transport->wait(comm_transport->data, slot < 0 ? 1 : MSG_TIMEOUT);
+    }
+    return NULL;
+}
+
+// Feeds `len` bytes to the decoder, until a message is complete, in which case `complete` is set and the message is written to `reply`
+// Anything in between messages (i.e. debug output or broken messages) is skipped
+// Returns the amount of bytes, that were consumed - the rest needs to be fed again
+// @Note: No byte is scanned twice, since the state is kept across calls. memchr skips through anything,
+// that can't start a message, which is much faster than checking for the magic at every offset
+static u32 sppp_decode(SpppDecoder *d, const u8 *data, u32 len, CommReply *reply, bool *complete)
+{
+    const u8 magic[3] = { (u8)(SPPP_MAGIC >> 24), (u8)(SPPP_MAGIC >> 16), (u8)(SPPP_MAGIC >> 8) };
+    *complete = false;
+    u32 i = 0;
+    while (i < len) {
+        switch (d->state) {
+            case SPPP_DECODE_MAGIC: {
+                if (!d->matched) {
+                    const u8 *start = memchr(&data[i], magic[0], len - i);
+                    if (!start) return len;
+                    i = start - data + 1;
+                    d->matched = 1;
+                    break;
+                }
+                u8 b = data[i++];
+                // The bytes matched so far might end with a shorter prefix of the magic (only if the magic repeats its first byte)
+                while (d->matched && b != magic[d->matched]) d->matched = (d->matched == 2 && magic[1] == magic[0]) ? 1 : 0;
+                if (b == magic[d->matched]) d->matched++;
+                if (d->matched == AIL_ARRLEN(magic)) {
+                    d->matched = 0;
+                    d->state   = SPPP_DECODE_TYPE;
+                }
+            } break;
+
+            case SPPP_DECODE_TYPE: {
+                d->type = data[i++];
+                d->have = 0;
+                switch (d->type) { // The SPPP extensions aren't part of ServerMsgType
+                    case SMSG_PONG:   d->size = 2;                    break;
+                    case SMSG_CREDIT: d->size = SMSG_CREDIT_SIZE - 4; break;
+                    case SMSG_ACK:    d->size = SMSG_ACK_SIZE - 4;    break;
+                    case SMSG_NAK:    d->size = SMSG_NAK_SIZE - 4;    break;
+                    case SMSG_CAPS:   d->size = SMSG_CAPS_SIZE - 4;   break;
+                    case SMSG_STATUS: d->size = SMSG_STATUS_SIZE - 4; break;
+                    case SMSG_CLOCK:  d->size = SMSG_CLOCK_SIZE - 4;  break;
+                    default:          d->size = 0;                    break;
+                }
+                d->state = SPPP_DECODE_PAYLOAD;
+            } // fallthrough
+
+            case SPPP_DECODE_PAYLOAD: {
+                u32 n = AIL_MIN((u32)(d->size - d->have), len - i);
+                memcpy(&d->payload[d->have], &data[i], n);
+                d->have += n;
+                i       += n;
+                if (d->have < d->size) return i;
+                d->state = SPPP_DECODE_MAGIC;
+
+                AIL_Buffer buf = { .data = d->payload, .idx = 0, .len = d->size, .cap = sizeof(d->payload) };
+                reply->type = (ServerMsgType)d->type;
+                switch (d->type) {
+                    case SMSG_PONG:
+                        reply->data.max_cmds_per_msg = ail_buf_read2lsb(&buf);
+                        break;
+                    case SMSG_CREDIT:
+                        reply->data.credit.received = ail_buf_read2lsb(&buf);
+                        reply->data.credit.window   = ail_buf_read2lsb(&buf);
+                        break;
+                    case SMSG_ACK:
+                        reply->data.ack.seq   = ail_buf_read1(&buf);
+                        reply->data.ack.reply = ail_buf_read1(&buf);
+                        break;
+                    case SMSG_NAK:
+                        reply->data.nak_seq = ail_buf_read1(&buf);
+                        break;
+                    case SMSG_CAPS:
+                        reply->data.caps.version       = ail_buf_read1(&buf);
+                        reply->data.caps.features      = ail_buf_read4lsb(&buf);
+                        reply->data.caps.max_frame     = ail_buf_read2lsb(&buf);
+                        reply->data.caps.window        = ail_buf_read2lsb(&buf);
+                        reply->data.caps.max_baud_rate = ail_buf_read4lsb(&buf);
+                        break;
+                    case SMSG_STATUS:
+                        reply->data.status.session     = ail_buf_read2lsb(&buf);
+                        reply->data.status.received    = ail_buf_read4lsb(&buf);
+                        reply->data.status.buffered_ms = ail_buf_read4lsb(&buf);
+                        break;
+                    case SMSG_CLOCK:
+                        reply->data.clock.query       = ail_buf_read1(&buf);
+                        reply->data.clock.playing     = ail_buf_read1(&buf);
+                        reply->data.clock.clock_us    = ail_buf_read4lsb(&buf);
+                        reply->data.clock.received    = ail_buf_read4lsb(&buf);
+                        reply->data.clock.buffered_us = ail_buf_read4lsb(&buf);
+                        break;
+                    default:
+                        break;
+                }
+                *complete = true;
+                return i;
+            }
+        }
     }
-    if (ail_ring_peek_at(comm_rb, 3) == SMSG_PONG) {
-        if (ail_ring_len(comm_rb) >= 6) {
-            ail_ring_popn(&comm_rb, 4); // Remove magic bytes & type
-            comm_max_cmds_per_msg = ail_ring_read2lsb(&comm_rb);
+    return i;
+}
+
+// Returns false if the reader thread couldn't read from the port anymore
+// @Note: The reader thread reads everything on its own, this only checks whether it is still able to
+bool listen_to_port(void)
+{
+    return !__atomic_load_n(&comm_reader_failed, __ATOMIC_ACQUIRE);
+}
+
+// Blocks until the UI queued a command, the reader thread parsed replies or `timeout_ms` passed
+static void comm_wait(u32 timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    deadline.tv_sec  += timeout_ms / 1000 + deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (sem_timedwait(&comm_wakeup, &deadline) != 0 && errno == EINTR) {}
+}
+
+// Applies the next reply, that the reader thread parsed, to the state of the communication thread
+// Flow control updates (SMSG_CREDIT) are handled right here and are never returned
+ServerMsgType check_for_msg(void)
+{
+    i64 slot;
+    while ((slot = spsc_queue_peek(&comm_reply_queue)) >= 0) {
+        CommReply reply = comm_reply_slots[slot];
+        spsc_queue_pop(&comm_reply_queue);
+        comm_reply_time = reply.time;
+        switch ((u8)reply.type) {
+            case SMSG_PONG:
+                comm_max_cmds_per_msg = reply.data.max_cmds_per_msg;
+                return SMSG_PONG;
+            case SMSG_CREDIT:
+                pthread_mutex_lock(&comm_write_lock);
+                comm_acked_bytes = reply.data.credit.received;
+                comm_window      = reply.data.credit.window;
+                comm_credit_flow = true;
+                pthread_mutex_unlock(&comm_write_lock);
+                break;
+            case SMSG_ACK:
+                if (reply.data.ack.seq == 0 && reply.data.ack.reply == SMSG_PONG) comm_seq_frames = true;
+                else if (reply.data.ack.seq == comm_seq && comm_last_sent.type != CMSG_NONE) return reply.data.ack.reply;
+                // Otherwise the ACK belongs to a message, that was already acknowledged before
+                break;
+            case SMSG_NAK:
+                if (reply.data.nak_seq == comm_seq && comm_last_sent.type != CMSG_NONE) comm_resend_now = true;
+                break;
+            case SMSG_CAPS:
+                comm_ext_version   = AIL_MIN(reply.data.caps.version, SPPP_EXT_VERSION);
+                comm_features      = reply.data.caps.features & SPPP_KNOWN_FEATURES;
+                comm_max_frame     = reply.data.caps.max_frame;
+                comm_max_baud_rate = reply.data.caps.max_baud_rate;
+                if (!comm_credit_flow) {
+                    // Nothing was acknowledged yet, so this only underestimates the available space until the first SMSG_CREDIT
+                    pthread_mutex_lock(&comm_write_lock);
+                    comm_acked_bytes = 0;
+                    comm_window      = reply.data.caps.window;
+                    comm_credit_flow = true;
+                    pthread_mutex_unlock(&comm_write_lock);
+                }
+                comm_caps_pending   = true;
+                comm_status_pending = comm_features & SPPP_FEATURE_RESUME;
+                printf("Arduino supports SPPP extensions v%d (features: %#x, max frame: %d bytes, max baud rate: %d)\n", comm_ext_version, comm_features, comm_max_frame, comm_max_baud_rate);
+                break;
+            case SMSG_STATUS:
+                resume_from_status(reply);
+                // The STATUS is the reply to CMSG_STATUS_QUERY
+                if (comm_last_sent.type == CMSG_STATUS_QUERY) return SMSG_SUCCESS;
+                break;
+            case SMSG_CLOCK:
+                handle_clock(reply);
+                break;
+            default:
+                return reply.type;
         }
-        return SMSG_PONG;
-    } else if (ail_ring_len(comm_rb) >= 4) {
-        ail_ring_popn(&comm_rb, 3); // Remove magic bytes
-        return (ServerMsgType)ail_ring_read(&comm_rb);
     }
     return SMSG_NONE;
 }
 
+// Returns replies that were stashed while waiting for credit first, before checking for new ones
+ServerMsgType next_reply(void)
+{
+    if (!comm_stashed_count) return check_for_msg();
+    CommReply res   = comm_stashed_replies[0];
+    comm_reply_time = res.time;
+    memmove(&comm_stashed_replies[0], &comm_stashed_replies[1], (--comm_stashed_count)*sizeof(CommReply));
+    return res.type;
+}
+
+// Keeps all replies, that arrived so far, for next_reply, except for `expected`, which is returned right away
+// Returns SMSG_NONE if `expected` didn't arrive
+static ServerMsgType stash_reply(ServerMsgType expected)
+{
+    ServerMsgType res;
+    while ((res = check_for_msg()) != SMSG_NONE) {
+        if (expected != SMSG_NONE && res == expected) return res;
+        if (comm_stashed_count < COMM_MAX_STASHED) comm_stashed_replies[comm_stashed_count++] = (CommReply){ .type = res, .time = comm_reply_time };
+    }
+    return SMSG_NONE;
+}
+
+// Blocks for at most MSG_TIMEOUT until the reply `expected` to comm_last_sent arrived
+// Other replies that arrive in the meantime are stashed for next_reply, so that this can be used while music is being streamed
+static bool wait_for_specific_reply(ServerMsgType expected)
+{
+    f64 t = ail_time_clock_start();
+    while (listen_to_port()) {
+        if (stash_reply(expected) == expected) return true;
+        f64 elapsed_ms = ail_time_clock_elapsed(t)*1000.0;
+        if (elapsed_ms >= MSG_TIMEOUT) break;
+        comm_wait((u32)(MSG_TIMEOUT - elapsed_ms) + 1);
+        handle_cmds();
+    }
+    return false;
+}
+
+// Amount of bytes the Arduino currently has space for
+static inline i32 comm_credit(void)
+{
+    return (i32)comm_window - (i32)(u16)(__atomic_load_n(&comm_sent_bytes, __ATOMIC_RELAXED) - comm_acked_bytes);
+}
+
+// Blocks for at most MSG_TIMEOUT until the Arduino has space for at least `needed` bytes
+// Any other replies that arrive in the meantime are stashed for next_reply
+static bool wait_for_credit(i32 needed)
+{
+    f64 t = ail_time_clock_start();
+    while (listen_to_port()) {
+        stash_reply(SMSG_NONE);
+        if (comm_credit() >= needed) return true;
+        f64 elapsed_ms = ail_time_clock_elapsed(t)*1000.0;
+        if (elapsed_ms >= MSG_TIMEOUT) break;
+        comm_wait((u32)(MSG_TIMEOUT - elapsed_ms) + 1);
+        handle_cmds();
+    }
+    return false;
+}
+
 // Blocks for at most MSG_TIMEOUT until a SPPP message was read from the Port or returns SMSG_NONE otherwise
 // Does not check whether comm_is_connected is true
 ServerMsgType wait_for_reply(void)
 {
     f64 t = ail_time_clock_start();
-    while (ail_time_clock_elapsed(t) < (f64)MSG_TIMEOUT/1000.0f) {
-        listen_to_port();
-        ServerMsgType res = check_for_msg();
-        if (res != SMSG_NONE) {
-            return res;
+    while (listen_to_port()) {
+        ServerMsgType res = next_reply();
+        if (res != SMSG_NONE) return res;
+        f64 elapsed_ms = ail_time_clock_elapsed(t)*1000.0;
+        if (elapsed_ms >= MSG_TIMEOUT) break;
+        comm_wait((u32)(MSG_TIMEOUT - elapsed_ms) + 1);
+        handle_cmds();
+    }
+    return SMSG_NONE;
+}
 
+// Writes the given frame to the Arduino without overflowing its receive buffer
+// Each write is a block, that is filled from the frame's parts as it goes, so the first bytes are on their way without encoding or copying the whole frame first
+// If `restart_count` is set (i.e. for PINGs), comm_sent_bytes and comm_acked_bytes start over right after the frame, before the scheduler thread can send anything else
+// comm_write_lock is only held while writing, but never while waiting for the Arduino to have space, so that the scheduler thread isn't kept waiting.
+// The Arduino first needs to have space for the whole frame, so that most frames are written at once.
+// Frames, that are written in several parts, keep the scheduler thread from sending keys in between via comm_frame_open.
+static bool write_frame(const CommFrame *frame, bool restart_count)
+{
+    const u8 *parts[]    = { frame->head,     frame->body,     frame->crc };
+    const u32 part_lens[] = { frame->head_len, frame->body_len, frame->crc_len };
+    u8  block[COMM_WRITE_BLOCK_SIZE];
+    u32 part     = 0;
+    u32 part_idx = 0;
+    u64 len      = frame->len;
+    u64 idx      = 0;
+    i32 needed   = (i32)AIL_MIN(len, comm_window);
+    pthread_mutex_lock(&comm_write_lock);
+    while (comm_credit_flow && comm_credit() < needed) {
+        pthread_mutex_unlock(&comm_write_lock);
+        if (!wait_for_credit(needed)) return false;
+        pthread_mutex_lock(&comm_write_lock);
+    }
+    comm_frame_open = true;
+    bool res = true;
+    while (idx < len) {
+        u32 to_write;
+        if (comm_credit_flow) {
+            // The Arduino told us how much space it has, so we can send that much at once
+            if (comm_credit() <= 0) {
+                pthread_mutex_unlock(&comm_write_lock);
+                res = wait_for_credit(1);
+                pthread_mutex_lock(&comm_write_lock);
+                if (!res) break;
+                continue;
+            }
+            to_write = AIL_MIN(len - idx, (u32)comm_credit());
+            to_write = AIL_MIN(to_write, COMM_WRITE_BLOCK_SIZE);
+        } else {
+            // Without flow control, we can only avoid overflowing the Arduino's receive buffer by sending slowly
+            if (idx > 0) {
+                pthread_mutex_unlock(&comm_write_lock);
+                ail_time_sleep(50);
+                handle_cmds();
+                pthread_mutex_lock(&comm_write_lock);
+            }
+            to_write = AIL_MIN(len - idx, MAX_BYTES_TO_SEND_AT_ONCE);
+        }
+        for (u32 filled = 0; filled < to_write;) {
+            if (part_idx == part_lens[part]) {
+                part++;
+                part_idx = 0;
+                continue;
+            }
+            u32 n = AIL_MIN(to_write - filled, part_lens[part] - part_idx);
+            memcpy(&block[filled], &parts[part][part_idx], n);
+            filled   += n;
+            part_idx += n;
         }
+        // printf("Sending %d bytes...\n", to_write);
+        res = comm_transport->write(comm_transport->data, block, to_write);
+        if (!res) break;
+        idx                   += to_write;
+        comm_total_bytes_sent += to_write;
+        __atomic_add_fetch(&comm_sent_bytes, to_write, __ATOMIC_RELAXED);
     }
-    return SMSG_NONE;
+    if (res && restart_count) {
+        // Both counters start over, even if the PING gets lost, since a stale `received` would leave no credit for the next PING
+        __atomic_store_n(&comm_sent_bytes, 0, __ATOMIC_RELAXED);
+        comm_acked_bytes = 0;
+    }
+    comm_frame_open = false;
+    pthread_mutex_unlock(&comm_write_lock);
+    return res;
+}
+
+// Starts encoding a new frame into comm_frame's head and returns whether it is sequenced
+static bool begin_frame(AIL_Buffer *buffer, ClientMsgType type)
+{
+    *buffer = (AIL_Buffer) {
+        .data = comm_frame.head,
+        .idx  = 0,
+        .len  = 0,
+        .cap  = COMM_FRAME_HEAD_SIZE,
+    };
+    bool sequenced = comm_seq_frames && sppp_is_sequenced(type);
+    if (type == CMSG_PING) comm_seq = 0;
+    if (sequenced) {
+        comm_seq = comm_seq == UINT8_MAX ? 1 : comm_seq + 1;
+        ail_buf_write4msb(buffer, SPPP_MAGIC | type | CMSG_SEQ_FLAG);
+        ail_buf_write1(buffer, comm_seq);
+    } else {
+        ail_buf_write4msb(buffer, SPPP_MAGIC | type);
+    }
+    return sequenced;
+}
+
+// The body is only referenced by the frame and needs to stay unchanged until the frame won't be sent again
+static void end_frame(AIL_Buffer *buffer, bool sequenced, const u8 *body, u32 body_len)
+{
+    comm_frame.head_len = buffer->len;
+    comm_frame.body     = body;
+    comm_frame.body_len = body_len;
+    comm_frame.crc_len  = 0;
+    if (sequenced) {
+        u16 crc = sppp_crc16_update(SPPP_CRC_INIT, &buffer->data[3], buffer->len - 3);
+        crc     = sppp_crc16_update(crc, body, body_len);
+        comm_frame.crc[0]  = crc & 0xff;
+        comm_frame.crc[1]  = crc >> 8;
+        comm_frame.crc_len = SPPP_CRC_SIZE;
+    }
+    comm_frame.len = comm_frame.head_len + comm_frame.body_len + comm_frame.crc_len;
 }
 
 bool send_msg(ClientMsg msg)
 {
 #if 1
     char *msg_str;
-    switch (msg.type) {
+    switch ((u8)msg.type) {
         case CMSG_NONE:      msg_str = "NONE";      break;
         case CMSG_PING:      msg_str = "PING";      break;
         case CMSG_MUSIC:     msg_str = "MUSIC";     break;
@@ -371,29 +1207,30 @@ bool send_msg(ClientMsg msg)
         case CMSG_CONTINUE:  msg_str = "CONTINUE";  break;
         case CMSG_VOLUME:    msg_str = "VOLUME";    break;
         case CMSG_SPEED:     msg_str = "SPEED";     break;
+        case CMSG_STATUS_QUERY: msg_str = "STATUS_QUERY"; break;
     }
     printf("Sending message of type %s to Arduino\n", msg_str);
 #endif
-    static u8 msgBuffer[MAX_CLIENT_MSG_SIZE] = {0};
-    AIL_Buffer buffer = {
-        .data = msgBuffer,
-        .idx  = 0,
-        .len  = 0,
-        .cap  = MAX_CLIENT_MSG_SIZE,
-    };
-    ail_buf_write4msb(&buffer, SPPP_MAGIC | msg.type);
-    switch (msg.type) {
+    encode_msg(msg);
+    comm_last_sent = msg;
+    return resend_last_msg();
+}
+
+// Encodes the message into comm_frame without sending it
+static void encode_msg(ClientMsg msg)
+{
+    AIL_Buffer buffer;
+    bool sequenced = begin_frame(&buffer, msg.type);
+    switch ((u8)msg.type) { // The SPPP extensions aren't part of ClientMsgType
         case CMSG_NEW_MUSIC:
             ail_buf_write1(&buffer, msg.data.pidi.pks_count);
-            encode_played_keys(msg.data.pidi.played_keys, msg.data.pidi.pks_count, buffer.data);
+            encode_played_keys(msg.data.pidi.played_keys, msg.data.pidi.pks_count, &buffer.data[buffer.idx]);
             buffer.idx += SPPP_PK_ENCODED_SIZE*msg.data.pidi.pks_count;
             AIL_FALL_THROUGH();
         case CMSG_MUSIC:
-            printf("Music with %d commands\n", msg.data.pidi.cmds_count);
-            ail_buf_write2lsb(&buffer, msg.data.pidi.cmds_count);
-            for (u32 i = 0; i < msg.data.pidi.cmds_count; i++) {
-                encode_cmd(&buffer, msg.data.pidi.cmds[i]);
-            }
+            // Commands are only ever sent in prepared chunks (see send_prepared_chunk), so these frames stay small
+            AIL_ASSERT(msg.data.pidi.cmds_count == 0);
+            ail_buf_write2lsb(&buffer, 0);
             break;
         case CMSG_CONTINUE:
             ail_buf_write1(&buffer, (u8)msg.data.b);
@@ -402,85 +1239,764 @@ bool send_msg(ClientMsg msg)
         case CMSG_SPEED:
             ail_buf_write4lsb(&buffer, *(u32 *)&msg.data.f);
             break;
+        case CMSG_STATUS_QUERY:
+            break;
         default:
             ail_buf_write4lsb(&buffer, 0);
             break;
     }
+    end_frame(&buffer, sequenced, NULL, 0);
+}
+
+// Sends the next prepared chunk, whose payload becomes the frame's body without being copied
+bool send_prepared_chunk(void)
+{
+    PreparedChunk *chunk = &comm_prepared[comm_prepared_start];
+    printf("Music with %d commands\n", chunk->cmds_count);
+    // The chunk's buffer is kept for resending the frame, while the buffer of the previously sent chunk is reused for preparing the next one
+    PreparedChunk sent = *chunk;
+    *chunk             = comm_sent_chunk;
+    comm_sent_chunk    = sent;
+    chunk              = &comm_sent_chunk;
+    AIL_Buffer buffer;
+    bool sequenced = begin_frame(&buffer, chunk->compact ? CMSG_MUSIC_COMPACT : CMSG_MUSIC);
+    end_frame(&buffer, sequenced, chunk->data, chunk->len);
+    comm_cmds_idx       = chunk->end_idx;
+    update_device_level();
+    comm_device_level_ms += chunk->span_ms/comm_level_speed;
+    comm_sent_song_ms    += chunk->span_ms;
+    comm_device_cmds     += chunk->cmds_count;
+    push_resume_point(chunk->end_idx);
+    comm_prepared_start = (comm_prepared_start + 1)%COMM_PREPARED_CHUNKS;
+    comm_prepared_count--;
+    comm_last_sent = (ClientMsg) {
+        .type = CMSG_MUSIC,
+        .data = { .pidi = { .cmds_count = chunk->cmds_count } },
+    };
+    return resend_last_msg();
+}
+
+// Sends the latest values of the controls, that changed since they were sent the last time
+// Arduinos with SPPP_FEATURE_CONTROL_BATCH get all of them in a single CMSG_CONTROL, others get one message per control
+static bool send_controls(void)
+{
+    bool batch = comm_features & SPPP_FEATURE_CONTROL_BATCH;
+    u8 fields;
+    if (batch) fields = comm_dirty_controls;
+    else if (comm_dirty_controls & SPPP_CONTROL_PLAY) fields = SPPP_CONTROL_PLAY; // Pausing shouldn't wait for the volume or speed
+    else {
+        // Take turns, so that a slider, that is dragged all the time, doesn't keep the other control from ever being sent
+        u8 later = comm_dirty_controls & ~((comm_last_control << 1) - 1);
+        if (!later) later = comm_dirty_controls;
+        fields = later & -later;
+    }
+    comm_last_control = fields;
+    comm_dirty_controls &= ~fields;
+    // A change while the message is on its way sets the flag again, so that the new value is sent afterwards
+    f32 volume = comm_volume;
+    f32 speed  = comm_speed;
+    bool play  = !comm_is_paused;
+    if (fields & SPPP_CONTROL_SPEED) {
+        // The music, that the Arduino already has, now plays faster or slower
+        update_device_level();
+        comm_device_level_ms *= comm_level_speed/speed;
+        comm_level_speed      = speed;
+    }
+    comm_control_frames++;
+    comm_controls_time = ail_time_clock_start();
+    if (!batch) {
+        switch (fields) {
+            case SPPP_CONTROL_VOLUME: return send_msg((ClientMsg){ .type = CMSG_VOLUME,   .data = { .f = volume } });
+            case SPPP_CONTROL_SPEED:  return send_msg((ClientMsg){ .type = CMSG_SPEED,    .data = { .f = speed } });
+            case SPPP_CONTROL_PLAY:   return send_msg((ClientMsg){ .type = CMSG_CONTINUE, .data = { .b = play } });
+            default: AIL_UNREACHABLE(); return true;
+        }
+    }
+
+    printf("Sending controls %#x to Arduino\n", fields);
+    AIL_Buffer buffer;
+    bool sequenced = begin_frame(&buffer, CMSG_CONTROL);
+    ail_buf_write1(&buffer, fields);
+    if (fields & SPPP_CONTROL_VOLUME) ail_buf_write4lsb(&buffer, *(u32 *)&volume);
+    if (fields & SPPP_CONTROL_SPEED)  ail_buf_write4lsb(&buffer, *(u32 *)&speed);
+    if (fields & SPPP_CONTROL_PLAY)   ail_buf_write1(&buffer, play);
+    end_frame(&buffer, sequenced, NULL, 0);
+    comm_last_sent = (ClientMsg){ .type = CMSG_CONTROL };
+    return resend_last_msg();
+}
+
+// Advances the model of the Arduino's buffer level to the current time
+static void update_device_level(void)
+{
+    f64 now = ail_time_clock_start();
+    if (comm_is_music_playing && !comm_is_paused) comm_device_level_ms = AIL_MAX(comm_device_level_ms - (now - comm_level_time)*1000.0, 0.0);
+    comm_level_time = now;
+}
+
+// Remembers that the Arduino has all commands of the current song before `end_idx`, once it received comm_device_cmds commands in total
+static void push_resume_point(u32 end_idx)
+{
+    comm_resume_points[comm_resume_next] = (CommResumePoint){
+        .device_cmds = comm_device_cmds,
+        .end_idx     = end_idx,
+        .song_ms     = comm_sent_song_ms,
+    };
+    comm_resume_next  = (comm_resume_next + 1)%COMM_RESUME_POINTS;
+    comm_resume_count = AIL_MIN(comm_resume_count + 1, COMM_RESUME_POINTS);
+}
+
+// Continues the song from the last chunk, that the Arduino actually received (see SMSG_STATUS)
+// Chunks, that got lost while reconnecting, are simply prepared again, while the Arduino keeps playing what it has
+// Only if the Arduino was reset or too much got lost, the song starts over at the position, that it was estimated to be at
+static void resume_from_status(CommReply reply)
+{
+    comm_status_pending = false;
+    bool same_session   = comm_session_known && reply.data.status.session == comm_session;
+    // The clock of an Arduino, that was reset, started over
+    if (comm_session_known && !same_session) reset_clock();
+    comm_session        = reply.data.status.session;
+    comm_session_known  = true;
+    update_device_level();
+    // A new song is sent from its start anyway and in the direct-drive mode, the Arduino has no music, that the song could continue from
+    if (!comm_is_music_playing || comm_new_song_pending || comm_direct) {
+        comm_device_cmds = reply.data.status.received;
+        return;
+    }
+    i32 age = same_session ? find_resume_point(reply.data.status.received) : -1;
+    if (age >= 0) {
+        CommResumePoint point = comm_resume_points[(comm_resume_next + COMM_RESUME_POINTS - 1 - age)%COMM_RESUME_POINTS];
+        if (age) printf("Continuing the song at %.0fms, since %d chunks got lost\n", point.song_ms, age);
+        comm_resume_next     = (comm_resume_next + COMM_RESUME_POINTS - age)%COMM_RESUME_POINTS;
+        comm_resume_count   -= age;
+        comm_device_cmds     = point.device_cmds;
+        comm_cmds_idx        = point.end_idx;
+        comm_sent_song_ms    = point.song_ms;
+        comm_device_level_ms = reply.data.status.buffered_ms;
+        // Chunks, that were prepared after the lost ones, would leave a gap
+        if (age) {
+            comm_prepared_count = 0;
+            comm_prepared_idx   = comm_cmds_idx;
+            comm_song_prepared  = false;
+        }
+        return;
+    }
+    comm_device_cmds = reply.data.status.received;
+    if (comm_cmds_idx < comm_cmds.len || comm_device_level_ms > 0) {
+        comm_time = (u32)AIL_MAX(comm_sent_song_ms - comm_device_level_ms*comm_level_speed, 0.0);
+        comm_new_song_pending = true;
+        printf("Arduino doesn't have the song anymore, starting it again at %ums\n", comm_time);
+    }
+}
+
+// Returns how many chunks were sent after the Arduino had received `device_cmds` commands in total or -1 if that isn't remembered
+static i32 find_resume_point(u32 device_cmds)
+{
+    for (u8 age = 0; age < comm_resume_count; age++) {
+        if (comm_resume_points[(comm_resume_next + COMM_RESUME_POINTS - 1 - age)%COMM_RESUME_POINTS].device_cmds == device_cmds) return age;
+    }
+    return -1;
+}
+
+// Forgets everything about the Arduino's clock, i.e. because it might be a different one now
+static void reset_clock(void)
+{
+    comm_clock_count = 0;
+    comm_clock_drift = 0;
+    comm_clock_valid = false;
+}
+
+// Extends the Arduino's `clock_us` to 64 bits, which works as long as it reports at least every half hour
+static u64 extend_device_clock(u32 clock_us)
+{
+    if (!comm_clock_count) comm_device_clock_us = clock_us;
+    else comm_device_clock_us += (i32)(clock_us - (u32)comm_device_clock_us);
+    return comm_device_clock_us;
+}
+
+// Converts a timestamp of the Arduino to the time on our clock, at which it was taken
+static f64 device_to_host_time(u64 device_us)
+{
+    return (device_us/1e6 - comm_clock_offset + comm_clock_drift*comm_clock_anchor)/(1.0 + comm_clock_drift);
+}
+
+// Estimates the offset between both clocks from a round trip, that was sent at `sent` and answered at `received`, like NTP does
+// The time it took to transmit the bytes at the current baud rate is taken out, since the reply is much longer than the query
+// Like NTP, only the samples with the shortest round trips are trusted, since their timestamps were delayed the least
+// Once they cover enough time, the drift between both clocks is estimated by fitting a line through their offsets
+static void add_clock_sample(f64 sent, f64 received, u64 device_us)
+{
+    f64 query_s = (4 + 1)*10.0/comm_baud_rate;
+    f64 reply_s = SMSG_CLOCK_SIZE*10.0/comm_baud_rate;
+    CommClockSample sample = {
+        .host = (sent + query_s + received - reply_s)/2,
+        .rtt  = AIL_MAX(received - sent - query_s - reply_s, 0.0),
+    };
+    sample.offset = device_us/1e6 - sample.host;
+    comm_clock_samples[comm_clock_next] = sample;
+    comm_clock_next  = (comm_clock_next + 1)%COMM_CLOCK_SAMPLES;
+    comm_clock_count = AIL_MIN(comm_clock_count + 1, COMM_CLOCK_SAMPLES);
+
+    f64 min_rtt = sample.rtt;
+    for (u8 i = 0; i < comm_clock_count; i++) min_rtt = AIL_MIN(min_rtt, comm_clock_samples[i].rtt);
+    f64 max_rtt = 2*min_rtt + COMM_CLOCK_RTT_SLACK;
+    f64 n = 0, mean_host = 0, mean_offset = 0, first = received, last = 0;
+    for (u8 i = 0; i < comm_clock_count; i++) {
+        CommClockSample *s = &comm_clock_samples[i];
+        if (s->rtt > max_rtt) continue;
+        n++;
+        mean_host   += s->host;
+        mean_offset += s->offset;
+        first = AIL_MIN(first, s->host);
+        last  = AIL_MAX(last,  s->host);
+    }
+    mean_host   /= n;
+    mean_offset /= n;
+    if (last - first >= COMM_CLOCK_MIN_SPAN) {
+        f64 sxx = 0, sxy = 0;
+        for (u8 i = 0; i < comm_clock_count; i++) {
+            CommClockSample *s = &comm_clock_samples[i];
+            if (s->rtt > max_rtt) continue;
+            sxx += (s->host - mean_host)*(s->host - mean_host);
+            sxy += (s->host - mean_host)*(s->offset - mean_offset);
+        }
+        comm_clock_drift = AIL_CLAMP(sxy/sxx, -COMM_CLOCK_MAX_DRIFT, COMM_CLOCK_MAX_DRIFT);
+    }
+    comm_clock_anchor = mean_host;
+    comm_clock_offset = mean_offset;
+}
+
+// Applies an SMSG_CLOCK, which tells where exactly the Arduino was in the song, once both clocks were compared
+// The Arduino was at the end of the chunk, after which it had received `received` commands, minus what it still had buffered
+static void handle_clock(CommReply reply)
+{
+    u64 device_us = extend_device_clock(reply.data.clock.clock_us);
+    if (reply.data.clock.query && reply.data.clock.query == comm_clock_query_id) add_clock_sample(comm_clock_query_time, comm_reply_time, device_us);
+    if (!comm_clock_count || !comm_is_music_playing || comm_new_song_pending) return;
+    i32 age = find_resume_point(reply.data.clock.received);
+    if (age < 0) return;
+    CommResumePoint *point = &comm_resume_points[(comm_resume_next + COMM_RESUME_POINTS - 1 - age)%COMM_RESUME_POINTS];
+    f64 buffered_ms        = reply.data.clock.buffered_us/1000.0;
+    comm_clock_valid       = true;
+    comm_clock_playing     = reply.data.clock.playing;
+    comm_clock_time        = device_to_host_time(device_us);
+    comm_clock_pos_ms      = point->song_ms - buffered_ms*comm_level_speed;
+    comm_clock_buffered_ms = buffered_ms;
+    // If the Arduino has all chunks, that were sent, the estimate of its buffer level doesn't need to drift anymore
+    if (age == 0) {
+        update_device_level();
+        f64 elapsed_ms       = comm_clock_playing ? AIL_MAX(comm_level_time - comm_clock_time, 0.0)*1000.0 : 0.0;
+        comm_device_level_ms = AIL_MAX(buffered_ms - elapsed_ms, 0.0);
+    }
+}
+
+// Direct-drive mode: instead of streaming chunks, that the Arduino buffers and plays on its own, we send every key right when it should be played
+// The communication thread schedules the keys of the next COMM_DIRECT_AHEAD_MS into comm_direct_queue (see direct_fill),
+// from which the scheduler thread (see comm_direct_main) sends them at their time, while running at a real-time priority (see rt.c).
+// The Arduino thus needs next to no buffer, but every hiccup of the host or the link is heard right away.
+// Volume and speed are applied to the keys, when they are scheduled. Pausing or jumping in the song drops all scheduled keys by incrementing comm_direct_gen.
+
+// Maps a time in the song to rt_now's clock, using the timeline of the keys, that are scheduled from now on
+static inline f64 direct_time(f64 song_ms)
+{
+    return comm_direct_timeline.base_time + (song_ms - comm_direct_timeline.base_ms)/comm_direct_timeline.speed/1000.0;
+}
+
+// Maps a time on rt_now's clock to the time in the song
+static f64 direct_song_ms(f64 t)
+{
+    DirectTimeline tl = t < comm_direct_timeline.base_time ? comm_direct_prev_timeline : comm_direct_timeline;
+    return tl.base_ms + (t - tl.base_time)*tl.speed*1000.0;
+}
+
+static f64 direct_position_ms(void)
+{
+    if (comm_direct_paused) return comm_direct_pause_ms;
+    f64 song_ms = direct_song_ms(rt_now());
+    return AIL_CLAMP(song_ms, (f64)comm_time, comm_direct_sched_ms);
+}
+
+static void direct_push(f64 song_ms, i8 octave, u8 key, u8 velocity)
+{
+    i64 slot = spsc_queue_reserve(&comm_direct_queue);
+    AIL_ASSERT(slot >= 0); // Callers check for free slots first
+    comm_direct_slots[slot] = (DirectEvent){
+        .time     = direct_time(song_ms),
+        .gen      = comm_direct_gen,
+        .octave   = octave,
+        .key      = key,
+        .velocity = velocity,
+    };
+    spsc_queue_publish(&comm_direct_queue);
+}
+
+// Schedules a key to be pressed at `song_ms` and released `len_ms` later, if there's space for both events
+// A key, that is still held, is released right before, so that it is struck again
+static void direct_press(f64 song_ms, i8 octave, u8 key, u8 velocity, u32 len_ms)
+{
+    if (comm_volume <= 0 || spsc_queue_free(&comm_direct_queue) < 2) return;
+    for (u32 i = 0; i < comm_direct_held_count; i++) {
+        if (comm_direct_held[i].octave == octave && comm_direct_held[i].key == key) {
+            direct_push(song_ms, octave, key, 0);
+            comm_direct_held[i] = comm_direct_held[--comm_direct_held_count];
+            break;
+        }
+    }
+    if (comm_direct_held_count == COMM_DIRECT_MAX_HELD) return;
+    f32 scaled = velocity*comm_volume + 0.5f;
+    direct_push(song_ms, octave, key, (u8)AIL_CLAMP(scaled, 1.0f, (f32)MAX_VELOCITY));
+    comm_direct_held[comm_direct_held_count++] = (DirectKey){ .song_ms = song_ms + len_ms, .octave = octave, .key = key };
+}
+
+// Starts playing the current song from comm_time in the direct-drive mode
+// `prev_cmd_time` is the time in the song of the command before comm_cmds_idx
+static void direct_start(u32 prev_cmd_time)
+{
+    // The scheduler thread releases the keys of the previous song or position
+    __atomic_add_fetch(&comm_direct_gen, 1, __ATOMIC_RELEASE);
+    comm_direct_held_count = 0;
+    comm_direct_prev_ms    = prev_cmd_time;
+    comm_direct_sched_ms   = comm_time;
+    comm_direct_paused     = comm_is_paused;
+    comm_direct_pause_ms   = comm_time;
+    comm_direct_timeline   = (DirectTimeline){ .base_time = rt_now() + COMM_DIRECT_START_MS/1000.0, .base_ms = comm_time, .speed = comm_speed };
+    comm_direct_prev_timeline = comm_direct_timeline;
+    comm_level_speed       = comm_speed;
+    comm_is_music_playing  = true;
+    comm_dirty_controls    = 0; // The controls only matter for the keys, which are scheduled with the latest values anyway
+    if (comm_direct_paused) return;
+    // Keys, that were pressed before comm_time and are still held there, are struck right at the start
+    for (u32 i = 0; i < comm_played_keys.len; i++) {
+        PlayedKeySPPP pk = comm_played_keys.data[i];
+        direct_press(comm_time, pk.octave, pk.key, pk.velocity, pk.len*LEN_FACTOR);
+    }
+    direct_fill();
+}
 
-    // @Cleanup
-    // printf("Writing message '");
-    // for (u8 i = 4; i < 8; i++) printf("%c", buffer.data[i]);
-    // printf("' (%lld bytes)...\n", buffer.len);
-    static int i = 0;
-    if (msg.type == CMSG_MUSIC || msg.type == CMSG_NEW_MUSIC) {
-        char buf[16];
-        sprintf(buf, "msg-%d.buf", i++);
-        ail_fs_write_file(buf, (char*)msgBuffer, buffer.len);
-    }
-    // printf("Writing message '");
-    // for (u8 i = 0; i < 8; i++) printf("%c", buffer.data[i]);
-    // for (u8 i = 8; i < buffer.len; i++) printf(" %u", buffer.data[i]);
-    // printf("'\n");
-
-    DWORD written;
-    u64 buffer_idx = 0;
-    u32 toWrite    = 1; // Set to 1, to enter the loop at least once
+// Schedules all keys, that are due within the next COMM_DIRECT_AHEAD_MS
+// Releases come before presses at the same time, so that a key, that is played again right away, is struck again
+static void direct_fill(void)
+{
+    if (!comm_is_music_playing || comm_direct_paused || comm_new_song_pending) return;
+    f64 horizon_ms = direct_song_ms(rt_now() + COMM_DIRECT_AHEAD_MS/1000.0);
+    while (spsc_queue_free(&comm_direct_queue) >= 2) {
+        u32 off = UINT32_MAX;
+        for (u32 i = 0; i < comm_direct_held_count; i++) {
+            if (off == UINT32_MAX || comm_direct_held[i].song_ms < comm_direct_held[off].song_ms) off = i;
+        }
+        bool has_on = comm_cmds_idx < comm_cmds.len;
+        if (!has_on && off == UINT32_MAX) return; // The song is over
+        f64 on_ms = has_on ? comm_direct_prev_ms + comm_cmds.data[comm_cmds_idx].dt : 0;
+        if (off != UINT32_MAX && (!has_on || comm_direct_held[off].song_ms <= on_ms)) {
+            DirectKey held = comm_direct_held[off];
+            if (held.song_ms > horizon_ms) break;
+            comm_direct_held[off] = comm_direct_held[--comm_direct_held_count];
+            direct_push(held.song_ms, held.octave, held.key, 0);
+            comm_direct_sched_ms = AIL_MAX(comm_direct_sched_ms, held.song_ms);
+        } else {
+            if (on_ms > horizon_ms) break;
+            PidiCmd cmd = comm_cmds.data[comm_cmds_idx++];
+            comm_direct_prev_ms  = on_ms;
+            comm_direct_sched_ms = AIL_MAX(comm_direct_sched_ms, on_ms);
+            direct_press(on_ms, cmd.octave, cmd.key, cmd.velocity, cmd.len*LEN_FACTOR);
+        }
+    }
+    // Nothing else is due before the horizon, unless the queue is full
+    if (spsc_queue_free(&comm_direct_queue) >= 2) comm_direct_sched_ms = AIL_MAX(comm_direct_sched_ms, horizon_ms);
+}
+
+// Applies the control values, that the UI changed, to the keys, that are scheduled from now on
+static void direct_apply_controls(void)
+{
+    if (!comm_dirty_controls) return;
+    if ((comm_dirty_controls & SPPP_CONTROL_SPEED) && comm_is_music_playing && !comm_direct_paused && !comm_new_song_pending) {
+        // The keys, that are scheduled already, keep their time, so the new speed starts right after them
+        f64 base_time = AIL_MAX(direct_time(comm_direct_sched_ms), rt_now());
+        f64 base_ms   = direct_song_ms(base_time);
+        comm_direct_prev_timeline = comm_direct_timeline;
+        comm_direct_timeline      = (DirectTimeline){ .base_time = base_time, .base_ms = base_ms, .speed = comm_speed };
+    }
+    if ((comm_dirty_controls & SPPP_CONTROL_PLAY) && comm_is_music_playing && !comm_new_song_pending && comm_is_paused != comm_direct_paused) {
+        if (comm_is_paused) {
+            comm_direct_pause_ms = direct_position_ms();
+            comm_direct_paused   = true;
+            __atomic_add_fetch(&comm_direct_gen, 1, __ATOMIC_RELEASE);
+        } else {
+            // Continuing works like jumping to the same time, so that the keys, that were held when pausing, are struck again
+            comm_time = (u32)comm_direct_pause_ms;
+            comm_new_song_pending = true;
+        }
+    }
+    comm_level_speed    = comm_speed;
+    comm_dirty_controls = 0;
+}
+
+// Sends the keys in a single CMSG_KEYS frame, which isn't answered, so nothing is waited for
+// Only if the Arduino has no space for the frame or the communication thread is in the middle of a frame, the keys are sent afterwards, which makes them late
+// If the keys were due at `due` (on rt_now's clock), how late they are is added to comm_direct_jitter
+static void direct_send_keys(const DirectEvent *events, u32 n, f64 due)
+{
+    u8 frame[4 + 1 + SPPP_KEY_ENCODED_SIZE*COMM_DIRECT_MAX_KEYS];
+    AIL_Buffer buffer = { .data = frame, .idx = 0, .len = 0, .cap = sizeof(frame) };
+    ail_buf_write4msb(&buffer, SPPP_MAGIC | CMSG_KEYS);
+    ail_buf_write1(&buffer, n);
+    for (u32 i = 0; i < n; i++) {
+        ail_buf_write1(&buffer, (u8)events[i].octave);
+        ail_buf_write1(&buffer, events[i].key);
+        ail_buf_write1(&buffer, events[i].velocity);
+    }
+    pthread_mutex_lock(&comm_write_lock);
+    // Overflowing the Arduino's receive buffer would garble the keys together with the frames around them
+    while (comm_port_open && (comm_frame_open || (comm_credit_flow && comm_credit() < (i32)AIL_MIN(buffer.len, comm_window)))) {
+        pthread_mutex_unlock(&comm_write_lock);
+        rt_sleep_until(rt_now() + COMM_DIRECT_BATCH_US/1e6);
+        pthread_mutex_lock(&comm_write_lock);
+    }
+    // Without a port, the keys are lost - the communication thread continues the song after reconnecting
+    if (comm_port_open) {
+        if (due) rt_jitter_add(&comm_direct_jitter, (rt_now() - due)*1e6);
+        if (comm_transport->write(comm_transport->data, frame, buffer.len)) {
+            comm_total_bytes_sent += buffer.len;
+            comm_direct_frames++;
+            __atomic_add_fetch(&comm_sent_bytes, buffer.len, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&comm_write_lock);
+}
+
+// Main loop for the scheduler thread of the direct-drive mode
+// It only ever waits for the next key's time, for the Arduino to have space for the keys
+// or for comm_write_lock, which the communication thread only holds while writing a frame (see write_frame)
+static void *comm_direct_main(void *args)
+{
+    AIL_UNUSED(args);
+    if (!rt_make_realtime()) printf("Failed to get a real-time priority, so keys might be late while the system is busy\n");
+    DirectEvent batch[COMM_DIRECT_MAX_KEYS];
+    DirectKey held[COMM_DIRECT_MAX_HELD]; // Only `octave` and `key` are used
+    u32 held_count = 0;
+    u32 gen        = 0;
     while (true) {
-        toWrite = AIL_MIN(buffer.len - buffer_idx, MAX_BYTES_TO_SEND_AT_ONCE);
-        if (!toWrite) break;
-        // printf("Sending %d bytes...\n", toWrite);
-        bool res = WriteFile(comm_port, &buffer.data[buffer_idx], toWrite, &written, 0);
-        AIL_ASSERT(res);
-        AIL_ASSERT(written == toWrite);
-        buffer_idx += toWrite;
-        if (buffer_idx < buffer.len) ail_time_sleep(50);
+        u32 latest_gen = __atomic_load_n(&comm_direct_gen, __ATOMIC_ACQUIRE);
+        if (latest_gen != gen) {
+            // The keys of the previous song or position are released right away
+            gen = latest_gen;
+            while (held_count) {
+                u32 n = 0;
+                for (; held_count && n < COMM_DIRECT_MAX_KEYS; n++) {
+                    DirectKey k = held[--held_count];
+                    batch[n] = (DirectEvent){ .octave = k.octave, .key = k.key, .velocity = 0 };
+                }
+                direct_send_keys(batch, n, 0);
+            }
+        }
+        i64 slot = spsc_queue_peek(&comm_direct_queue);
+        if (slot < 0) {
+            rt_sleep_until(rt_now() + COMM_DIRECT_POLL_MS/1000.0);
+            continue;
+        }
+        DirectEvent next = comm_direct_slots[slot];
+        if (next.gen != gen) {
+            // Events of a newer generation are only sent, once the keys of the older one were released
+            if ((i32)(next.gen - gen) < 0) spsc_queue_pop(&comm_direct_queue);
+            continue;
+        }
+        f64 now = rt_now();
+        if (next.time > now) {
+            rt_sleep_until(AIL_MIN(next.time, now + COMM_DIRECT_POLL_MS/1000.0));
+            continue;
+        }
+        u32 n = 0;
+        while (n < COMM_DIRECT_MAX_KEYS && (slot = spsc_queue_peek(&comm_direct_queue)) >= 0) {
+            DirectEvent e = comm_direct_slots[slot];
+            if (e.gen != gen || e.time > now + COMM_DIRECT_BATCH_US/1e6) break;
+            spsc_queue_pop(&comm_direct_queue);
+            batch[n++] = e;
+            u32 i = 0;
+            while (i < held_count && (held[i].octave != e.octave || held[i].key != e.key)) i++;
+            if (!e.velocity && i < held_count) held[i] = held[--held_count];
+            else if (e.velocity && i == held_count && held_count < COMM_DIRECT_MAX_HELD) held[held_count++] = (DirectKey){ .octave = e.octave, .key = e.key };
+        }
+        direct_send_keys(batch, n, batch[0].time);
     }
-    comm_last_sent = msg;
+    return NULL;
+}
+
+// Copies `keep` of the `n` commands into `out`, skipping the least audible ones (quiet and short notes)
+// The delta times of skipped commands are added to the next kept one and the last command is always kept, so that the timing stays the same
+// @Note: Merged delta times can't overflow, since commands are only skipped in chunks, that play for a very short time
+static void decimate_cmds(PidiCmd *out, const PidiCmd *cmds, u32 n, u32 keep)
+{
+    #define DECIMATE_SCORE(cmd) ((u32)(cmd).velocity*((u32)(cmd).len + 1))
+    // Find the lowest score `t`, such that at most keep - 1 commands besides the last have a score of at least `t`
+    u32 lo = 0, hi = (MAX_VELOCITY + 1)*(UINT8_MAX + 2);
+    while (lo < hi) {
+        u32 t = (lo + hi)/2, count = 0;
+        for (u32 i = 0; i + 1 < n; i++) count += DECIMATE_SCORE(cmds[i]) >= t;
+        if (count <= keep - 1) hi = t;
+        else                   lo = t + 1;
+    }
+    u32 t = lo;
+    u32 above = 0;
+    for (u32 i = 0; i + 1 < n; i++) above += DECIMATE_SCORE(cmds[i]) >= t;
+    // Commands just below the threshold fill up the remaining slots in order
+    u32 at_threshold = keep - 1 - above;
+    u32 carry_dt     = 0;
+    u32 kept_count   = 0;
+    for (u32 i = 0; i < n; i++) {
+        PidiCmd cmd = cmds[i];
+        u32 score   = DECIMATE_SCORE(cmd);
+        bool kept   = i + 1 == n || score >= t || (t > 0 && score == t - 1 && at_threshold && at_threshold--);
+        if (kept) {
+            cmd.dt  += carry_dt;
+            carry_dt = 0;
+            out[kept_count++] = cmd;
+        } else {
+            carry_dt += cmd.dt;
+        }
+    }
+    #undef DECIMATE_SCORE
+}
+
+// Encodes the payload of a music chunk (cmds_count & commands) and returns whether it is meant for CMSG_MUSIC_COMPACT
+// The compact encoding is only used, if the Arduino supports it and if it actually is smaller
+// If `wire` holds the same commands already encoded like encode_cmd does, they are simply copied from there
+static bool encode_chunk(AIL_Buffer *buffer, const PidiCmd *cmds, const u8 *wire, u32 n)
+{
+    buffer->idx = 0;
+    buffer->len = 0;
+    ail_buf_write2lsb(buffer, n);
+    if (comm_features & SPPP_FEATURE_COMPACT_MUSIC) {
+        ail_buf_write2lsb(buffer, 0); // Size of the encoded commands - filled in below
+        u32 plain_len = 2 + 4*n;
+        if (compact_encode_cmds(buffer, cmds, n, plain_len)) {
+            buffer->idx = 2;
+            ail_buf_write2lsb(buffer, buffer->len - 4);
+            buffer->idx = buffer->len;
+            return true;
+        }
+        buffer->idx = 2;
+        buffer->len = 2;
+    }
+    if (wire) ail_buf_writestr(buffer, (const char *)wire, 4*n);
+    else for (u32 i = 0; i < n; i++) encode_cmd(buffer, cmds[i]);
+    return false;
+}
+
+// Encodes the next chunks of the current song ahead of time, so that a REQUEST can be answered right away
+// Chunks are kept as small as possible while still playing for COMM_CHUNK_RTTS round trips (but at least COMM_MIN_CHUNK_MS),
+// so that the Arduino's receive buffer stays free for other messages
+void prepare_chunks(void)
+{
+    if (!comm_max_cmds_per_msg || comm_song_prepared || comm_prepared_count == COMM_PREPARED_CHUNKS) return;
+    // The chunk's play time is measured in song time, which passes faster than real time at higher speeds
+    u32 target_ms = comm_srtt_ms ? (u32)(AIL_MAX(COMM_CHUNK_RTTS*comm_srtt_ms, COMM_MIN_CHUNK_MS)*comm_speed) : UINT32_MAX;
+    while (comm_prepared_count < COMM_PREPARED_CHUNKS && comm_prepared_idx < comm_cmds.len) {
+        PreparedChunk *chunk = &comm_prepared[(comm_prepared_start + comm_prepared_count)%COMM_PREPARED_CHUNKS];
+        u32 cap = 4 + 4*comm_max_cmds_per_msg + COMPACT_MAX_CMD_SIZE;
+        if (chunk->cap < cap) {
+            chunk->data = realloc(chunk->data, cap);
+            chunk->cap  = cap;
+        }
+        u32 max_cmds = AIL_MIN(comm_cmds.len - comm_prepared_idx, comm_max_cmds_per_msg);
+        // Even without the compact encoding, the chunk's frame needs to fit into the Arduino's receive buffer
+        if (comm_max_frame) max_cmds = AIL_MIN(max_cmds, (u32)(AIL_MAX(comm_max_frame, COMM_MUSIC_FRAME_OVERHEAD + 4) - COMM_MUSIC_FRAME_OVERHEAD)/4);
+        u32 n = 0, play_ms = 0;
+        while (n < max_cmds && play_ms < target_ms) play_ms += comm_cmds.data[comm_prepared_idx + n++].dt;
+        AIL_Buffer buffer = { .data = chunk->data, .idx = 0, .len = 0, .cap = chunk->cap };
+        bool compact = encode_chunk(&buffer, &comm_cmds.data[comm_prepared_idx], comm_wire ? &comm_wire[4*comm_prepared_idx] : NULL, n);
+
+        // If the link can't carry the chunk while it plays, the least audible notes are skipped
+        // The last chunk is never thinned out, since it might just be short because the song ends
+        // Neither are chunks without any play time, since they only hold up the song instead of falling behind it
+        u32 budget = (u32)(play_ms/comm_speed/1000.0f*comm_link_bps*COMM_LINK_HEADROOM);
+        bool fits  = buffer.len <= budget || !play_ms || comm_prepared_idx + n >= comm_cmds.len;
+        u32  keep  = n;
+        if (!fits) {
+            if (comm_kept_cap < n) {
+                comm_kept_cmds = realloc(comm_kept_cmds, n*sizeof(PidiCmd));
+                comm_kept_cap  = n;
+            }
+            // Compact commands differ in size, so the estimate is corrected until the chunk fits
+            for (u32 tries = 0; tries < 4 && buffer.len > budget && keep > 1; tries++) {
+                f32 cmd_size = (f32)buffer.len/keep;
+                keep    = AIL_CLAMP((u32)(budget/cmd_size), 1, keep - 1);
+                decimate_cmds(comm_kept_cmds, &comm_cmds.data[comm_prepared_idx], n, keep);
+                compact = encode_chunk(&buffer, comm_kept_cmds, NULL, keep);
+            }
+        }
+        comm_link_overloaded = !fits;
+        comm_prepared_idx   += n;
+        chunk->len         = buffer.len;
+        chunk->cmds_count  = keep;
+        chunk->span_ms     = play_ms;
+        chunk->end_idx     = comm_prepared_idx;
+        chunk->compact     = compact;
+        comm_prepared_count++;
+    }
+    comm_song_prepared = comm_prepared_idx >= comm_cmds.len;
+}
+
+// Switches to the highest baud rate, that both sides support (see CMSG_BAUD_RATE in header.h)
+// If anything goes wrong, both sides go back to BAUD_RATE and no other baud rate is tried until a port is opened again
+// Returns false if the Arduino needs to be found again
+static bool switch_baud_rate(void)
+{
+    static const u32 baud_rates[] = { 2000000, 1000000, 500000, 460800, 230400 };
+    u32 baud_rate = 0;
+    for (u32 i = 0; i < AIL_ARRLEN(baud_rates) && !baud_rate; i++) {
+        if (baud_rates[i] <= comm_max_baud_rate) baud_rate = baud_rates[i];
+    }
+    if (comm_baud_failed || baud_rate <= comm_baud_rate) return true;
+    printf("Switching to %d baud\n", baud_rate);
+
+    AIL_Buffer buffer;
+    bool sequenced = begin_frame(&buffer, CMSG_BAUD_RATE);
+    ail_buf_write4lsb(&buffer, baud_rate);
+    end_frame(&buffer, sequenced, NULL, 0);
+    comm_last_sent = (ClientMsg){ .type = CMSG_BAUD_RATE };
+    if (!resend_last_msg()) return false;
+    bool accepted  = wait_for_specific_reply(SMSG_SUCCESS);
+    comm_last_sent = (ClientMsg){0};
+    if (accepted) {
+        // Anything the Arduino sent right before switching needs to be read before we switch as well
+        ail_time_sleep(COMM_BAUD_SWITCH_MS);
+        if (!listen_to_port()) return false;
+        stash_reply(SMSG_NONE);
+        pthread_mutex_lock(&comm_write_lock);
+        bool switched = comm_transport->set_baud_rate(comm_transport->data, baud_rate);
+        pthread_mutex_unlock(&comm_write_lock);
+        if (switched) {
+            comm_baud_rate = baud_rate;
+            if (send_msg((ClientMsg){ .type = CMSG_PING }) && wait_for_specific_reply(SMSG_PONG)) {
+                comm_last_sent = (ClientMsg){0};
+                comm_link_bps  = baud_rate/10;
+                return true;
+            }
+            comm_last_sent = (ClientMsg){0};
+            pthread_mutex_lock(&comm_write_lock);
+            comm_transport->set_baud_rate(comm_transport->data, BAUD_RATE);
+            pthread_mutex_unlock(&comm_write_lock);
+            comm_baud_rate = BAUD_RATE;
+        }
+    }
+    // If the Arduino switched, it goes back to BAUD_RATE once it didn't receive a valid frame for SPPP_BAUD_CONFIRM_MS
+    printf("Failed to switch to %d baud\n", baud_rate);
+    comm_baud_failed = true;
+    ail_time_sleep(SPPP_BAUD_CONFIRM_MS);
+    return false;
+}
+
+// Writes the frame of comm_last_sent, which is still stored in comm_frame, to the Arduino (again)
+bool resend_last_msg(void)
+{
+    comm_resend_now  = false;
+    comm_queried_ack = false;
+    if (!write_frame(&comm_frame, comm_last_sent.type == CMSG_PING)) return false;
+    last_comm_time = ail_time_clock_start();
+    return true;
+}
+
+// Asks the Arduino for the SMSG_ACK of the last frame it executed, without changing comm_last_sent
+bool send_ack_query(void)
+{
+    CommFrame frame = { .head_len = 4, .len = 4 };
+    AIL_Buffer buffer = { .data = frame.head, .idx = 0, .len = 0, .cap = sizeof(frame.head) };
+    ail_buf_write4msb(&buffer, SPPP_MAGIC | CMSG_ACK_QUERY);
+    comm_queried_ack = true;
+    if (!write_frame(&frame, false)) return false;
     last_comm_time = ail_time_clock_start();
     return true;
 }
 
-// @Note: Updates comm_port
+// Sends a CMSG_CLOCK_QUERY without changing comm_last_sent, since its reply is only matched by its `id`
+static bool send_clock_query(void)
+{
+    comm_clock_query_id = comm_clock_query_id == UINT8_MAX ? 1 : comm_clock_query_id + 1;
+    CommFrame frame = { .head_len = 5, .len = 5 };
+    AIL_Buffer buffer = { .data = frame.head, .idx = 0, .len = 0, .cap = sizeof(frame.head) };
+    ail_buf_write4msb(&buffer, SPPP_MAGIC | CMSG_CLOCK_QUERY);
+    ail_buf_write1(&buffer, comm_clock_query_id);
+    comm_clock_query_time = ail_time_clock_start();
+    return write_frame(&frame, false);
+}
+
+// @Note: Updates comm_port_open
 void find_server_port(AIL_Allocator *allocator)
 {
     ClientMsg ping = { .type = CMSG_PING };
-    if (comm_port) {
+    if (comm_port_open) {
         if (send_msg(ping) && wait_for_reply() == SMSG_PONG) {
             comm_last_sent = (ClientMsg){0};
             return;
         }
-        CloseHandle(comm_port);
-        comm_port = NULL;
-    }
-
-    unsigned long ports_amount = 0;
-    unsigned long required_size;
-    bool res = EnumPorts(NULL, 2, NULL, 0, &required_size, &ports_amount);
-    PORT_INFO_2 *ports = allocator->alloc(allocator->data, required_size);
-    AIL_ASSERT(ports != NULL);
-    res = EnumPorts(NULL, 2, (u8 *)ports, required_size, &required_size, &ports_amount);
-    if (res == 0) {
-        AIL_DBG_PRINT("Error in enumerating ports: %ld\n", GetLastError());
-        goto done;
-    }
-
-    for (unsigned long i = 0; i < ports_amount; i++) {
-        PORT_INFO_2 port = ports[i];
-        bool port_is_rw  = port.fPortType & PORT_TYPE_READ && port.fPortType & PORT_TYPE_WRITE;
-        bool port_is_usb = strlen(port.pPortName) >= 3 && memcmp(port.pPortName, "COM", 3) == 0;
-        if (port_is_rw && port_is_usb) {
-            comm_port = CreateFile(port.pPortName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL|FILE_SHARE_READ|FILE_SHARE_WRITE, 0);
-            if (comm_port != INVALID_HANDLE_VALUE && comm_setup_port()) {
-                // printf("Checking port '%s'...\n", port.pPortName);
-                if (send_msg(ping) && wait_for_reply() == SMSG_PONG) {
-                    comm_last_sent = (ClientMsg){0};
-                    goto done;
-                }
-                CloseHandle(comm_port);
-            }
+        comm_close_port();
+    }
+
+    SerialPortName names[SERIAL_MAX_PORTS];
+    u32 ports_amount = serial_list_ports(comm_transport, allocator, names, SERIAL_MAX_PORTS);
+    if (!ports_amount) return;
+    // The port, on which the Arduino was found the last time, gets the PING first, so that it's the one kept, if it answers as fast as another one
+    for (u32 i = 1; i < ports_amount; i++) {
+        if (strcmp(names[i].str, comm_last_port.str) == 0) {
+            SerialPortName tmp = names[0];
+            names[0] = names[i];
+            names[i] = tmp;
+            break;
         }
     }
-    comm_port = NULL;
-done:
-    allocator->free_one(allocator->data, ports);
-}
\ No newline at end of file
+    // All ports get the same PING at once, so that finding the Arduino only takes a single round trip
+    // printf("Checking %u ports...\n", ports_amount);
+    encode_msg(ping);
+    comm_probe = (SerialProbe){
+        .msg        = comm_frame.head,
+        .msg_len    = comm_frame.len,
+        .timeout_ms = MSG_TIMEOUT,
+    };
+    AIL_Buffer reply = { .data = comm_probe.reply, .idx = 0, .len = 0, .cap = sizeof(comm_probe.reply) };
+    ail_buf_write4msb(&reply, SPPP_MAGIC | SMSG_PONG);
+    f64 probe_time = ail_time_clock_start();
+    i32 found      = comm_transport->probe(comm_transport->data, names, ports_amount, &comm_probe);
+    if (found < 0) return;
+    if (!comm_start_reader()) return; // The port was closed already
+    comm_last_port = names[found];
+
+    // The keys, that were scheduled in the meantime, didn't reach the Arduino, so the song continues where it should be by now
+    if (comm_direct && comm_is_music_playing && !comm_new_song_pending) {
+        comm_time = (u32)direct_position_ms();
+        comm_new_song_pending = true;
+    }
+    comm_direct = false; // Decided again, once the song continues
+    __atomic_add_fetch(&comm_direct_gen, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&comm_write_lock);
+    comm_port_open     = true;
+    __atomic_store_n(&comm_sent_bytes, 0, __ATOMIC_RELAXED); // Counted from the end of the probe's PING, including what the scheduler thread sends from now on
+    comm_acked_bytes   = 0;
+    comm_credit_flow   = false; // Only known once the Arduino sent its first SMSG_CREDIT
+    pthread_mutex_unlock(&comm_write_lock);
+    comm_seq_frames    = false; // Only known once the Arduino announced them after the PONG
+    comm_stashed_count = 0;
+    comm_ext_version   = 0;     // Only known once the Arduino sent SMSG_CAPS after the PONG
+    comm_features      = 0;
+    comm_max_frame     = 0;
+    comm_max_baud_rate = 0;
+    comm_baud_rate     = BAUD_RATE; // Ports are always opened with BAUD_RATE
+    comm_baud_failed   = false;
+    comm_caps_pending  = false;
+    comm_status_pending = false; // Only asked for once the Arduino announced SPPP_FEATURE_RESUME
+    reset_clock();               // This might be a different Arduino
+    comm_link_bps      = BAUD_RATE/10;
+    // A different Arduino or one that was reset doesn't know the current volume and speed yet
+    comm_dirty_controls |= SPPP_CONTROL_VOLUME | SPPP_CONTROL_SPEED;
+    // Chunks, that weren't sent yet, might have been encoded for features, that this Arduino doesn't have
+    comm_prepared_count = 0;
+    comm_prepared_idx   = comm_cmds_idx;
+    comm_song_prepared  = false;
+    // The PING was sent by the probe, whose reply was already handed to the reader thread
+    comm_last_sent         = ping;
+    comm_total_bytes_sent += comm_probe.msg_len;
+    last_comm_time         = probe_time;
+    if (wait_for_reply() == SMSG_PONG) {
+        comm_last_sent = (ClientMsg){0};
+        return;
+    }
+    comm_close_port();
+}
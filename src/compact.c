@@ -0,0 +1,177 @@
+#include "header.h"
+
+// Compact encoding of PIDI commands for CMSG_MUSIC_COMPACT (see header.h)
+// Every command starts with a header byte, which only says what changed compared to the previous command:
+//   bits 0-4: Difference in pitch (octave*PIANO_KEY_AMOUNT + key) plus COMPACT_PITCH_BIAS,
+//             COMPACT_PITCH_FAR if the difference follows as zigzag varint or COMPACT_BACKREF for a back-reference
+//   bit 5:    dt follows as varint (otherwise dt is 0)
+//   bit 6:    len follows as varint (otherwise it is the same as before)
+//   bit 7:    velocity follows as a single byte (otherwise it is the same as before)
+// A back-reference is followed by the varints `distance` and `count` and repeats the `count` commands, that start `distance` commands back.
+// Like in LZ77, the repeated commands may overlap with the ones they produce, so a single back-reference can repeat a bar several times.
+// Back-references only ever point into the same message, so the Arduino can copy from the commands it just decoded
+// and a lost or repeated message can't break the following ones.
+// Before the first command of a message, the previous command is assumed to be all zeroes.
+#define COMPACT_PITCH_BIAS   15
+#define COMPACT_PITCH_FAR    30
+#define COMPACT_BACKREF      31
+#define COMPACT_HAS_DT       0x20
+#define COMPACT_HAS_LEN      0x40
+#define COMPACT_HAS_VELOCITY 0x80
+#define COMPACT_MAX_DISTANCE 128 // Keeps the distance of a back-reference at a single byte and the search for them cheap
+#define COMPACT_MIN_REPEAT   2
+#define COMPACT_MAX_CMD_SIZE 10  // Header, pitch (3), dt (3), len (2) and velocity - back-references are at most 6 bytes
+
+static inline void compact_write_varint(AIL_Buffer *buffer, u32 x)
+{
+    while (x >= 0x80) {
+        ail_buf_write1(buffer, (x & 0x7f) | 0x80);
+        x >>= 7;
+    }
+    ail_buf_write1(buffer, x);
+}
+
+// Returns false if the varint doesn't end before `end`
+static inline bool compact_read_varint(AIL_Buffer *buffer, u64 end, u32 *x)
+{
+    *x = 0;
+    for (u8 shift = 0; shift < 32 && buffer->idx < end; shift += 7) {
+        u8 b = ail_buf_read1(buffer);
+        *x |= (u32)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static inline u8 compact_varint_size(u32 x)
+{
+    u8 size = 1;
+    while (x >= 0x80) { x >>= 7; size++; }
+    return size;
+}
+
+static inline u32 compact_zigzag(i32 x)   { return ((u32)x << 1) ^ (u32)(x >> 31); }
+static inline i32 compact_unzigzag(u32 x) { return (i32)(x >> 1) ^ -(i32)(x & 1); }
+
+static inline i32 compact_pitch(PidiCmd cmd)
+{
+    return (i32)pidi_octave(cmd)*PIANO_KEY_AMOUNT + pidi_key(cmd);
+}
+
+static inline bool compact_cmds_eq(PidiCmd a, PidiCmd b)
+{
+    return pidi_dt(a) == pidi_dt(b) && pidi_len(a) == pidi_len(b) && pidi_velocity(a) == pidi_velocity(b) &&
+           pidi_octave(a) == pidi_octave(b) && pidi_key(a) == pidi_key(b);
+}
+
+// Size of `cmd`, when it follows `prev`
+static u8 compact_cmd_size(PidiCmd prev, PidiCmd cmd)
+{
+    i32 delta = compact_pitch(cmd) - compact_pitch(prev);
+    u8  size  = 1;
+    if (delta < -COMPACT_PITCH_BIAS || delta >= COMPACT_PITCH_FAR - COMPACT_PITCH_BIAS) size += compact_varint_size(compact_zigzag(delta));
+    if (pidi_dt(cmd))                         size += compact_varint_size(pidi_dt(cmd));
+    if (pidi_len(cmd) != pidi_len(prev))      size += compact_varint_size(pidi_len(cmd));
+    if (pidi_velocity(cmd) != pidi_velocity(prev)) size += 1;
+    return size;
+}
+
+static void compact_encode_cmd(AIL_Buffer *buffer, PidiCmd prev, PidiCmd cmd)
+{
+    i32 delta  = compact_pitch(cmd) - compact_pitch(prev);
+    bool far   = delta < -COMPACT_PITCH_BIAS || delta >= COMPACT_PITCH_FAR - COMPACT_PITCH_BIAS;
+    u8  header = far ? COMPACT_PITCH_FAR : (u8)(delta + COMPACT_PITCH_BIAS);
+    if (pidi_dt(cmd))                              header |= COMPACT_HAS_DT;
+    if (pidi_len(cmd) != pidi_len(prev))           header |= COMPACT_HAS_LEN;
+    if (pidi_velocity(cmd) != pidi_velocity(prev)) header |= COMPACT_HAS_VELOCITY;
+    ail_buf_write1(buffer, header);
+    if (far)                            compact_write_varint(buffer, compact_zigzag(delta));
+    if (header & COMPACT_HAS_DT)        compact_write_varint(buffer, pidi_dt(cmd));
+    if (header & COMPACT_HAS_LEN)       compact_write_varint(buffer, pidi_len(cmd));
+    if (header & COMPACT_HAS_VELOCITY)  ail_buf_write1(buffer, pidi_velocity(cmd));
+}
+
+// Encodes the `n` commands into `buffer`, which needs space for at least `limit` + COMPACT_MAX_CMD_SIZE bytes
+// Returns false as soon as the encoding got longer than `limit` bytes, in which case the caller should fall back to encode_cmd
+bool compact_encode_cmds(AIL_Buffer *buffer, const PidiCmd *cmds, u32 n, u64 limit)
+{
+    PidiCmd prev = { 0 };
+    for (u32 i = 0; i < n;) {
+        // Find the longest repetition of earlier commands
+        u32 best_count = 0, best_distance = 0;
+        for (u32 distance = 1; distance <= AIL_MIN(i, COMPACT_MAX_DISTANCE); distance++) {
+            u32 count = 0;
+            while (i + count < n && count < UINT16_MAX && compact_cmds_eq(cmds[i + count - distance], cmds[i + count])) count++;
+            if (count > best_count) {
+                best_count    = count;
+                best_distance = distance;
+            }
+        }
+        if (best_count >= COMPACT_MIN_REPEAT) {
+            // Only worth it, if the repeated commands would take up more space themselves
+            u32 literal_size = 0;
+            for (u32 j = 0; j < best_count; j++) literal_size += compact_cmd_size(j ? cmds[i + j - 1] : prev, cmds[i + j]);
+            if (literal_size > 1u + compact_varint_size(best_distance) + compact_varint_size(best_count)) {
+                ail_buf_write1(buffer, COMPACT_BACKREF);
+                compact_write_varint(buffer, best_distance);
+                compact_write_varint(buffer, best_count);
+                i   += best_count;
+                prev = cmds[i - 1];
+                if (buffer->len > limit) return false;
+                continue;
+            }
+        }
+        compact_encode_cmd(buffer, prev, cmds[i]);
+        prev = cmds[i++];
+        if (buffer->len > limit) return false;
+    }
+    return true;
+}
+
+// Decodes exactly `n` commands, that were encoded with compact_encode_cmds and end before `end`, into `cmds`
+// Returns false if the encoding is broken
+bool compact_decode_cmds(AIL_Buffer *buffer, u64 end, PidiCmd *cmds, u32 n)
+{
+    PidiCmd prev = { 0 };
+    u32 i = 0;
+    while (i < n) {
+        if (buffer->idx >= end) return false;
+        u8 header = ail_buf_read1(buffer);
+        u8 code   = header & 0x1f;
+        if (code == COMPACT_BACKREF) {
+            u32 distance, count;
+            if (header != COMPACT_BACKREF || !compact_read_varint(buffer, end, &distance) || !compact_read_varint(buffer, end, &count)) return false;
+            if (!distance || distance > i || count > n - i) return false;
+            for (u32 j = 0; j < count; j++, i++) cmds[i] = cmds[i - distance];
+            if (count) prev = cmds[i - 1];
+            continue;
+        }
+        i32 pitch = compact_pitch(prev);
+        u32 x;
+        if (code == COMPACT_PITCH_FAR) {
+            if (!compact_read_varint(buffer, end, &x)) return false;
+            pitch += compact_unzigzag(x);
+        } else {
+            pitch += (i32)code - COMPACT_PITCH_BIAS;
+        }
+        u32 dt = 0, len = pidi_len(prev);
+        u8 velocity = pidi_velocity(prev);
+        if ((header & COMPACT_HAS_DT)  && !compact_read_varint(buffer, end, &dt))  return false;
+        if ((header & COMPACT_HAS_LEN) && !compact_read_varint(buffer, end, &len)) return false;
+        if (header & COMPACT_HAS_VELOCITY) {
+            if (buffer->idx >= end) return false;
+            velocity = ail_buf_read1(buffer);
+        }
+        // Floor division, since the octave can be negative
+        i32 octave = (pitch >= 0 ? pitch : pitch - (PIANO_KEY_AMOUNT - 1))/PIANO_KEY_AMOUNT;
+        cmds[i] = (PidiCmd) {
+            .dt       = dt,
+            .len      = len,
+            .velocity = velocity,
+            .octave   = octave,
+            .key      = pitch - octave*PIANO_KEY_AMOUNT,
+        };
+        prev = cmds[i++];
+    }
+    return true;
+}
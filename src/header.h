@@ -1,6 +1,8 @@
 #ifndef HEADER_H_
 #define HEADER_H_
 
+#define _DEFAULT_SOURCE // Needed to get POSIX functions like clock_gettime on Linux, since we compile with -std=c99
+
 #define AIL_ALL_IMPL
 #define AIL_ALLOC_IMPL
 #define AIL_MD_IMPL
@@ -25,6 +27,8 @@
 #include <stdlib.h>  // For calloc, free, memcpy, memcmp
 
 static const CONST_VAR u32 PDIL_MAGIC = (((u32)'P') << 24) | (((u32)'D') << 16) | (((u32)'I') << 8) | (((u32)'L') << 0);
+// A PIDI-file starts with PIDI_MAGIC and the amount of commands, after which the commands are encoded exactly like encode_cmd encodes them for SPPP
+#define PIDI_HEADER_SIZE 8
 
 #ifndef DBG_LOG
 #ifdef UI_DEBUG
@@ -35,6 +39,196 @@ static const CONST_VAR u32 PDIL_MAGIC = (((u32)'P') << 24) | (((u32)'D') << 16)
 #endif // UI_DEBUG
 #endif // DBG_LOG
 
+// Extensions to SPPP (see common.h), that are not part of the original protocol
+// @Note: The firmware needs to mirror these. Older firmware never sends any of them, in which case SAM keeps behaving like before.
+// Extension message types start at 0xC0 for the device and at 0x40 for the host, so that they never collide with the original ones
+//
+// SMSG_CREDIT: Credit-based flow control. Payload: u16 lsb `received`, u16 lsb `window`
+//   `received` is the amount of bytes the device received since the end of the last PING (mod 2^16)
+//   `window` is the amount of free bytes in the device's receive buffer at that point
+//   The host may thus send up to `window - (sent - received)` more bytes, where `sent` counts the bytes sent since the end of the last PING.
+//   The device sends a CREDIT after every PONG and SUCCESS and whenever it freed up at least a quarter of its receive buffer since the last CREDIT.
+//   A device that sends CREDITs also queues music chunks, that arrive before it sent a REQUEST for them, so the host may send ahead.
+#define SMSG_CREDIT ((ServerMsgType)0xC0)
+#define SMSG_CREDIT_SIZE 8
+//
+// Sequenced frames: Once the device sent an SMSG_ACK with `seq` 0 and `reply` SMSG_PONG right after a PONG, every message except PING is sent as
+//   magic, type | CMSG_SEQ_FLAG, u8 `seq`, payload, u16 lsb CRC-16/CCITT of everything after the magic
+//   `seq` starts at 1 after every PING, is incremented for every new message (skipping 0) and stays the same when a message is sent again.
+//   The device only executes a sequenced frame if its CRC matches and its `seq` differs from the last executed one.
+//   Duplicates are only acknowledged again, so a lost reply can't make the device play the same chunk twice.
+//   The device repeats an SMSG_REQUEST if no chunk arrived within MSG_TIMEOUT, since the host can't notice a lost REQUEST.
+// SMSG_ACK: Payload: u8 `seq`, u8 `reply`. Replaces the reply (i.e. SMSG_SUCCESS) to a sequenced frame.
+// SMSG_NAK: Payload: u8 `seq`. The device received a broken frame, while it expected `seq`, and asks for it to be sent again right away.
+// CMSG_ACK_QUERY: No payload and never sequenced. The device answers with the SMSG_ACK of the last frame it executed.
+//   The host uses it after a timeout, so that large frames are only sent again if they were actually lost.
+#define CMSG_SEQ_FLAG 0x80
+#define CMSG_ACK_QUERY ((ClientMsgType)0x40)
+#define SMSG_ACK ((ServerMsgType)0xC1)
+#define SMSG_ACK_SIZE 6
+#define SMSG_NAK ((ServerMsgType)0xC2)
+#define SMSG_NAK_SIZE 5
+#define SPPP_CRC_SIZE 2
+//
+// SMSG_CAPS: The device's capabilities. Sent right after every PONG, so the host only ever sends extensions, that the device announced here.
+//   Payload: u8 `version`, u32 lsb `features`, u16 lsb `max_frame`, u16 lsb `window`, u32 lsb `max_baud_rate`
+//   `version` is the version of these extensions, that the device implements. Both sides use the lower one of their versions.
+//   `features` is a bitmask of the SPPP_FEATURE_* flags below. The host ignores flags it doesn't know.
+//   `max_frame` is the size of the largest frame, that the device can receive. The host keeps music chunks small enough for it.
+//   `window` is the size of the device's receive buffer. A device that sends CAPS also sends CREDITs, so the host may start sending before the first CREDIT.
+//   `max_baud_rate` is the highest baud rate, that the device can switch to (see CMSG_BAUD_RATE), or 0 if it can't switch.
+// CMSG_MUSIC_COMPACT: Same as CMSG_MUSIC, but with the commands in the compact encoding from compact.c
+//   Payload: u16 lsb `cmds_count`, u16 lsb size of the encoded commands, encoded commands
+//   The host only sends it if the device announced SPPP_FEATURE_COMPACT_MUSIC and only if it is actually smaller than CMSG_MUSIC.
+// CMSG_BAUD_RATE: Payload: u32 lsb `baud_rate`. Asks the device to switch to a baud rate of at most `max_baud_rate`.
+//   The device answers with SMSG_SUCCESS at the old baud rate and switches right after that reply was sent completely.
+//   The host then switches as well and sends a PING. If the device didn't receive a valid frame within SPPP_BAUD_CONFIRM_MS after switching,
+//   it switches back to BAUD_RATE. So does the host, if it didn't get a PONG in time.
+//   The device also switches back to BAUD_RATE if it didn't receive anything for SPPP_BAUD_IDLE_MS, so that a host, that lost
+//   the connection, always finds it at BAUD_RATE again.
+// CMSG_CONTROL: Several control values in a single frame. Payload: u8 `fields`, followed by the values of the SPPP_CONTROL_* flags set in `fields`
+//   in the order of their bits: f32 lsb volume (like CMSG_VOLUME), f32 lsb speed (like CMSG_SPEED), u8 whether to play (like CMSG_CONTINUE)
+//   The host only sends it if the device announced SPPP_FEATURE_CONTROL_BATCH. Either way, the host only sends the latest value of every control.
+// CMSG_STATUS_QUERY: No payload and never sequenced. Only sent if the device announced SPPP_FEATURE_RESUME.
+//   The device answers with an SMSG_STATUS. The host asks for it after every CAPS, so that after reconnecting it can continue the song
+//   right where the device is, instead of starting it over with CMSG_NEW_MUSIC.
+// SMSG_STATUS: Payload: u16 lsb `session`, u32 lsb `received`, u32 lsb `buffered_ms`
+//   `session` is chosen randomly whenever the device starts, so that the host notices a device, that was reset in the meantime.
+//   `received` is the amount of music commands, that the device received since it started (mod 2^32). It is never reset, not even by CMSG_NEW_MUSIC.
+//   `buffered_ms` is the time in ms, after which the device runs out of music at the current speed (0 if it isn't playing).
+// CMSG_CLOCK_QUERY: Payload: u8 `id`, which is never 0. Never sequenced. Only sent if the device announced SPPP_FEATURE_CLOCK.
+//   The device answers right away with an SMSG_CLOCK, whose `query` is `id`. From the round trip, the host estimates the offset between both clocks.
+// SMSG_CLOCK: Where the device is in the music. Payload: u8 `query`, u8 `playing`, u32 lsb `clock_us`, u32 lsb `received`, u32 lsb `buffered_us`
+//   `query` is the `id` of the CMSG_CLOCK_QUERY, that is answered, or 0 for a periodic report
+//   `playing` is 1 while the device is actually playing music, i.e. it is neither paused nor did it run out of music
+//   `clock_us` is the device's clock in µs (mod 2^32) at the moment the other values were taken
+//   `received` is like in SMSG_STATUS, while `buffered_us` is like `buffered_ms` of SMSG_STATUS, just in µs
+//   A device with SPPP_FEATURE_CLOCK reports every SPPP_CLOCK_INTERVAL_MS while it plays and once more right after it stopped playing.
+// CMSG_KEYS: Presses or releases keys right away. Payload: u8 `count`, followed by `count` times i8 `octave`, u8 `key`, u8 `velocity`
+//   A `velocity` of 0 releases the key. Never sequenced and never answered, since a late note is worse than a missing one.
+//   Only sent if the device announced SPPP_FEATURE_DIRECT and only in the host-timed direct-drive mode (see comm.c), which sends no music chunks at all.
+//   Keys are applied in the order of the payload, so a key, that is released and pressed in the same frame, is struck again.
+#define SMSG_CAPS ((ServerMsgType)0xC3)
+#define SMSG_CAPS_SIZE 17
+#define SPPP_EXT_VERSION 1
+#define SPPP_FEATURE_COMPACT_MUSIC  (1 << 0)
+#define SPPP_FEATURE_CONTROL_BATCH  (1 << 1)
+#define SPPP_FEATURE_RESUME         (1 << 2)
+#define SPPP_FEATURE_CLOCK          (1 << 3)
+#define SPPP_FEATURE_DIRECT         (1 << 4)
+#define SPPP_KNOWN_FEATURES (SPPP_FEATURE_COMPACT_MUSIC | SPPP_FEATURE_CONTROL_BATCH | SPPP_FEATURE_RESUME | SPPP_FEATURE_CLOCK | SPPP_FEATURE_DIRECT)
+#define CMSG_MUSIC_COMPACT ((ClientMsgType)0x41)
+#define CMSG_BAUD_RATE ((ClientMsgType)0x42)
+#define CMSG_CONTROL ((ClientMsgType)0x43)
+#define CMSG_STATUS_QUERY ((ClientMsgType)0x44)
+#define SMSG_STATUS ((ServerMsgType)0xC4)
+#define SMSG_STATUS_SIZE 14
+#define CMSG_CLOCK_QUERY ((ClientMsgType)0x45)
+#define SMSG_CLOCK ((ServerMsgType)0xC5)
+#define SMSG_CLOCK_SIZE 18
+#define SPPP_CLOCK_INTERVAL_MS 100
+#define CMSG_KEYS ((ClientMsgType)0x46)
+#define SPPP_KEY_ENCODED_SIZE 3
+
+// PINGs and queries are never sequenced, so that they are answered no matter which frames the device executed already
+// Neither are keys, which are never sent again
+static inline bool sppp_is_sequenced(ClientMsgType type)
+{
+    return type != CMSG_PING && type != CMSG_ACK_QUERY && type != CMSG_STATUS_QUERY && type != CMSG_CLOCK_QUERY && type != CMSG_KEYS;
+}
+#define SPPP_CONTROL_VOLUME (1 << 0)
+#define SPPP_CONTROL_SPEED  (1 << 1)
+#define SPPP_CONTROL_PLAY   (1 << 2)
+#define SPPP_CONTROL_ALL    (SPPP_CONTROL_VOLUME | SPPP_CONTROL_SPEED | SPPP_CONTROL_PLAY)
+#define SPPP_BAUD_CONFIRM_MS MSG_TIMEOUT
+#define SPPP_BAUD_IDLE_MS    (4*MSG_TIMEOUT) // Longer than the time after which the host sends a PING to keep the connection alive
+
+// CRC-16/CCITT (polynomial 0x1021, initial value 0xffff) - computed bitwise, since the Arduino has no space for a table
+// sppp_crc16_update continues the CRC of everything before `data`, so that frames can be checksummed in parts
+#define SPPP_CRC_INIT 0xffff
+static inline u16 sppp_crc16_update(u16 crc, const u8 *data, u64 len)
+{
+    for (u64 i = 0; i < len; i++) {
+        crc ^= (u16)data[i] << 8;
+        for (u8 j = 0; j < 8; j++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+static inline u16 sppp_crc16(const u8 *data, u64 len)
+{
+    return sppp_crc16_update(SPPP_CRC_INIT, data, len);
+}
+
+// Lock-free handoff of the latest value from one producer thread to one consumer thread
+// The data itself lives in an array of 3 slots owned by the user: the producer only ever writes into slot `back`,
+// the consumer only ever reads from slot `front` and `middle` holds the most recently published slot
+#define TRIPLE_BUFFER_FRESH 0x80
+typedef struct TripleBuffer {
+    u8 front;
+    u8 middle; // Has TRIPLE_BUFFER_FRESH set, if it was published but not yet taken by the consumer
+    u8 back;
+} TripleBuffer;
+#define TRIPLE_BUFFER_INIT { .front = 0, .middle = 1, .back = 2 }
+
+// Called by the producer after it finished writing into slot `back`
+static inline void triple_buffer_publish(TripleBuffer *tb)
+{
+    tb->back = __atomic_exchange_n(&tb->middle, tb->back | TRIPLE_BUFFER_FRESH, __ATOMIC_ACQ_REL) & ~TRIPLE_BUFFER_FRESH;
+}
+
+// Called by the consumer - makes the latest published slot the new `front`. Returns false if nothing new was published
+static inline bool triple_buffer_acquire(TripleBuffer *tb)
+{
+    if (!(__atomic_load_n(&tb->middle, __ATOMIC_ACQUIRE) & TRIPLE_BUFFER_FRESH)) return false;
+    tb->front = __atomic_exchange_n(&tb->middle, tb->front, __ATOMIC_ACQ_REL) & ~TRIPLE_BUFFER_FRESH;
+    return true;
+}
+
+// Lock-free queue from one producer thread to one consumer thread
+// Like with TripleBuffer, the data lives in an array owned by the user, whose length `cap` has to be a power of 2
+// `head` and `tail` only ever increase (mod 2^32), so the slot of an index is `index & (cap - 1)`
+typedef struct SpscQueue {
+    u32 head; // Index of the next slot to write into - only changed by the producer
+    u32 tail; // Index of the next slot to read from - only changed by the consumer
+    u32 cap;
+} SpscQueue;
+#define SPSC_QUEUE_INIT(n) { .head = 0, .tail = 0, .cap = (n) }
+
+// Called by the producer - returns the slot to write the next element into or -1 if the queue is full
+static inline i64 spsc_queue_reserve(SpscQueue *q)
+{
+    u32 head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= q->cap) return -1;
+    return head & (q->cap - 1);
+}
+
+// Called by the producer - returns how many elements can be pushed without the queue getting full
+static inline u32 spsc_queue_free(SpscQueue *q)
+{
+    return q->cap - (__atomic_load_n(&q->head, __ATOMIC_RELAXED) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE));
+}
+
+// Called by the producer after it finished writing into the slot returned by spsc_queue_reserve
+static inline void spsc_queue_publish(SpscQueue *q)
+{
+    __atomic_store_n(&q->head, __atomic_load_n(&q->head, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+// Called by the consumer - returns the slot of the oldest element or -1 if the queue is empty
+static inline i64 spsc_queue_peek(SpscQueue *q)
+{
+    u32 tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail) return -1;
+    return tail & (q->cap - 1);
+}
+
+// Called by the consumer after it is done with the slot returned by spsc_queue_peek, which the producer may reuse afterwards
+static inline void spsc_queue_pop(SpscQueue *q)
+{
+    __atomic_store_n(&q->tail, __atomic_load_n(&q->tail, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
 void print_cmd(PidiCmd c)
 {
     static const char *key_strs[] = { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
@@ -0,0 +1,1101 @@
+// Indices over the song library, that allow answering queries from the UI without walking over every song
+//
+// Searching works on case-folded copies of all song names. Each folded character is mapped onto a 6-bit symbol
+// and every name contributes all of its symbol-trigrams (padded with an end-symbol) to a posting list of song indices.
+// Since songs are only ever appended to the library, all posting lists stay sorted without any extra work.
+// Because several characters can share the same symbol, candidates from the posting lists are always verified against the folded name.
+//
+// Fuzzy searching uses Myers' bit-parallel edit-distance algorithm over the same folded names. Only the best FUZZY_TOP_K matches are kept.
+//
+// All searching happens on the Search thread (see search_thread_main), so that the UI never has to wait for it.
+// The UI hands queries to it and picks up results via lock-free triple buffers. The Search thread only ever works on the latest query,
+// and it aborts a running fuzzy search, as soon as a newer query was requested.
+//
+// For browsing the library in different orders, a permutation of all song indices is kept for every LibrarySortKey.
+// New songs are inserted into each permutation at the right place, so that switching the order never requires sorting.
+//
+// Songs can be grouped by tags. Each tag keeps a compressed bitmap of its songs in the style of roaring bitmaps:
+// song indices are split into chunks of 2^16 and each chunk is stored either as a sorted array or as a plain bitmap, whichever is smaller.
+// Filters combining several tags are evaluated into preallocated dense bitsets over the whole library with word-wise operations.
+
+#include "header.h"
+#include <semaphore.h>
+#include <errno.h>
+#include <time.h>
+
+#define SEARCH_ALPHABET_BITS   6
+#define SEARCH_ALPHABET_SIZE   (1 << SEARCH_ALPHABET_BITS)
+#define SEARCH_TRIGRAMS_COUNT  (1 << (3*SEARCH_ALPHABET_BITS))
+#define SEARCH_SYM_END         0  // Symbol appended to the end of each name, so that the last two characters also form a trigram
+#define SEARCH_SYM_SPACE       37
+#define SEARCH_SYM_OTHERS      38 // All symbols from here on are shared by several characters
+#define SEARCH_MAX_QUERY_LEN   256
+#define FUZZY_MAX_QUERY_LEN    64 // Patterns have to fit into a single u64
+#define FUZZY_MIN_QUERY_LEN    3
+#define FUZZY_LANES            4  // Amount of names that are matched in lockstep
+#define FUZZY_TOP_K            32
+#define FUZZY_CANCEL_INTERVAL  1024 // Amount of names after which a fuzzy search checks whether it was cancelled
+#define SEARCH_DEBOUNCE_MS     40   // Time to wait for the next keystroke before starting a fuzzy search
+#define TAG_FILTER_MAX_TERMS   16   // Further tags in a filter are ignored
+#define TAG_ARRAY_MAX_CARD     4096 // Containers with more songs are stored as bitmaps instead
+#define TAG_CHUNK_BITS         16
+#define TAG_CHUNK_WORDS        ((1 << TAG_CHUNK_BITS)/64)
+#define SEARCH_TRIGRAM(a, b, c) ((((u32)(a)) << (2*SEARCH_ALPHABET_BITS)) | (((u32)(b)) << SEARCH_ALPHABET_BITS) | ((u32)(c)))
+
+typedef struct SearchIndex {
+    AIL_DA(char) names;        // Case-folded, zero-terminated copies of all song names
+    AIL_DA(u32)  name_offsets; // Offset of each song's folded name into `names`
+    AIL_DA(u64)  char_masks;   // Bitmask of all symbols that appear in each name - used for single-character queries
+    AIL_DA(u32) *trigrams;     // SEARCH_TRIGRAMS_COUNT posting lists of song indices, each sorted in ascending order
+    u32 count;                 // Amount of indexed songs
+} SearchIndex;
+
+typedef struct SearchRes {
+    AIL_DA(u32) idxs;           // Indices into the library: first all songs whose name starts with the query, then all songs that contain it somewhere else - each group in library-order
+    u32         prefixed_count; // Amount of prefix-matches at the start of `idxs`
+    AIL_DA(u32) others;         // Scratch-buffers, that are kept around between queries to not allocate on every keystroke
+    AIL_DA(u32) tmp;
+    AIL_DA(u64) bits;
+    u32  count;                 // Amount of songs in the index when this result was computed
+    u32  query_len;
+    char query[SEARCH_MAX_QUERY_LEN + 1]; // Folded query this result belongs to
+} SearchRes;
+
+typedef struct FuzzyMatch {
+    u32 idx;  // Index into the library
+    u16 dist; // Smallest edit-distance between the query and any substring of the name
+    u16 len;  // Length of the name - shorter names are ranked higher, when the distance is the same
+} FuzzyMatch;
+
+typedef struct FuzzyRes {
+    FuzzyMatch matches[FUZZY_TOP_K]; // Sorted from best to worst match
+    u32  count;
+    char query[FUZZY_MAX_QUERY_LEN + 1];
+} FuzzyRes;
+
+typedef struct SearchQuery {
+    char text[SEARCH_MAX_QUERY_LEN + 1];
+    u32  generation;
+} SearchQuery;
+
+typedef struct SearchResults {
+    AIL_DA(u32) idxs;        // Indices into the library: all exact matches (see SearchRes) followed by the fuzzy matches
+    u32  exact_count;
+    bool fuzzy_done;         // Whether the fuzzy matches were already added
+    u32  generation;         // Generation of the query these results belong to
+} SearchResults;
+
+typedef enum LibrarySortKey {
+    LIBRARY_SORT_ADDED,    // Order in which songs were added to the library
+    LIBRARY_SORT_NAME,
+    LIBRARY_SORT_DURATION,
+    LIBRARY_SORT_RECENT,   // Time the song was last played
+    LIBRARY_SORT_DENSITY,  // Notes per second
+    LIBRARY_SORT_COUNT,
+} LibrarySortKey;
+
+typedef struct SongStats {
+    u64 len;         // Length of the song in ms
+    u64 last_played; // Unix-timestamp of when the song was played last or 0 if it was never played
+    u32 cmds_count;
+} SongStats;
+AIL_DA_INIT(SongStats);
+
+typedef struct LibraryViews {
+    AIL_DA(SongStats) stats;                    // Stats for each song in the library
+    AIL_DA(u32)       perms[LIBRARY_SORT_COUNT]; // Song indices sorted in ascending order by the respective LibrarySortKey
+    bool              sorted;                   // While false, new songs are simply appended and library_views_sort needs to be called afterwards
+} LibraryViews;
+
+// A read-only window into one of the permutations - indexing it with library_view_get never allocates or copies
+typedef struct LibraryView {
+    const u32 *idxs;
+    u32  count;
+    bool reversed;
+} LibraryView;
+
+// All songs whose indices share the same upper 16 bits
+typedef struct TagContainer {
+    u16  key;       // Upper 16 bits of all song indices in this container
+    bool is_bitmap;
+    u32  card;      // Amount of songs in this container
+    AIL_DA(u16) arr; // Sorted lower 16 bits of all song indices - only used while !is_bitmap
+    u64 *bits;      // TAG_CHUNK_WORDS words - only used while is_bitmap
+} TagContainer;
+AIL_DA_INIT(TagContainer);
+
+typedef struct Tag {
+    char *name; // Case-folded
+    AIL_DA(TagContainer) containers; // Sorted by key
+} Tag;
+AIL_DA_INIT(Tag);
+
+// Tags that songs need to have to pass a filter - the values are indices into TagIndex.tags
+typedef struct TagFilter {
+    u32  all[TAG_FILTER_MAX_TERMS];  // `#tag`:  Songs need to have all of these tags
+    u32  any[TAG_FILTER_MAX_TERMS];  // `~#tag`: Songs need to have at least one of these tags
+    u32  none[TAG_FILTER_MAX_TERMS]; // `-#tag`: Songs may not have any of these tags
+    u8   all_count;
+    u8   any_count;
+    u8   none_count;
+    bool empty;                      // Set if a required tag doesn't exist, in which case no song can pass the filter
+} TagFilter;
+
+// @Note: Tags are only ever changed and read by the UI thread (or while the library is loading), so no locking is required
+typedef struct TagIndex {
+    AIL_DA(Tag) tags;
+    u32  bits_cap;  // Amount of songs that the following buffers have space for - they grow together with the library, so that filtering never allocates
+    u64 *res;       // Dense bitset that filters are evaluated into
+    u64 *any;       // Dense bitset for collecting the union of all `any` tags
+    u32 *filtered;  // Song indices that passed the last filter
+} TagIndex;
+
+static SearchIndex     search_index       = { 0 };
+static pthread_mutex_t search_index_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects search_index from being changed while the search thread reads it
+
+// @Note: The UI thread sends queries to the search thread and picks up its results via the following variables
+static u32           search_generation         = 0; // Increased for every new query and whenever the library changes - running searches for older generations are cancelled
+static sem_t         search_wakeup;
+static SearchQuery   search_queries[3]         = { 0 };
+static TripleBuffer  search_queries_tb         = TRIPLE_BUFFER_INIT;
+static SearchResults search_results[3]         = { 0 };
+static TripleBuffer  search_results_tb         = TRIPLE_BUFFER_INIT;
+
+static LibraryViews  library_views             = { 0 };
+static TagIndex      library_tags              = { 0 };
+
+void library_views_init(LibraryViews *views);
+void library_views_add(LibraryViews *views, SongStats stats);
+void library_views_sort(LibraryViews *views);
+void library_views_mark_played(LibraryViews *views, u32 idx, u64 timestamp);
+LibraryView library_view(const LibraryViews *views, LibrarySortKey key, bool reversed);
+static inline u32 library_view_get(LibraryView view, u32 i);
+void tags_init(TagIndex *index);
+void tags_reserve(TagIndex *index, u32 songs_count);
+u32  tag_get_or_add(TagIndex *index, const char *name, u32 name_len);
+void tag_add_song(Tag *tag, u32 idx);
+u32  tags_strip_name(TagIndex *index, const char *text, char *name, u32 *tag_ids, u32 tag_ids_cap);
+bool tag_filter_parse(const TagIndex *index, const char *text, TagFilter *filter, char *rest, u32 rest_cap);
+const u64 *tag_filter_eval(TagIndex *index, const TagFilter *filter, u32 songs_count);
+u32  tag_filter_view(TagIndex *index, const u64 *bits, LibraryView view);
+void tags_write(const TagIndex *index, AIL_Buffer *buf);
+void tags_read(TagIndex *index, AIL_Buffer *buf);
+void search_index_init(SearchIndex *index);
+void search_index_add(SearchIndex *index, const char *name);
+void search_index_query(SearchIndex *index, const char *query, SearchRes *res);
+bool fuzzy_search(const SearchIndex *index, const char *query, FuzzyRes *res, u32 generation);
+void  search_thread_init(void);
+void *search_thread_main(void *args);
+void  search_request(const char *query);
+void  search_cancel(void);
+const SearchResults *search_poll_results(void);
+static inline char search_fold_char(char c);
+static inline u8   search_symbol(char folded);
+
+
+// An index, that was initialized before, is emptied instead, keeping all of its memory for the songs, that are added again
+void search_index_init(SearchIndex *index)
+{
+    if (index->trigrams) {
+        index->names.len        = 0;
+        index->name_offsets.len = 0;
+        index->char_masks.len   = 0;
+        for (u32 i = 0; i < SEARCH_TRIGRAMS_COUNT; i++) index->trigrams[i].len = 0;
+        index->count = 0;
+        return;
+    }
+    index->names        = ail_da_new(char);
+    index->name_offsets = ail_da_new(u32);
+    index->char_masks   = ail_da_new(u64);
+    index->trigrams     = malloc(SEARCH_TRIGRAMS_COUNT * sizeof(AIL_DA(u32)));
+    AIL_ASSERT(index->trigrams != NULL);
+    for (u32 i = 0; i < SEARCH_TRIGRAMS_COUNT; i++) index->trigrams[i] = ail_da_new_empty(u32);
+    index->count = 0;
+}
+
+static inline char search_fold_char(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline u8 search_symbol(char folded)
+{
+    if (folded >= 'a' && folded <= 'z') return 1 + folded - 'a';
+    if (folded >= '0' && folded <= '9') return 27 + folded - '0';
+    if (folded == ' ') return SEARCH_SYM_SPACE;
+    return SEARCH_SYM_OTHERS + ((u8)folded) % (SEARCH_ALPHABET_SIZE - SEARCH_SYM_OTHERS);
+}
+
+// Adds the name of the song at index `index->count` in the library
+void search_index_add(SearchIndex *index, const char *name)
+{
+    u32 id       = index->count++;
+    u32 name_len = strlen(name);
+    u32 offset   = index->names.len;
+    ail_da_maybe_grow(&index->names, name_len + 1);
+    char *folded = &index->names.data[offset];
+    u64   mask   = 0;
+    for (u32 i = 0; i < name_len; i++) {
+        folded[i] = search_fold_char(name[i]);
+        mask     |= 1ull << search_symbol(folded[i]);
+    }
+    folded[name_len]  = 0;
+    index->names.len += name_len + 1;
+    ail_da_push(&index->name_offsets, offset);
+    ail_da_push(&index->char_masks, mask);
+
+    for (u32 i = 0; i + 1 < name_len; i++) {
+        u8 c = (i + 2 < name_len) ? search_symbol(folded[i + 2]) : SEARCH_SYM_END;
+        AIL_DA(u32) *list = &index->trigrams[SEARCH_TRIGRAM(search_symbol(folded[i]), search_symbol(folded[i + 1]), c)];
+        // The same trigram can appear several times in a name, but the song should only be listed once
+        if (!list->len || list->data[list->len - 1] != id) ail_da_push(list, id);
+    }
+}
+
+static inline const char *search_name(const SearchIndex *index, u32 id)
+{
+    return &index->names.data[index->name_offsets.data[id]];
+}
+
+// Returns the first index >= `from` in the sorted list `data`, at which the value is not smaller than `x`
+static u32 search_gallop(const u32 *data, u32 len, u32 from, u32 x)
+{
+    u32 step = 1;
+    u32 hi   = from;
+    while (hi < len && data[hi] < x) {
+        from = hi + 1;
+        hi  += step;
+        step *= 2;
+    }
+    hi = AIL_MIN(hi, len);
+    while (from < hi) {
+        u32 mid = from + (hi - from)/2;
+        if (data[mid] < x) from = mid + 1;
+        else hi = mid;
+    }
+    return from;
+}
+
+// Sorts the candidates in res->tmp into prefix-matches (res->idxs) and substring-matches (res->others)
+static void search_verify_candidates(const SearchIndex *index, SearchRes *res)
+{
+    for (u32 i = 0; i < res->tmp.len; i++) {
+        u32 id = res->tmp.data[i];
+        const char *name = search_name(index, id);
+        if (strncmp(name, res->query, res->query_len) == 0) ail_da_push(&res->idxs, id);
+        else if (name[0] && strstr(&name[1], res->query)) ail_da_push(&res->others, id);
+    }
+}
+
+// Collects all songs containing the current query into res->tmp (in ascending order)
+static void search_collect_candidates(const SearchIndex *index, SearchRes *res)
+{
+    const char *q = res->query;
+    if (res->query_len == 1) {
+        u8  sym = search_symbol(q[0]);
+        u64 bit = 1ull << sym;
+        for (u32 i = 0; i < index->count; i++) {
+            if (index->char_masks.data[i] & bit) ail_da_push(&res->tmp, i);
+        }
+    } else if (res->query_len == 2) {
+        // The query can be followed by any symbol (including the end-symbol), so all those posting lists are merged via a bitset
+        u32 words = (index->count + 63)/64;
+        if (res->bits.len < words) {
+            ail_da_maybe_grow(&res->bits, words - res->bits.len);
+            memset(&res->bits.data[res->bits.len], 0, (words - res->bits.len)*sizeof(u64));
+            res->bits.len = words;
+        }
+        u32 base = SEARCH_TRIGRAM(search_symbol(q[0]), search_symbol(q[1]), 0);
+        for (u32 c = 0; c < SEARCH_ALPHABET_SIZE; c++) {
+            AIL_DA(u32) list = index->trigrams[base + c];
+            for (u32 i = 0; i < list.len; i++) res->bits.data[list.data[i]/64] |= 1ull << (list.data[i]%64);
+        }
+        for (u32 w = 0; w < words; w++) {
+            u64 word = res->bits.data[w];
+            res->bits.data[w] = 0;
+            while (word) {
+                ail_da_push(&res->tmp, w*64 + __builtin_ctzll(word));
+                word &= word - 1;
+            }
+        }
+    } else {
+        // Intersect the posting lists of all trigrams in the query, starting with the shortest one
+        #define SEARCH_MAX_QUERY_TRIGRAMS 32
+        AIL_DA(u32) *lists[SEARCH_MAX_QUERY_TRIGRAMS];
+        u32 lists_count = 0;
+        for (u32 i = 0; i + 2 < res->query_len && lists_count < SEARCH_MAX_QUERY_TRIGRAMS; i++) {
+            AIL_DA(u32) *list = &index->trigrams[SEARCH_TRIGRAM(search_symbol(q[i]), search_symbol(q[i + 1]), search_symbol(q[i + 2]))];
+            u32 j = lists_count++;
+            for (; j > 0 && lists[j - 1]->len > list->len; j--) lists[j] = lists[j - 1];
+            lists[j] = list;
+        }
+        ail_da_pushn(&res->tmp, lists[0]->data, lists[0]->len);
+        for (u32 l = 1; l < lists_count && res->tmp.len; l++) {
+            const AIL_DA(u32) *list = lists[l];
+            u32 n = 0;
+            u32 k = 0;
+            for (u32 i = 0; i < res->tmp.len && k < list->len; i++) {
+                k = search_gallop(list->data, list->len, k, res->tmp.data[i]);
+                if (k < list->len && list->data[k] == res->tmp.data[i]) res->tmp.data[n++] = res->tmp.data[i];
+            }
+            res->tmp.len = n;
+        }
+    }
+}
+
+// Only keeps those previous results (in res->tmp), that also match the current (longer) query
+static void search_refine(const SearchIndex *index, SearchRes *res, u32 prev_prefixed_count)
+{
+    // Previous prefix-matches either stay prefix-matches, turn into substring-matches or are dropped
+    for (u32 i = 0; i < prev_prefixed_count; i++) {
+        u32 id = res->tmp.data[i];
+        const char *name = search_name(index, id);
+        if (strncmp(name, res->query, res->query_len) == 0) ail_da_push(&res->idxs, id);
+        else if (name[0] && strstr(&name[1], res->query)) ail_da_push(&res->others, id);
+    }
+    // Previous substring-matches can't have become prefix-matches
+    u32 n = prev_prefixed_count;
+    for (u32 i = prev_prefixed_count; i < res->tmp.len; i++) {
+        u32 id = res->tmp.data[i];
+        if (strstr(search_name(index, id), res->query)) res->tmp.data[n++] = id;
+    }
+    // Merge both groups of substring-matches back into library-order
+    u32 a = 0, b = prev_prefixed_count;
+    u32 a_len = res->others.len;
+    res->prefixed_count = res->idxs.len;
+    ail_da_maybe_grow(&res->idxs, a_len + n - prev_prefixed_count);
+    while (a < a_len && b < n) {
+        if (res->others.data[a] < res->tmp.data[b]) res->idxs.data[res->idxs.len++] = res->others.data[a++];
+        else res->idxs.data[res->idxs.len++] = res->tmp.data[b++];
+    }
+    while (a < a_len) res->idxs.data[res->idxs.len++] = res->others.data[a++];
+    while (b < n)     res->idxs.data[res->idxs.len++] = res->tmp.data[b++];
+}
+
+// Finds all songs whose name contains `query` (ignoring case)
+// The result is written into `res`, whose buffers are reused. If `res` contains the result for a prefix of `query`, only those results are filtered
+void search_index_query(SearchIndex *index, const char *query, SearchRes *res)
+{
+    if (!res->idxs.data) {
+        res->idxs   = ail_da_new(u32);
+        res->others = ail_da_new(u32);
+        res->tmp    = ail_da_new(u32);
+        res->bits   = ail_da_new_empty(u64);
+    }
+
+    char folded[SEARCH_MAX_QUERY_LEN + 1];
+    u32  len = 0;
+    for (; query[len] && len < SEARCH_MAX_QUERY_LEN; len++) folded[len] = search_fold_char(query[len]);
+    folded[len] = 0;
+
+    bool can_refine = res->count == index->count && res->query_len > 0 && len >= res->query_len && memcmp(folded, res->query, res->query_len) == 0;
+    u32  prev_prefixed_count = res->prefixed_count;
+    memcpy(res->query, folded, len + 1);
+    res->query_len      = len;
+    res->count          = index->count;
+    res->prefixed_count = 0;
+
+    AIL_SWAP_PORTABLE(AIL_DA(u32), res->idxs, res->tmp);
+    res->idxs.len   = 0;
+    res->others.len = 0;
+    if (!len) return;
+
+    if (can_refine) {
+        search_refine(index, res, prev_prefixed_count);
+    } else {
+        res->tmp.len = 0;
+        search_collect_candidates(index, res);
+        search_verify_candidates(index, res);
+        res->prefixed_count = res->idxs.len;
+        ail_da_pushn(&res->idxs, res->others.data, res->others.len);
+    }
+}
+
+static inline u32 search_name_len(const SearchIndex *index, u32 id)
+{
+    u32 end = (id + 1 < index->count) ? index->name_offsets.data[id + 1] : index->names.len;
+    return end - index->name_offsets.data[id] - 1;
+}
+
+static inline bool fuzzy_is_better(FuzzyMatch a, FuzzyMatch b)
+{
+    if (a.dist != b.dist) return a.dist < b.dist;
+    if (a.len  != b.len)  return a.len  < b.len;
+    return a.idx < b.idx;
+}
+
+// Adds the match to the top-k, which is kept as a max-heap (worst match at the root) while searching
+static void fuzzy_heap_push(FuzzyRes *res, FuzzyMatch m)
+{
+    u32 i;
+    if (res->count < FUZZY_TOP_K) {
+        i = res->count++;
+        while (i > 0 && fuzzy_is_better(res->matches[(i - 1)/2], m)) {
+            res->matches[i] = res->matches[(i - 1)/2];
+            i = (i - 1)/2;
+        }
+    } else {
+        if (!fuzzy_is_better(m, res->matches[0])) return;
+        i = 0;
+        while (true) {
+            u32 child = 2*i + 1;
+            if (child >= FUZZY_TOP_K) break;
+            if (child + 1 < FUZZY_TOP_K && fuzzy_is_better(res->matches[child], res->matches[child + 1])) child++;
+            if (!fuzzy_is_better(m, res->matches[child])) break;
+            res->matches[i] = res->matches[child];
+            i = child;
+        }
+    }
+    res->matches[i] = m;
+}
+
+static inline void fuzzy_add_match(const SearchIndex *index, FuzzyRes *res, u32 id, u32 dist, u32 max_dist)
+{
+    if (dist == 0 || dist > max_dist) return;
+    FuzzyMatch match = {
+        .idx  = id,
+        .dist = dist,
+        .len  = AIL_MIN(search_name_len(index, id), UINT16_MAX),
+    };
+    fuzzy_heap_push(res, match);
+}
+
+// Computes the smallest edit-distance between the pattern (given as `peq` bitmasks) and any substring of each name
+// FUZZY_LANES names are stepped through in lockstep, so that the dependency chains of the lanes can overlap.
+// Whenever a lane reaches the end of its name, it continues with the next name that wasn't looked at yet
+// Returns false if the scan was cancelled
+static bool fuzzy_scan(const SearchIndex *index, const u64 peq[256], u32 m, u32 max_dist, FuzzyRes *res, u32 generation)
+{
+    static const u8 empty = 0;
+    const u8 *text[FUZZY_LANES];
+    u32 ids[FUZZY_LANES];
+    u64 pv[FUZZY_LANES], mv[FUZZY_LANES];
+    u32 score[FUZZY_LANES], best[FUZZY_LANES];
+    u32 next   = 0;
+    u32 active = 0;
+    for (u32 l = 0; l < FUZZY_LANES; l++) {
+        ids[l]   = next;
+        text[l]  = (next < index->count) ? (const u8 *)search_name(index, next) : &empty;
+        active  += next < index->count;
+        next    += next < index->count;
+        pv[l]    = ~0ull;
+        mv[l]    = 0;
+        score[l] = m;
+        best[l]  = m;
+    }
+
+    const u32 shift = m - 1;
+    while (active) {
+        for (u32 l = 0; l < FUZZY_LANES; l++) {
+            // Lanes without any names left keep reading the same terminator, whose mask is 0
+            u64 eq = peq[*text[l]];
+            u64 xv = eq | mv[l];
+            u64 xh = (((eq & pv[l]) + pv[l]) ^ pv[l]) | eq;
+            u64 ph = mv[l] | ~(xh | pv[l]);
+            u64 mh = pv[l] & xh;
+            score[l] += (u32)((ph >> shift) & 1) - (u32)((mh >> shift) & 1);
+            ph <<= 1; // No carry into the first row, since a match may start anywhere in the name
+            mh <<= 1;
+            pv[l]   = mh | ~(xv | ph);
+            mv[l]   = ph & xv;
+            best[l] = AIL_MIN(best[l], score[l]);
+            text[l] += *text[l] != 0;
+        }
+        for (u32 l = 0; l < FUZZY_LANES; l++) {
+            if (AIL_LIKELY(*text[l]) || text[l] == &empty) continue;
+            fuzzy_add_match(index, res, ids[l], best[l], max_dist);
+            if (next < index->count) {
+                if (AIL_UNLIKELY(next % FUZZY_CANCEL_INTERVAL == 0) && __atomic_load_n(&search_generation, __ATOMIC_RELAXED) != generation) return false;
+                ids[l]  = next;
+                text[l] = (const u8 *)search_name(index, next++);
+            } else {
+                text[l] = &empty;
+                active--;
+            }
+            pv[l]    = ~0ull;
+            mv[l]    = 0;
+            score[l] = m;
+            best[l]  = m;
+        }
+    }
+    return true;
+}
+
+// Finds the FUZZY_TOP_K names closest to `query`, that don't contain it exactly (those are already found by search_index_query)
+// At most a third of the query's characters may be wrong for a name to count as a match
+// Returns false if the search was cancelled, because `generation` is not the latest search-generation anymore
+bool fuzzy_search(const SearchIndex *index, const char *query, FuzzyRes *res, u32 generation)
+{
+    res->count = 0;
+    u32 m = 0;
+    for (; query[m] && m < FUZZY_MAX_QUERY_LEN; m++) res->query[m] = search_fold_char(query[m]);
+    res->query[m] = 0;
+    if (m < FUZZY_MIN_QUERY_LEN || query[m]) return true;
+
+    u64 peq[256] = { 0 };
+    for (u32 i = 0; i < m; i++) peq[(u8)res->query[i]] |= 1ull << i;
+    peq[0] = 0;
+    u32 max_dist = m/3;
+
+    if (!fuzzy_scan(index, peq, m, max_dist, res, generation)) return false;
+
+    // Turn the heap into a list sorted from best to worst
+    for (u32 i = 1; i < res->count; i++) {
+        FuzzyMatch x = res->matches[i];
+        u32 j = i;
+        for (; j > 0 && fuzzy_is_better(x, res->matches[j - 1]); j--) res->matches[j] = res->matches[j - 1];
+        res->matches[j] = x;
+    }
+    return true;
+}
+
+// Hands the exact (and if already available the fuzzy) results for the query to the UI
+static void search_publish(const SearchQuery *query, const SearchRes *exact, const FuzzyRes *fuzzy)
+{
+    SearchResults *out = &search_results[search_results_tb.back];
+    out->idxs.len = 0;
+    ail_da_pushn(&out->idxs, exact->idxs.data, exact->idxs.len);
+    out->exact_count = exact->idxs.len;
+    out->fuzzy_done  = fuzzy != NULL;
+    out->generation  = query->generation;
+    if (fuzzy) {
+        ail_da_maybe_grow(&out->idxs, fuzzy->count);
+        for (u32 i = 0; i < fuzzy->count; i++) out->idxs.data[out->idxs.len++] = fuzzy->matches[i].idx;
+    }
+    triple_buffer_publish(&search_results_tb);
+}
+
+// Blocks until a new query was requested or `timeout_ms` passed (or forever if timeout_ms is 0)
+// Returns true if the search thread was woken up by a new query
+// @Note: search_request posts once per query, but only the latest one is picked up, so the posts for skipped queries are consumed without counting as a new query
+static bool search_thread_wait(u32 timeout_ms)
+{
+    struct timespec deadline;
+    if (timeout_ms) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        deadline.tv_sec  += timeout_ms / 1000 + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+    }
+    while (true) {
+        int res;
+        if (!timeout_ms) while ((res = sem_wait(&search_wakeup)) != 0 && errno == EINTR) {}
+        else while ((res = sem_timedwait(&search_wakeup, &deadline)) != 0 && errno == EINTR) {}
+        if (res != 0) return false;
+        if (triple_buffer_acquire(&search_queries_tb)) return true;
+    }
+}
+
+// Needs to be called before search_thread_main is started
+void search_thread_init(void)
+{
+    sem_init(&search_wakeup, 0, 0);
+    for (u32 i = 0; i < AIL_ARRLEN(search_results); i++) search_results[i].idxs = ail_da_new(u32);
+}
+
+// Main loop for the Search Thread
+// Always works on the latest requested query: the exact results are published right away,
+// the fuzzy results only once no new query was requested for SEARCH_DEBOUNCE_MS
+void *search_thread_main(void *args)
+{
+    AIL_UNUSED(args);
+    static SearchRes exact = { 0 };
+    static FuzzyRes  fuzzy = { 0 };
+    while (true) {
+        if (!search_thread_wait(0)) continue;
+        bool has_new_query;
+        do {
+            SearchQuery *query = &search_queries[search_queries_tb.front];
+            while (pthread_mutex_lock(&search_index_mutex) != 0) {}
+            search_index_query(&search_index, query->text, &exact);
+            while (pthread_mutex_unlock(&search_index_mutex) != 0) {}
+            search_publish(query, &exact, NULL);
+
+            has_new_query = search_thread_wait(SEARCH_DEBOUNCE_MS);
+            if (!has_new_query) {
+                while (pthread_mutex_lock(&search_index_mutex) != 0) {}
+                bool done = fuzzy_search(&search_index, query->text, &fuzzy, query->generation);
+                while (pthread_mutex_unlock(&search_index_mutex) != 0) {}
+                if (done) {
+                    search_publish(query, &exact, &fuzzy);
+                } else {
+                    has_new_query = triple_buffer_acquire(&search_queries_tb);
+                    // Without a newer query, the search was cancelled because the library changed, so the same query is searched again in the changed library
+                    if (!has_new_query) {
+                        query->generation = __atomic_load_n(&search_generation, __ATOMIC_RELAXED);
+                        has_new_query     = true;
+                    }
+                }
+            }
+        } while (has_new_query);
+    }
+    return NULL;
+}
+
+// Called by the UI thread - never blocks
+// Replaces any query, that the search thread didn't start working on yet, and cancels the fuzzy search for older queries
+void search_request(const char *query)
+{
+    SearchQuery *q = &search_queries[search_queries_tb.back];
+    u32 len = 0;
+    for (; query[len] && len < SEARCH_MAX_QUERY_LEN; len++) q->text[len] = query[len];
+    q->text[len]  = 0;
+    q->generation = __atomic_add_fetch(&search_generation, 1, __ATOMIC_RELAXED);
+    triple_buffer_publish(&search_queries_tb);
+    sem_post(&search_wakeup);
+}
+
+// Cancels any running fuzzy search - used before changing the library
+void search_cancel(void)
+{
+    __atomic_add_fetch(&search_generation, 1, __ATOMIC_RELAXED);
+}
+
+// Called by the UI thread - returns the latest results the search thread published
+const SearchResults *search_poll_results(void)
+{
+    triple_buffer_acquire(&search_results_tb);
+    return &search_results[search_results_tb.front];
+}
+
+void library_views_init(LibraryViews *views)
+{
+    views->stats = ail_da_new(SongStats);
+    for (u32 k = 0; k < LIBRARY_SORT_COUNT; k++) views->perms[k] = ail_da_new(u32);
+    views->sorted = true;
+}
+
+// Returns whether song a comes before song b when sorting by `key`
+// Ties are always broken by the order in which the songs were added, so that every permutation is unique
+static bool library_views_less(const LibraryViews *views, LibrarySortKey key, u32 a, u32 b)
+{
+    SongStats sa = views->stats.data[a];
+    SongStats sb = views->stats.data[b];
+    switch (key) {
+        case LIBRARY_SORT_ADDED:
+        case LIBRARY_SORT_COUNT:
+            break;
+        case LIBRARY_SORT_NAME: {
+            // Names are compared case-insensitively via their folded copies in the search index
+            int cmp = strcmp(search_name(&search_index, a), search_name(&search_index, b));
+            if (cmp) return cmp < 0;
+        } break;
+        case LIBRARY_SORT_DURATION:
+            if (sa.len != sb.len) return sa.len < sb.len;
+            break;
+        case LIBRARY_SORT_RECENT:
+            if (sa.last_played != sb.last_played) return sa.last_played < sb.last_played;
+            break;
+        case LIBRARY_SORT_DENSITY: {
+            // Compares cmds_a/len_a with cmds_b/len_b without dividing - songs without any length are treated as having no density at all
+            u64 da = sa.len ? (u64)sa.cmds_count*AIL_MAX(sb.len, 1) : 0;
+            u64 db = sb.len ? (u64)sb.cmds_count*AIL_MAX(sa.len, 1) : 0;
+            if (da != db) return da < db;
+        } break;
+    }
+    return a < b;
+}
+
+// Inserts the song at the correct position into the permutation via binary search
+static void library_views_insert(LibraryViews *views, LibrarySortKey key, u32 idx)
+{
+    AIL_DA(u32) *perm = &views->perms[key];
+    u32 lo = 0, hi = perm->len;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo)/2;
+        if (library_views_less(views, key, perm->data[mid], idx)) lo = mid + 1;
+        else hi = mid;
+    }
+    ail_da_maybe_grow(perm, 1);
+    memmove(&perm->data[lo + 1], &perm->data[lo], (perm->len - lo)*sizeof(u32));
+    perm->data[lo] = idx;
+    perm->len++;
+}
+
+// Adds the song at index `views->stats.len` in the library - its name needs to already be in the search index
+void library_views_add(LibraryViews *views, SongStats stats)
+{
+    u32 idx = views->stats.len;
+    ail_da_push(&views->stats, stats);
+    for (u32 k = 0; k < LIBRARY_SORT_COUNT; k++) {
+        if (views->sorted && k != LIBRARY_SORT_ADDED) library_views_insert(views, k, idx);
+        else ail_da_push(&views->perms[k], idx);
+    }
+}
+
+static const LibraryViews *library_views_qsort_views;
+static LibrarySortKey      library_views_qsort_key;
+static int library_views_qsort_cmp(const void *a, const void *b)
+{
+    u32 x = *(const u32 *)a;
+    u32 y = *(const u32 *)b;
+    if (x == y) return 0;
+    return library_views_less(library_views_qsort_views, library_views_qsort_key, x, y) ? -1 : 1;
+}
+
+// Sorts all permutations from scratch - used after adding many songs at once (e.g. when loading the library)
+void library_views_sort(LibraryViews *views)
+{
+    library_views_qsort_views = views;
+    for (u32 k = 0; k < LIBRARY_SORT_COUNT; k++) {
+        if (k == LIBRARY_SORT_ADDED) continue;
+        library_views_qsort_key = k;
+        qsort(views->perms[k].data, views->perms[k].len, sizeof(u32), library_views_qsort_cmp);
+    }
+    views->sorted = true;
+}
+
+// Moves the song to the end of the LIBRARY_SORT_RECENT permutation
+void library_views_mark_played(LibraryViews *views, u32 idx, u64 timestamp)
+{
+    AIL_DA(u32) *perm = &views->perms[LIBRARY_SORT_RECENT];
+    // Even if the system's clock was turned back, the song needs to end up as the most recently played one
+    u32 last = perm->data[perm->len - 1];
+    if (last != idx && timestamp <= views->stats.data[last].last_played) timestamp = views->stats.data[last].last_played + 1;
+    views->stats.data[idx].last_played = timestamp;
+    u32 pos = 0;
+    while (perm->data[pos] != idx) pos++;
+    memmove(&perm->data[pos], &perm->data[pos + 1], (perm->len - pos - 1)*sizeof(u32));
+    perm->data[perm->len - 1] = idx;
+}
+
+LibraryView library_view(const LibraryViews *views, LibrarySortKey key, bool reversed)
+{
+    return (LibraryView) {
+        .idxs     = views->perms[key].data,
+        .count    = views->perms[key].len,
+        .reversed = reversed,
+    };
+}
+
+static inline u32 library_view_get(LibraryView view, u32 i)
+{
+    return view.reversed ? view.idxs[view.count - 1 - i] : view.idxs[i];
+}
+
+void tags_init(TagIndex *index)
+{
+    index->tags     = ail_da_new(Tag);
+    index->bits_cap = 0;
+    index->res      = NULL;
+    index->any      = NULL;
+    index->filtered = NULL;
+    tags_reserve(index, 1024);
+}
+
+// Makes sure that filters can be evaluated over `songs_count` songs without allocating
+void tags_reserve(TagIndex *index, u32 songs_count)
+{
+    if (songs_count <= index->bits_cap) return;
+    u32 cap = AIL_MAX(index->bits_cap, 64);
+    while (cap < songs_count) cap *= 2;
+    index->res      = realloc(index->res,      (cap/64)*sizeof(u64));
+    index->any      = realloc(index->any,      (cap/64)*sizeof(u64));
+    index->filtered = realloc(index->filtered, cap*sizeof(u32));
+    index->bits_cap = cap;
+}
+
+static inline bool tag_names_eq(const char *tag_name, const char *name, u32 name_len)
+{
+    for (u32 i = 0; i < name_len; i++) {
+        if (tag_name[i] != search_fold_char(name[i])) return false;
+    }
+    return tag_name[name_len] == 0;
+}
+
+// Returns the index of the tag with the given name (compared case-insensitively) or -1 if no such tag exists
+static i32 tag_find(const TagIndex *index, const char *name, u32 name_len)
+{
+    for (u32 i = 0; i < index->tags.len; i++) {
+        if (tag_names_eq(index->tags.data[i].name, name, name_len)) return i;
+    }
+    return -1;
+}
+
+u32 tag_get_or_add(TagIndex *index, const char *name, u32 name_len)
+{
+    i32 id = tag_find(index, name, name_len);
+    if (id >= 0) return id;
+    char *folded = malloc(name_len + 1);
+    for (u32 i = 0; i < name_len; i++) folded[i] = search_fold_char(name[i]);
+    folded[name_len] = 0;
+    Tag tag = {
+        .name       = folded,
+        .containers = ail_da_new(TagContainer),
+    };
+    ail_da_push(&index->tags, tag);
+    return index->tags.len - 1;
+}
+
+void tag_add_song(Tag *tag, u32 idx)
+{
+    u16 key = idx >> TAG_CHUNK_BITS;
+    u16 low = idx & ((1 << TAG_CHUNK_BITS) - 1);
+    u32 lo = 0, hi = tag->containers.len;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo)/2;
+        if (tag->containers.data[mid].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == tag->containers.len || tag->containers.data[lo].key != key) {
+        ail_da_maybe_grow(&tag->containers, 1);
+        memmove(&tag->containers.data[lo + 1], &tag->containers.data[lo], (tag->containers.len - lo)*sizeof(TagContainer));
+        tag->containers.data[lo] = (TagContainer) { .key = key, .arr = ail_da_new(u16) };
+        tag->containers.len++;
+    }
+    TagContainer *c = &tag->containers.data[lo];
+
+    if (!c->is_bitmap) {
+        u32 pos_lo = 0, pos_hi = c->arr.len;
+        while (pos_lo < pos_hi) {
+            u32 mid = pos_lo + (pos_hi - pos_lo)/2;
+            if (c->arr.data[mid] < low) pos_lo = mid + 1;
+            else pos_hi = mid;
+        }
+        if (pos_lo < c->arr.len && c->arr.data[pos_lo] == low) return;
+        if (c->card < TAG_ARRAY_MAX_CARD) {
+            ail_da_maybe_grow(&c->arr, 1);
+            memmove(&c->arr.data[pos_lo + 1], &c->arr.data[pos_lo], (c->arr.len - pos_lo)*sizeof(u16));
+            c->arr.data[pos_lo] = low;
+            c->arr.len++;
+            c->card++;
+            return;
+        }
+        // The array would now take up more space than a bitmap
+        c->bits = calloc(TAG_CHUNK_WORDS, sizeof(u64));
+        for (u32 i = 0; i < c->arr.len; i++) c->bits[c->arr.data[i] >> 6] |= 1ull << (c->arr.data[i] & 63);
+        ail_da_free(&c->arr);
+        c->is_bitmap = true;
+    }
+    u64 bit = 1ull << (low & 63);
+    if (!(c->bits[low >> 6] & bit)) {
+        c->bits[low >> 6] |= bit;
+        c->card++;
+    }
+}
+
+// Returns the length of the tag's name, if a tag term starts at `text` - a `#` followed by a digit (like in "Symphony #5") doesn't start a tag
+static inline u32 tag_term_len(const char *text)
+{
+    if (text[0] != '#' || !text[1] || text[1] == ' ' || (text[1] >= '0' && text[1] <= '9')) return 0;
+    u32 len = 1;
+    while (text[len + 1] && text[len + 1] != ' ') len++;
+    return len;
+}
+
+// Writes `text` without any `#tag` terms into `name`, which needs to have space for at least strlen(text)+1 characters
+// If `tag_ids` isn't NULL, the ids of all tags in `text` (creating any tags, that don't exist yet) are written into it
+// Returns the amount of tags in `text`
+u32 tags_strip_name(TagIndex *index, const char *text, char *name, u32 *tag_ids, u32 tag_ids_cap)
+{
+    u32 n = 0, tags_count = 0;
+    for (u32 i = 0; text[i];) {
+        u32 term_len = (i == 0 || text[i - 1] == ' ') ? tag_term_len(&text[i]) : 0;
+        if (!term_len) {
+            name[n++] = text[i++];
+            continue;
+        }
+        if (tag_ids && tags_count < tag_ids_cap) tag_ids[tags_count] = tag_get_or_add(index, &text[i + 1], term_len);
+        tags_count++;
+        i += 1 + term_len;
+        while (text[i] == ' ') i++;
+    }
+    while (n > 0 && name[n - 1] == ' ') n--;
+    name[n] = 0;
+    return tags_count;
+}
+
+// Splits the text from the search box into a TagFilter and the remaining text, that is searched for in the songs' names
+// `#tag` requires the tag, `~#tag` requires at least one of all tags written this way and `-#tag` excludes all songs with the tag
+// Returns whether the text contained any tag terms
+bool tag_filter_parse(const TagIndex *index, const char *text, TagFilter *filter, char *rest, u32 rest_cap)
+{
+    memset(filter, 0, sizeof(*filter));
+    bool any_terms = false;
+    u32  n = 0;
+    for (u32 i = 0; text[i];) {
+        bool at_token = i == 0 || text[i - 1] == ' ';
+        u32  prefix   = (at_token && (text[i] == '~' || text[i] == '-')) ? 1 : 0;
+        u32  term_len = at_token ? tag_term_len(&text[i + prefix]) : 0;
+        if (!term_len) {
+            if (n + 1 < rest_cap) rest[n++] = text[i];
+            i++;
+            continue;
+        }
+        any_terms = true;
+        i32 id = tag_find(index, &text[i + prefix + 1], term_len);
+        switch (prefix ? text[i] : '#') {
+            case '#':
+                if (id < 0) filter->empty = true;
+                else if (filter->all_count < TAG_FILTER_MAX_TERMS) filter->all[filter->all_count++] = id;
+                break;
+            case '~':
+                // Unknown tags still count as `any` term, so that a filter with only unknown alternatives lets no song pass
+                if (filter->any_count < TAG_FILTER_MAX_TERMS) filter->any[filter->any_count++] = id < 0 ? UINT32_MAX : (u32)id;
+                break;
+            case '-':
+                if (id >= 0 && filter->none_count < TAG_FILTER_MAX_TERMS) filter->none[filter->none_count++] = id;
+                break;
+        }
+        i += prefix + 1 + term_len;
+        while (text[i] == ' ') i++;
+    }
+    while (n > 0 && rest[n - 1] == ' ') n--;
+    rest[n] = 0;
+    return any_terms;
+}
+
+// bits &= tag
+static void tag_and_into(const Tag *tag, u64 *bits, u32 words)
+{
+    u32 w = 0;
+    for (u32 i = 0; i < tag->containers.len; i++) {
+        const TagContainer *c = &tag->containers.data[i];
+        u32 start = (u32)c->key*TAG_CHUNK_WORDS;
+        if (start >= words) break;
+        u32 end = AIL_MIN(start + TAG_CHUNK_WORDS, words);
+        memset(&bits[w], 0, (start - w)*sizeof(u64));
+        if (c->is_bitmap) {
+            for (u32 j = start; j < end; j++) bits[j] &= c->bits[j - start];
+        } else {
+            u32 k = 0;
+            for (u32 j = start; j < end; j++) {
+                u64 mask = 0;
+                while (k < c->card && (u32)(c->arr.data[k] >> 6) == j - start) { mask |= 1ull << (c->arr.data[k] & 63); k++; }
+                bits[j] &= mask;
+            }
+        }
+        w = end;
+    }
+    memset(&bits[w], 0, (words - w)*sizeof(u64));
+}
+
+// bits |= tag
+static void tag_or_into(const Tag *tag, u64 *bits, u32 words)
+{
+    for (u32 i = 0; i < tag->containers.len; i++) {
+        const TagContainer *c = &tag->containers.data[i];
+        u32 start = (u32)c->key*TAG_CHUNK_WORDS;
+        if (start >= words) break;
+        u32 end = AIL_MIN(start + TAG_CHUNK_WORDS, words);
+        if (c->is_bitmap) {
+            for (u32 j = start; j < end; j++) bits[j] |= c->bits[j - start];
+        } else {
+            for (u32 k = 0; k < c->card; k++) {
+                u32 j = start + (c->arr.data[k] >> 6);
+                if (j < end) bits[j] |= 1ull << (c->arr.data[k] & 63);
+            }
+        }
+    }
+}
+
+// bits &= ~tag
+static void tag_andnot_into(const Tag *tag, u64 *bits, u32 words)
+{
+    for (u32 i = 0; i < tag->containers.len; i++) {
+        const TagContainer *c = &tag->containers.data[i];
+        u32 start = (u32)c->key*TAG_CHUNK_WORDS;
+        if (start >= words) break;
+        u32 end = AIL_MIN(start + TAG_CHUNK_WORDS, words);
+        if (c->is_bitmap) {
+            for (u32 j = start; j < end; j++) bits[j] &= ~c->bits[j - start];
+        } else {
+            for (u32 k = 0; k < c->card; k++) {
+                u32 j = start + (c->arr.data[k] >> 6);
+                if (j < end) bits[j] &= ~(1ull << (c->arr.data[k] & 63));
+            }
+        }
+    }
+}
+
+// Evaluates the filter for the first `songs_count` songs - bit i of the returned bitset is set if song i passes the filter
+// The returned bitset is owned by the index and only stays valid until the filter is evaluated again
+const u64 *tag_filter_eval(TagIndex *index, const TagFilter *filter, u32 songs_count)
+{
+    AIL_ASSERT(songs_count <= index->bits_cap);
+    u32  words = (songs_count + 63)/64;
+    u64 *res   = index->res;
+    if (filter->empty) {
+        memset(res, 0, words*sizeof(u64));
+        return res;
+    }
+    memset(res, 0xff, words*sizeof(u64));
+    if (songs_count % 64) res[words - 1] = (1ull << (songs_count % 64)) - 1;
+    for (u32 i = 0; i < filter->all_count; i++) tag_and_into(&index->tags.data[filter->all[i]], res, words);
+    if (filter->any_count) {
+        memset(index->any, 0, words*sizeof(u64));
+        for (u32 i = 0; i < filter->any_count; i++) {
+            if (filter->any[i] != UINT32_MAX) tag_or_into(&index->tags.data[filter->any[i]], index->any, words);
+        }
+        for (u32 i = 0; i < words; i++) res[i] &= index->any[i];
+    }
+    for (u32 i = 0; i < filter->none_count; i++) tag_andnot_into(&index->tags.data[filter->none[i]], res, words);
+    return res;
+}
+
+// Writes all songs from the view, that passed the filter, into index->filtered (keeping their order) and returns their amount
+u32 tag_filter_view(TagIndex *index, const u64 *bits, LibraryView view)
+{
+    u32 n = 0;
+    for (u32 i = 0; i < view.count; i++) {
+        u32 idx = library_view_get(view, i);
+        index->filtered[n] = idx;
+        n += (bits[idx >> 6] >> (idx & 63)) & 1;
+    }
+    return n;
+}
+
+// Containers are written as-is, so that loading the tags doesn't need to rebuild any bitmaps
+void tags_write(const TagIndex *index, AIL_Buffer *buf)
+{
+    ail_buf_write4lsb(buf, index->tags.len);
+    for (u32 i = 0; i < index->tags.len; i++) {
+        Tag tag = index->tags.data[i];
+        u32 name_len = strlen(tag.name);
+        ail_buf_write4lsb(buf, name_len);
+        ail_buf_writestr(buf, tag.name, name_len);
+        ail_buf_write4lsb(buf, tag.containers.len);
+        for (u32 j = 0; j < tag.containers.len; j++) {
+            TagContainer c = tag.containers.data[j];
+            ail_buf_write2lsb(buf, c.key);
+            ail_buf_write1(buf, c.is_bitmap);
+            ail_buf_write4lsb(buf, c.card);
+            if (c.is_bitmap) {
+                for (u32 k = 0; k < TAG_CHUNK_WORDS; k++) ail_buf_write8lsb(buf, c.bits[k]);
+            } else {
+                for (u32 k = 0; k < c.card; k++) ail_buf_write2lsb(buf, c.arr.data[k]);
+            }
+        }
+    }
+}
+
+void tags_read(TagIndex *index, AIL_Buffer *buf)
+{
+    u32 n = ail_buf_read4lsb(buf);
+    ail_da_maybe_grow(&index->tags, n);
+    for (u32 i = 0; i < n; i++) {
+        u32 name_len = ail_buf_read4lsb(buf);
+        Tag tag = {
+            .name       = ail_buf_readstr(buf, name_len),
+            .containers = ail_da_new(TagContainer),
+        };
+        u32 containers_count = ail_buf_read4lsb(buf);
+        ail_da_maybe_grow(&tag.containers, containers_count);
+        for (u32 j = 0; j < containers_count; j++) {
+            TagContainer c = { 0 };
+            c.key       = ail_buf_read2lsb(buf);
+            c.is_bitmap = ail_buf_read1(buf);
+            c.card      = ail_buf_read4lsb(buf);
+            if (c.is_bitmap) {
+                c.bits = malloc(TAG_CHUNK_WORDS*sizeof(u64));
+                for (u32 k = 0; k < TAG_CHUNK_WORDS; k++) c.bits[k] = ail_buf_read8lsb(buf);
+            } else {
+                c.arr = ail_da_new_with_cap(u16, AIL_MAX(c.card, 1));
+                for (u32 k = 0; k < c.card; k++) c.arr.data[k] = ail_buf_read2lsb(buf);
+                c.arr.len = c.card;
+            }
+            ail_da_push(&tag.containers, c);
+        }
+        ail_da_push(&index->tags, tag);
+    }
+}
@@ -15,8 +15,10 @@ static RL_MouseCursor cursor;
 
 #include "header.h"
 #include <math.h>   // For sinf, cosf
+#include <time.h>   // For time
 #include "midi.c"
 #include "comm.c"
+#include "library.c"
 
 
 #define PRIMARY_COLOR          (RL_Color) { 0xff, 0x8c, 0x00, 0xff }
@@ -48,15 +50,16 @@ typedef enum {
 
 static inline bool draw_icon(RL_Texture icon, u8 texture_idx, f32 x, f32 y, f32 icon_size, bool *pressed);
 RL_Texture get_texture(const char *filepath);
-AIL_DA(Song) search_songs(const char *substr);
 void draw_loading_anim(RL_Rectangle bounds, bool start_new);
 bool is_songname_taken(const char *name);
-void  load_pidi(Song *song);
+AIL_Buffer load_pidi(Song *song);
 bool  save_pidi(Song song);
 bool  save_library();
 void *load_library(void *arg);
 void *parse_file(void *_filepath);
 void *util_memadd(const void *a, u64 a_size, const void *b, u64 b_size);
+void  library_add_song(Song song, SongStats stats);
+u32   read_pidi_cmds_count(const char *song_name);
 
 
 // These variables are all accessed by main and parse_file (and the functions called by parse_file)
@@ -82,6 +85,7 @@ int main(void)
 
     u8   library_updated  = 0;
     bool is_music_playing = false;
+    u32  song_id          = 0; // Amount of songs sent to the communication thread, which tells whether its state already belongs to the current song
     f64 cur_music_time = 0; // in ms
     f64 cur_music_len  = 0; // in ms
 
@@ -95,9 +99,13 @@ int main(void)
     pthread_t fileParsingThread;
     pthread_t loadLibraryThread;
     pthread_t commThread;
+    pthread_t searchThread;
 
     pthread_create(&loadLibraryThread, NULL, load_library, NULL);
+    comm_init();
     pthread_create(&commThread, NULL, comm_thread_main, NULL);
+    search_thread_init();
+    pthread_create(&searchThread, NULL, search_thread_main, NULL);
 
     // Load Icons
 #define ICON_TEXTURE_SIZE 512
@@ -106,6 +114,7 @@ int main(void)
     RL_Texture volume_icon = get_texture("assets/volume.png");
     RL_Texture back_icon   = get_texture("assets/back.png");
     bool muted  = false;
+    bool paused = false;
     f32  speed  = 1.0f;
     f32  volume = 1.0f;
     set_volume(volume);
@@ -203,6 +212,28 @@ int main(void)
         .defaultStyle = style_default,
         .hovered      = style_default,
     };
+    static const char *sort_btn_msgs[LIBRARY_SORT_COUNT] = {
+        [LIBRARY_SORT_ADDED]    = "Added",
+        [LIBRARY_SORT_NAME]     = "Name",
+        [LIBRARY_SORT_DURATION] = "Length",
+        [LIBRARY_SORT_RECENT]   = "Recent",
+        [LIBRARY_SORT_DENSITY]  = "Density",
+    };
+    // Default direction for each sort order - the most recently played songs should be shown first for example
+    // Songs are still shown in the order in which they were added by default
+    static const bool sort_reversed[LIBRARY_SORT_COUNT] = {
+        [LIBRARY_SORT_RECENT] = true,
+    };
+    LibrarySortKey sort_key = LIBRARY_SORT_ADDED;
+    AIL_Gui_Style style_sort_default = ail_gui_cloneStyle(style_search);
+    style_sort_default.hAlign = AIL_GUI_ALIGN_C;
+    AIL_Gui_Style style_sort_hover = ail_gui_cloneStyle(style_sort_default);
+    style_sort_hover.bg = RL_GRAY;
+    AIL_Gui_Label sort_button = {
+        .text         = ail_da_from_parts(char, (char *)sort_btn_msgs[sort_key], strlen(sort_btn_msgs[sort_key]), strlen(sort_btn_msgs[sort_key]), &ail_default_allocator),
+        .defaultStyle = style_sort_default,
+        .hovered      = style_sort_hover,
+    };
     char *upload_btn_msg = "Upload";
     AIL_Gui_Label upload_button = {
         .text         = ail_da_from_parts(char, upload_btn_msg, strlen(upload_btn_msg), strlen(upload_btn_msg), &ail_default_allocator),
@@ -216,6 +247,7 @@ int main(void)
     bool view_prev_changed = false;
     while (!RL_WindowShouldClose()) {
         RL_BeginDrawing();
+        const CommState *comm_state = comm_poll_state();
 
         bool is_resized = RL_IsWindowResized() || is_first_frame;
         is_first_frame = false;
@@ -310,6 +342,14 @@ int main(void)
                     upload_button.bounds.height = header_bounds.height - upload_button.bounds.y - upload_button.hovered.border_width - header_y_pad;
                     upload_button.bounds.width  = upload_button.hovered.border_width*2 + upload_button.hovered.pad*2 + upload_txt_size.x;
                     upload_button.bounds.x      = header_bounds.x + header_bounds.width - header_y_pad - upload_button.bounds.width;
+                    f32 sort_txt_width = 0;
+                    for (u32 k = 0; k < LIBRARY_SORT_COUNT; k++) {
+                        sort_txt_width = AIL_MAX(sort_txt_width, MeasureTextEx(sort_button.hovered.font, sort_btn_msgs[k], sort_button.hovered.font_size, sort_button.hovered.cSpacing).x);
+                    }
+                    sort_button.bounds.y      = upload_button.bounds.y;
+                    sort_button.bounds.height = upload_button.bounds.height;
+                    sort_button.bounds.width  = sort_button.hovered.border_width*2 + sort_button.hovered.pad*2 + sort_txt_width;
+                    sort_button.bounds.x      = upload_button.bounds.x - upload_button.hovered.border_width - header_x_pad - sort_button.bounds.width;
                 }
 
 
@@ -324,13 +364,25 @@ int main(void)
                 }
                 // Show library otherwise
                 else {
-                    RL_Color conn_color = comm_is_connected ? RL_GREEN : RL_BLANK;
+                    RL_Color conn_color = comm_state->connected ? RL_GREEN : RL_BLANK;
                     DrawCircle     (header_bounds.x + conn_circ_radius, header_bounds.y + conn_circ_radius + header_y_pad, conn_circ_radius, conn_color);
                     DrawCircleLines(header_bounds.x + conn_circ_radius, header_bounds.y + conn_circ_radius + header_y_pad, conn_circ_radius, RL_WHITE);
 
                     AIL_Gui_State upload_button_state = ail_gui_drawLabel(upload_button);
                     if (upload_button_state == AIL_GUI_STATE_PRESSED) SET_VIEW(UI_VIEW_DND);
 
+                    // Set whenever the order of the shown songs changed without the search text or library changing
+                    static bool songs_order_changed = false;
+
+                    // Switching the order only picks a different precomputed permutation of the library
+                    AIL_Gui_State sort_button_state = ail_gui_drawLabel(sort_button);
+                    if (sort_button_state == AIL_GUI_STATE_PRESSED) {
+                        songs_order_changed = true;
+                        sort_key = (sort_key + 1) % LIBRARY_SORT_COUNT;
+                        sort_button.text = ail_da_from_parts(char, (char *)sort_btn_msgs[sort_key], strlen(sort_btn_msgs[sort_key]), strlen(sort_btn_msgs[sort_key]), &ail_default_allocator);
+                        scroll = 0.0f;
+                    }
+
                     static char *search_text = "";
                     static char *search_placeholder = "Search...";
                     static RL_Rectangle       search_bounds;
@@ -342,7 +394,7 @@ int main(void)
                         search_bounds = (RL_Rectangle) {
                             .x = search_x,
                             .y = header_bounds.y + style_search.border_width + header_y_pad,
-                            .width  = upload_button.bounds.x - upload_button.hovered.border_width - header_x_pad - style_search.border_width - search_x,
+                            .width  = sort_button.bounds.x - sort_button.hovered.border_width - header_x_pad - style_search.border_width - search_x,
                             .height = header_bounds.height - 2*style_search.border_width - 2*header_y_pad,
                         };
                         AIL_Gui_Label search_label = {
@@ -356,11 +408,38 @@ int main(void)
                     search_res  = ail_gui_drawInputBox(&search_input_box);
                     search_text = search_input_box.label.text.data;
 
-                    static AIL_DA(Song) songs;
-                    if (search_res.updated && search_input_box.label.text.len) {
-                        if (songs.data != library.data && songs.data) ail_da_free(&songs);
-                        songs = search_songs(search_input_box.label.text.data);
-                    } else if (!songs.data || library_updated) songs = library;
+                    // Tag terms (like `#tag`) are split off from the search text, the rest is searched for in the songs' names
+                    // Tags are re-parsed when the library changes, since the filter might contain tags that were only just created
+                    static TagFilter tag_filter = { 0 };
+                    static char      search_query[SEARCH_MAX_QUERY_LEN] = { 0 };
+                    static bool      is_tag_filtering = false;
+                    bool tag_filter_changed = search_res.updated || library_updated;
+                    if (tag_filter_changed) is_tag_filtering = tag_filter_parse(&library_tags, search_text ? search_text : "", &tag_filter, search_query, sizeof(search_query));
+
+                    // While searching, only the matching songs are shown (followed by the closest misspelled ones), otherwise the whole library in the selected order
+                    // Until the search thread finished searching for the newest query, the results for the previous query are still shown
+                    bool is_searching = search_query[0] != 0;
+                    if (is_searching && (search_res.updated || library_updated)) search_request(search_query);
+                    const SearchResults *search_matches = search_poll_results();
+                    LibraryView shown_songs = library_view(&library_views, sort_key, sort_reversed[sort_key]);
+                    if (is_searching) shown_songs = (LibraryView) { .idxs = search_matches->idxs.data, .count = search_matches->idxs.len, .reversed = false };
+
+                    // The filtered list is only rebuilt when its input changed
+                    if (is_tag_filtering) {
+                        static u32  filtered_count      = 0;
+                        static u32  filtered_generation = 0;
+                        static bool filtered_fuzzy_done = false;
+                        bool search_matches_changed = is_searching && (search_matches->generation != filtered_generation || search_matches->fuzzy_done != filtered_fuzzy_done);
+                        if (tag_filter_changed || songs_order_changed || search_matches_changed) {
+                            const u64 *tag_bits = tag_filter_eval(&library_tags, &tag_filter, library.len);
+                            filtered_count      = tag_filter_view(&library_tags, tag_bits, shown_songs);
+                            filtered_generation = search_matches->generation;
+                            filtered_fuzzy_done = search_matches->fuzzy_done;
+                            songs_order_changed = false;
+                        }
+                        shown_songs = (LibraryView) { .idxs = library_tags.filtered, .count = filtered_count, .reversed = false };
+                    }
+                    u32 songs_count = shown_songs.count;
 
 
                     // @Cleanup: Magic numbers hidden deep inside function
@@ -370,7 +449,7 @@ int main(void)
                     u32 full_song_name_width  = song_name_width  + 2*style_song_name_default.pad + 2*style_song_name_default.border_width;
                     u32 full_song_name_height = song_name_height + 2*style_song_name_default.pad + 2*style_song_name_default.border_width;
                     u32 song_names_per_row    = (content_bounds.width + song_name_margin) / (song_name_margin + full_song_name_width);
-                    u32 rows_amount           = (songs.len / song_names_per_row) + ((songs.len % song_names_per_row) > 0);
+                    u32 rows_amount           = (songs_count / song_names_per_row) + ((songs_count % song_names_per_row) > 0);
                     u32 full_width            = song_names_per_row*full_song_name_width + (song_names_per_row - 1)*song_name_margin;
                     u32 start_x               = (content_bounds.width - full_width) / 2;
                     u32 virtual_height        = rows_amount*(full_song_name_height + song_name_margin);
@@ -378,14 +457,15 @@ int main(void)
                     scroll = AIL_MIN(scroll, max_y);
                     u32 start_row             = scroll / (full_song_name_height + song_name_margin);
 
-                    for (u32 i = start_row * song_names_per_row; i < songs.len; i++) {
+                    for (u32 i = start_row * song_names_per_row; i < songs_count; i++) {
+                        u32 song_idx = library_view_get(shown_songs, i);
                         RL_Rectangle song_bounds = {
                             start_x + (full_song_name_width + song_name_margin)*(i % song_names_per_row) + 2*style_song_name_default.border_width,
                             content_bounds.y + song_name_margin + (full_song_name_height + song_name_margin)*(i / song_names_per_row) - scroll,
                             song_name_width,
                             song_name_height
                         };
-                        char *song_name = songs.data[i].name;
+                        char *song_name = library.data[song_idx].name;
                         AIL_Gui_Label song_label = {
                             .text         = ail_da_from_parts(char, song_name, strlen(song_name), strlen(song_name), &ail_default_allocator),
                             .bounds       = song_bounds,
@@ -393,18 +473,26 @@ int main(void)
                             .hovered      = style_song_name_hover,
                         };
                         AIL_Gui_State song_label_state = ail_gui_drawLabelOuterBounds(song_label, content_bounds);
-                        if (song_label_state == AIL_GUI_STATE_PRESSED && comm_is_connected) {
+                        if (song_label_state == AIL_GUI_STATE_PRESSED && comm_state->connected) {
                             DBG_LOG("Playing song: %s\n", song_name);
                             // @TODO: Display hover style of songs differently if not connected maybe?
                             // @TODO: Reading file blocks UI thread...
-                            Song s = songs.data[i];
-                            load_pidi(&s);
+                            Song s = library.data[song_idx];
+                            AIL_Buffer pidi = load_pidi(&s);
                             printf("\033[33mSending song with %d commands\033[0m\n", s.cmds.len);
-                            send_new_song(s.cmds, 0);
-                            is_music_playing = true;
-                            cur_music_len    = s.len;
-                            cur_music_time   = 0;
-                            set_paused(false);
+                            if (send_new_song(s.cmds, pidi, 0)) {
+                                library_views_mark_played(&library_views, song_idx, (u64)time(NULL));
+                                songs_order_changed = true;
+                                is_music_playing = true;
+                                song_id++;
+                                cur_music_len    = s.len;
+                                cur_music_time   = 0;
+                                paused           = false;
+                                set_paused(paused);
+                            } else {
+                                ail_da_free(&s.cmds);
+                                free(pidi.data);
+                            }
                         }
                     }
                 }
@@ -412,10 +500,12 @@ int main(void)
 
                 // If music is playing -> show timeline & music controls
                 if (is_music_playing) {
-                    if (!comm_is_music_playing) {
+                    if (!comm_state->playing || comm_state->song_id != song_id) {
                         draw_loading_anim(play_bounds, false);
                     } else {
                         static bool timeline_selected = false;
+                        // The timeline follows the Arduino, so that it also shows e.g. the song stalling, because the connection was lost
+                        cur_music_time  = comm_state_position(comm_state);
                         f32 played_perc = AIL_MIN(cur_music_time / cur_music_len, 1.0f);
                         RL_Rectangle total_rect = {
                             .x      = play_bounds.x,
@@ -443,7 +533,8 @@ int main(void)
                             .x = icon_bounds.x + speed_max_size - speed_text_size.x,
                             .y = icon_bounds.y + (icon_bounds.height - speed_text_size.y)/2,
                         };
-                        RL_DrawTextEx(font, speed_text, speed_text_pos, size_smaller, 0, RL_WHITE);
+                        // Warn that the song is too dense for the connection at this speed, before the skipped notes are played
+                        RL_DrawTextEx(font, speed_text, speed_text_pos, size_smaller, 0, comm_state->overloaded ? RL_ORANGE : RL_WHITE);
                         f32 icon_x = icon_bounds.x + speed_max_size + icon_pad;
                         f32 icon_y = icon_bounds.y;
                         bool pressed;
@@ -453,9 +544,10 @@ int main(void)
                             set_speed(speed);
                         }
                         icon_x += icon_size + icon_pad;
-                        any_icon_hovered |= draw_icon(play_icon, !comm_is_paused, icon_x, icon_y, icon_size, &pressed);
+                        any_icon_hovered |= draw_icon(play_icon, !paused, icon_x, icon_y, icon_size, &pressed);
                         if (pressed) {
-                            set_paused(!comm_is_paused);
+                            paused = !paused;
+                            set_paused(paused);
                         }
                         icon_x += icon_size + icon_pad;
                         any_icon_hovered |= draw_icon(speed_icon, 1, icon_x, icon_y, icon_size, &pressed);
@@ -521,7 +613,7 @@ int main(void)
 timeline_jump:
                                 played_perc    = ((f32)(mouse.x - total_rect.x))/(f32)total_rect.width;
                                 cur_music_time = AIL_LERP(played_perc, 0, cur_music_len);
-                                send_new_song(comm_cmds, (u32)cur_music_time);
+                                seek_song((u32)cur_music_time);
                                 timeline_selected = false;
                             }
                         }
@@ -538,12 +630,10 @@ timeline_jump:
                         DrawRectangleRounded(total_rect,  5.0f, 5, RL_GRAY);
                         DrawRectangleRounded(played_rect, 5.0f, 5, RL_RED);
                         DrawCircle(x_circle, played_rect.y + played_rect.height/2, play_circ_radius, RL_RED);
-
-                        if (!comm_is_paused) cur_music_time += speed * RL_GetFrameTime() * 1000.0f;
                     }
                 }
                 // Otherwise if Arduino is not connected, show text reminding user to connect
-                else if (!comm_is_connected) {
+                else if (!comm_state->connected) {
                     static const char *not_connected_msg = "Please connect to the Arduino to play any music...";
                     ail_gui_drawText(not_connected_msg, play_bounds, style_warn_text);
                 }
@@ -603,7 +693,16 @@ timeline_jump:
                     SET_VIEW(UI_VIEW_LIBRARY);
                 }
 
-                bool valid_name = name_input.label.text.len > 0 && !is_songname_taken(name_input.label.text.data);
+                // `#tag` terms in the name are added as tags to the song, so they don't count towards the song's name
+                // The name is only checked again after it was changed
+                static bool valid_name   = false;
+                static bool name_changed = true;
+                if (name_changed || requires_recalc) {
+                    char *stripped_name = malloc(name_input.label.text.len + 1);
+                    tags_strip_name(&library_tags, name_input.label.text.len ? name_input.label.text.data : "", stripped_name, NULL, 0);
+                    valid_name = stripped_name[0] && !is_songname_taken(stripped_name);
+                    free(stripped_name);
+                }
                 AIL_Gui_Style input_style = ail_gui_cloneStyle(style_default);
                 input_style.border_width      = 5;
                 input_style.border_color      = valid_name ? RL_GREEN : RL_RED;
@@ -613,6 +712,7 @@ timeline_jump:
                 name_input.label.hovered      = input_style;
                 name_input.selected           = !btn_selected;
                 AIL_Gui_Update_Res res        = ail_gui_drawInputBox(&name_input);
+                name_changed                  = res.updated;
 
                 u32 btn_text_size     = MeasureTextEx(style_button_default.font, upload_btn_msg, style_button_default.font_size, style_button_default.cSpacing).x;
                 i32 btn_width         = btn_text_size + 2*style_button_default.border_width + 2*style_button_default.pad;
@@ -629,9 +729,11 @@ timeline_jump:
                 if (res.tab || IsKeyPressed(KEY_TAB))   btn_selected = !btn_selected;
                 if (res.state >= AIL_GUI_STATE_PRESSED) btn_selected = false;
                 if (valid_name && (res.enter || btn_res >= AIL_GUI_STATE_PRESSED)) {
-                    song_name = name_input.label.text.data;
+                    // The name is copied, since the input box keeps its text
+                    song_name = malloc(name_input.label.text.len + 1);
+                    memcpy(song_name, name_input.label.text.data, name_input.label.text.len);
+                    song_name[name_input.label.text.len] = 0;
                     DBG_LOG("song_name: %s\n", song_name);
-                    // @Memory: Potentially leaking `song_name` here???
                     SET_VIEW(UI_VIEW_PARSING_SONG);
                 }
             } break;
@@ -639,8 +741,17 @@ timeline_jump:
             case UI_VIEW_PARSING_SONG: {
                 draw_loading_anim((RL_Rectangle){0, 0, win_width, win_height}, view_changed);
                 if (file_parsed) {
-                    song.name = song_name;
-                    ail_da_push(&library, song);
+                    u32 tag_ids[TAG_FILTER_MAX_TERMS];
+                    song.name = malloc(strlen(song_name) + 1);
+                    u32 tags_count = AIL_MIN(tags_strip_name(&library_tags, song_name, song.name, tag_ids, AIL_ARRLEN(tag_ids)), AIL_ARRLEN(tag_ids));
+                    free(song_name);
+                    song_name = NULL;
+                    SongStats stats = {
+                        .len        = song.len,
+                        .cmds_count = song.cmds.len,
+                    };
+                    library_add_song(song, stats);
+                    for (u32 i = 0; i < tags_count; i++) tag_add_song(&library_tags.tags.data[tag_ids[i]], library.len - 1);
                     library_updated = 2; // setting it to 2 instead of true, because we reduce it by 1 each frame (up to 0) and thus it will still be greater 0 when being checked next frame
                     if (!save_pidi(song)) AIL_TODO();
                     if (!save_library()) AIL_TODO();
@@ -655,6 +766,7 @@ timeline_jump:
     }
 
     RL_CloseWindow();
+    if (library_ready) save_library(); // To remember when songs were played
     close_comm();
     return 0;
 }
@@ -729,62 +841,29 @@ void* util_memadd(const void *a, u64 a_size, const void *b, u64 b_size)
     return (void*) out;
 }
 
-bool is_songname_taken(const char *name)
-{
-    for (u32 i = 0; i < library.len; i++) {
-        if (strcmp(name, library.data[i].name) == 0) return true;
-    }
-    return false;
-}
-
-bool is_prefix(const char *restrict prefix, const char *restrict str, bool ignore_case)
+// Adds the song to the library and all indices built over it
+void library_add_song(Song song, SongStats stats)
 {
-    bool is_prefix = true;
-    u32 i = 0;
-    for (; str[i] && prefix[i] && is_prefix; i++) {
-        char c1 = str[i];
-        char c2 = prefix[i];
-        if (ignore_case && str[i]    >= 'A' && str[i]    <= 'Z') c1 += 'a' - 'A';
-        if (ignore_case && prefix[i] >= 'A' && prefix[i] <= 'Z') c2 += 'a' - 'A';
-        is_prefix = c1 == c2;
-    }
-    return is_prefix && !prefix[i];
+    search_cancel(); // Don't wait for a running fuzzy search to finish - the UI requests a new search anyways, once the library was updated
+    while (pthread_mutex_lock(&search_index_mutex) != 0) {}
+    ail_da_push(&library, song);
+    search_index_add(&search_index, song.name);
+    library_views_add(&library_views, stats);
+    tags_reserve(&library_tags, library.len);
+    while (pthread_mutex_unlock(&search_index_mutex) != 0) {}
 }
 
-AIL_DA(Song) search_songs(const char *substr)
+bool is_songname_taken(const char *name)
 {
-    AIL_DA(Song) prefixed    = ail_da_new(Song);
-    AIL_DA(Song) substringed = ail_da_new(Song);
-    u32 substr_len = strlen(substr);
-    // DBG_LOG("substr: %s\n", substr);
-    // DBG_LOG("library: { data: %p, len: %d, cap: %d }\n", (void *)library.data, library.len, library.cap);
     for (u32 i = 0; i < library.len; i++) {
-        // Check for prefix
-        // DBG_LOG("i: %d, s: %s\n", i, library.data[i].name);
-        if (is_prefix(substr, library.data[i].name, true)) {
-            // DBG_LOG("is prefix\n");
-            ail_da_push(&prefixed, library.data[i]);
-        } else {
-            // Check for substring
-            bool is_substr = false;
-            u32 name_len = strlen(library.data[i].name);
-            if (name_len > substr_len) {
-                for (u32 j = 1; !is_substr && j <= name_len - substr_len; j++) {
-                    // DBG_LOG("j: %d\n", j);
-                    is_substr = is_prefix(substr, &library.data[i].name[j], true);
-                }
-            }
-            // if (is_substr) DBG_LOG("is substring\n");
-            if (is_substr) ail_da_push(&substringed, library.data[i]);
-        }
+        if (strcmp(name, library.data[i].name) == 0) return true;
     }
-    ail_da_pushn(&prefixed, substringed.data, substringed.len);
-    ail_da_free(&substringed);
-    return prefixed;
+    return false;
 }
 
 // loads the PIDI-file (as referred to by song->name) into song
-void load_pidi(Song *song)
+// Returns the file's contents, which the caller owns - its commands are already encoded for SPPP (see PIDI_HEADER_SIZE)
+AIL_Buffer load_pidi(Song *song)
 {
     u64 data_dir_path_len = data_dir_path.len;
     u64 name_len          = strlen(song->name);
@@ -802,6 +881,29 @@ void load_pidi(Song *song)
     for (u32 i = 0; i < n; i++) {
         song->cmds.data[i] = decode_cmd(&buf);
     }
+    return buf;
+}
+
+// Reads only the amount of commands from the header of the song's PIDI-file
+u32 read_pidi_cmds_count(const char *song_name)
+{
+    u64 data_dir_path_len = data_dir_path.len;
+    u64 name_len          = strlen(song_name);
+    char *fname = malloc(data_dir_path_len + name_len + 6);
+    memcpy(fname, data_dir_path.str, data_dir_path_len);
+    memcpy(&fname[data_dir_path_len], song_name, name_len);
+    memcpy(&fname[data_dir_path_len + name_len], ".pidi", 6);
+    FILE *f = fopen(fname, "rb");
+    free(fname);
+    if (!f) return 0;
+    u8 header[8];
+    u32 n = 0;
+    if (fread(header, 1, sizeof(header), f) == sizeof(header)) {
+        AIL_Buffer buf = { .data = header, .idx = 0, .len = sizeof(header), .cap = sizeof(header) };
+        if (ail_buf_read4msb(&buf) == PIDI_MAGIC) n = ail_buf_read4lsb(&buf);
+    }
+    fclose(f);
+    return n;
 }
 
 bool save_pidi(Song song)
@@ -836,6 +938,13 @@ bool save_library()
         ail_buf_write8lsb(&buf, song.len);
         ail_buf_writestr(&buf, song.name, name_len);
     }
+    // Stats for each song are appended after all names, so that older versions can still read the file
+    for (u32 i = 0; i < library.len; i++) {
+        SongStats stats = library_views.stats.data[i];
+        ail_buf_write8lsb(&buf, stats.last_played);
+        ail_buf_write4lsb(&buf, stats.cmds_count);
+    }
+    tags_write(&library_tags, &buf);
     if (!RL_DirectoryExists(data_dir_path.str)) mkdir(data_dir_path.str, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
     return ail_buf_to_file(&buf, library_filepath.str);
 }
@@ -845,6 +954,13 @@ void *load_library(void *arg)
     (void)arg;
     library_ready = false;
     ail_da_free(&library);
+    search_cancel();
+    while (pthread_mutex_lock(&search_index_mutex) != 0) {}
+    search_index_init(&search_index);
+    while (pthread_mutex_unlock(&search_index_mutex) != 0) {}
+    library_views_init(&library_views);
+    library_views.sorted = false; // Only sort once after all songs were loaded
+    tags_init(&library_tags);
 
     if (!RL_DirectoryExists(data_dir_path.str)) {
         mkdir(data_dir_path.str, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
@@ -855,23 +971,38 @@ void *load_library(void *arg)
         if (ail_buf_read4msb(&buf) != PDIL_MAGIC) goto nothing_to_load;
         u32 n = ail_buf_read4lsb(&buf);
         ail_da_maybe_grow(&library, n);
-        for (; n > 0; n--) {
+        Song *songs = malloc(n * sizeof(Song));
+        for (u32 i = 0; i < n; i++) {
             u32 name_len = ail_buf_read4lsb(&buf);
             u64 song_len = ail_buf_read8lsb(&buf);
             char *name   = ail_buf_readstr(&buf, name_len);
-            Song song = {
+            songs[i] = (Song) {
                 .name   = name,
                 .len    = song_len,
                 .cmds = ail_da_new_empty(PidiCmd),
             };
-            ail_da_push(&library, song);
         }
+        // Library files written by older versions don't contain any stats yet
+        bool has_stats = buf.idx < buf.len;
+        for (u32 i = 0; i < n; i++) {
+            SongStats stats = { .len = songs[i].len };
+            if (has_stats) {
+                stats.last_played = ail_buf_read8lsb(&buf);
+                stats.cmds_count  = ail_buf_read4lsb(&buf);
+            } else {
+                stats.cmds_count  = read_pidi_cmds_count(songs[i].name);
+            }
+            library_add_song(songs[i], stats);
+        }
+        free(songs);
+        if (buf.idx < buf.len) tags_read(&library_tags, &buf);
         goto end;
     }
 
 nothing_to_load:
     ail_da_maybe_grow(&library, 16);
 end:
+    library_views_sort(&library_views);
     library_ready = true;
     return NULL;
 }
@@ -0,0 +1,103 @@
+#include "header.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <mmsystem.h> // For timeBeginPeriod
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#endif // _WIN32
+
+// Timing for threads, that need to act at exact times (see the direct-drive mode in comm.c)
+// All times are in seconds on a monotonic clock (see rt_now), which is independent of the clock used by ail_time.
+// Sleeping always targets an absolute deadline, so that the time spent between two sleeps never adds up.
+// On Linux, clock_nanosleep is woken by a high resolution timer and SCHED_FIFO lets the thread preempt every normal thread as soon as it expires.
+// On Windows, a high resolution waitable timer is used together with the time critical thread priority.
+// Without permission for a real-time priority (i.e. without CAP_SYS_NICE or an rtprio limit on Linux), the thread keeps its normal priority,
+// which is still good enough on an idle machine.
+// How late a thread woke up is collected in an RtJitter histogram.
+#define RT_PRIORITY         40  // SCHED_FIFO priority - below the kernel's interrupt threads (50), which have to deliver our bytes to the USB device
+#define RT_JITTER_BUCKET_US 10  // Width of a bucket in the jitter histogram
+#define RT_JITTER_BUCKETS   200 // The last bucket collects everything beyond the others, so the histogram only resolves the first 2ms
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002 // Only available since Windows 10 1803 and missing in older headers
+#endif
+
+typedef struct RtJitter {
+    u64 counts[RT_JITTER_BUCKETS];
+    u64 total;
+    f64 max_us;
+} RtJitter;
+
+#ifdef _WIN32
+static HANDLE rt_timer = NULL; // Only used by the thread, that called rt_make_realtime
+#endif
+
+f64 rt_now(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq = { 0 };
+    LARGE_INTEGER count;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (f64)count.QuadPart/(f64)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+#endif
+}
+
+// Gives the calling thread a real-time priority and returns false if that isn't permitted
+bool rt_make_realtime(void)
+{
+#ifdef _WIN32
+    timeBeginPeriod(1); // Only matters if there are no high resolution timers
+    rt_timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (!rt_timer) rt_timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+    return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#else
+    struct sched_param param = { .sched_priority = RT_PRIORITY };
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+#endif
+}
+
+void rt_sleep_until(f64 deadline)
+{
+#ifdef _WIN32
+    f64 wait = deadline - rt_now();
+    if (wait <= 0) return;
+    LARGE_INTEGER due = { .QuadPart = -(LONGLONG)(wait*1e7) }; // Negative times are relative, in units of 100ns
+    if (rt_timer && SetWaitableTimer(rt_timer, &due, 0, NULL, NULL, FALSE)) WaitForSingleObject(rt_timer, INFINITE);
+    else Sleep((DWORD)(wait*1000));
+#elif defined(TIMER_ABSTIME)
+    struct timespec ts = { .tv_sec = (time_t)deadline, .tv_nsec = (long)((deadline - (time_t)deadline)*1e9) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+#else
+    // Without clock_nanosleep (i.e. on macOS), sleeping for the remaining time is the best we can do
+    f64 wait = deadline - rt_now();
+    if (wait <= 0) return;
+    struct timespec ts = { .tv_sec = (time_t)wait, .tv_nsec = (long)((wait - (time_t)wait)*1e9) };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+void rt_jitter_add(RtJitter *h, f64 late_us)
+{
+    u32 bucket = late_us <= 0 ? 0 : (u32)AIL_MIN(late_us/RT_JITTER_BUCKET_US, RT_JITTER_BUCKETS - 1);
+    h->counts[bucket]++;
+    h->total++;
+    h->max_us = AIL_MAX(h->max_us, late_us);
+}
+
+// Returns an upper bound for the `p`-th percentile (0 < p <= 1) of how late the thread woke up in µs
+f64 rt_jitter_percentile(const RtJitter *h, f64 p)
+{
+    u64 sum = 0;
+    for (u32 i = 0; i < RT_JITTER_BUCKETS; i++) {
+        sum += h->counts[i];
+        if (sum && sum >= p*h->total) return i + 1 < RT_JITTER_BUCKETS ? AIL_MIN((i + 1)*RT_JITTER_BUCKET_US, h->max_us) : h->max_us;
+    }
+    return 0;
+}
@@ -0,0 +1,567 @@
+// Transport for talking to the Arduino over a serial port
+//
+// The Communications thread and its Reader thread only access the port through a SerialTransport, so that comm.c doesn't need to know about the platform.
+// All transports share the same model: reading never blocks, writing blocks until all bytes were handed to the OS
+// and `wait` sleeps until data can be read, another thread called `wake` or the timeout passed.
+// While a port is open, `read` and `wait` are only called by the Reader thread and everything else only by the Communications thread,
+// except for `write`, which the Scheduler thread of the direct-drive mode calls as well. Both hold comm_write_lock while writing (see comm.c).
+//
+// On Windows, ports are opened for overlapped IO and a read is always kept pending, so that its event can be waited on.
+// On POSIX systems, ports are put into raw non-blocking mode and poll() waits on them together with a self-pipe for wakeups.
+// Setting the environment variable SAM_PORT (see SERIAL_PORT_ENV) restricts discovery to a single port, which allows using a pty as stand-in device (see utils/sim_device.c).
+// Discovery probes all candidate ports at once (see `probe`), so finding the Arduino takes a single round trip no matter how many ports there are.
+
+#include "header.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <xpsprint.h>
+#else
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#endif // __linux__
+#endif // _WIN32
+
+#define SERIAL_MAX_PORTS      32
+#define SERIAL_PORT_NAME_MAX  64
+#define SERIAL_READ_CHUNK_MAX 256
+#define SERIAL_PORT_ENV       "SAM_PORT"
+
+typedef struct SerialPortName {
+    char str[SERIAL_PORT_NAME_MAX];
+} SerialPortName;
+
+// Describes how `probe` recognizes the Arduino and holds what was read from its port
+typedef struct SerialProbe {
+    const u8 *msg;      // Written to every port
+    u32       msg_len;
+    u8        reply[4]; // Start of the reply to `msg`, that only the Arduino sends
+    u32       timeout_ms;
+    u8        rest[SERIAL_READ_CHUNK_MAX]; // Bytes, that were read from the found port, starting at `reply` - the port won't return them again
+    u32       rest_len;
+} SerialProbe;
+
+typedef struct SerialTransport {
+    void *data; // State of the backend
+    bool (*init)(void *data);
+    u32  (*list_ports)(void *data, AIL_Allocator *allocator, SerialPortName *names, u32 cap);
+    bool (*open)(void *data, const char *name);
+    void (*close)(void *data);
+    i32  (*read)(void *data, u8 *buf, u32 cap);        // Returns the amount of bytes that were read (possibly 0) or -1 if the port can't be read from anymore
+    bool (*write)(void *data, const u8 *buf, u32 len);
+    bool (*set_baud_rate)(void *data, u32 baud_rate);  // Waits until all written bytes were sent. Returns false if the port doesn't support the baud rate
+    void (*wait)(void *data, u32 timeout_ms);
+    void (*wake)(void *data);                          // May be called from any thread
+    // Opens all ports at once, writes probe->msg to each of them and waits until one replies or probe->timeout_ms passed
+    // The port, that replied first, stays open as if `open` was called for it. Returns its index in `names` or -1
+    i32  (*probe)(void *data, const SerialPortName *names, u32 count, SerialProbe *probe);
+} SerialTransport;
+
+// Returns the names of all ports, that might be connected to the Arduino
+static u32 serial_list_ports(SerialTransport *transport, AIL_Allocator *allocator, SerialPortName *names, u32 cap)
+{
+    const char *env_port = getenv(SERIAL_PORT_ENV);
+    if (env_port && env_port[0] && cap > 0) {
+        snprintf(names[0].str, SERIAL_PORT_NAME_MAX, "%s", env_port);
+        return 1;
+    }
+    return transport->list_ports(transport->data, allocator, names, cap);
+}
+
+// Looks for probe->reply in the bytes, that were read from a port so far, and copies everything from there on into probe->rest
+// Otherwise only the last bytes are kept, since the reply might be split across reads
+static bool serial_probe_match(SerialProbe *probe, u8 *buf, u32 *len)
+{
+    for (u32 i = 0; i + sizeof(probe->reply) <= *len; i++) {
+        if (memcmp(&buf[i], probe->reply, sizeof(probe->reply)) == 0) {
+            probe->rest_len = *len - i;
+            memcpy(probe->rest, &buf[i], probe->rest_len);
+            return true;
+        }
+    }
+    u32 keep = AIL_MIN(*len, (u32)sizeof(probe->reply) - 1);
+    memmove(buf, &buf[*len - keep], keep);
+    *len = keep;
+    return false;
+}
+
+
+#ifdef _WIN32
+
+typedef struct SerialWin32 {
+    HANDLE     port;
+    HANDLE     wakeup;       // Auto-reset event, that is signaled by `wake`
+    OVERLAPPED read_ov;      // A read is always kept pending on the port, so that its event is signaled as soon as data arrives
+    OVERLAPPED write_ov;
+    bool       read_pending;
+    u8         read_buf[SERIAL_READ_CHUNK_MAX];
+} SerialWin32;
+
+static bool serial_win32_init(void *data)
+{
+    SerialWin32 *s = data;
+    s->port            = NULL;
+    s->read_pending    = false;
+    s->wakeup          = CreateEvent(NULL, FALSE, FALSE, NULL);
+    s->read_ov.hEvent  = CreateEvent(NULL, TRUE,  FALSE, NULL);
+    s->write_ov.hEvent = CreateEvent(NULL, TRUE,  FALSE, NULL);
+    return s->wakeup && s->read_ov.hEvent && s->write_ov.hEvent;
+}
+
+static u32 serial_win32_list_ports(void *data, AIL_Allocator *allocator, SerialPortName *names, u32 cap)
+{
+    AIL_UNUSED(data);
+    u32 n = 0;
+    unsigned long ports_amount = 0;
+    unsigned long required_size;
+    bool res = EnumPorts(NULL, 2, NULL, 0, &required_size, &ports_amount);
+    PORT_INFO_2 *ports = allocator->alloc(allocator->data, required_size);
+    AIL_ASSERT(ports != NULL);
+    res = EnumPorts(NULL, 2, (u8 *)ports, required_size, &required_size, &ports_amount);
+    if (res == 0) {
+        AIL_DBG_PRINT("Error in enumerating ports: %ld\n", GetLastError());
+        goto done;
+    }
+    for (unsigned long i = 0; i < ports_amount && n < cap; i++) {
+        PORT_INFO_2 port = ports[i];
+        bool port_is_rw  = port.fPortType & PORT_TYPE_READ && port.fPortType & PORT_TYPE_WRITE;
+        bool port_is_usb = strlen(port.pPortName) >= 3 && memcmp(port.pPortName, "COM", 3) == 0;
+        if (port_is_rw && port_is_usb) snprintf(names[n++].str, SERIAL_PORT_NAME_MAX, "%s", port.pPortName);
+    }
+done:
+    allocator->free_one(allocator->data, ports);
+    return n;
+}
+
+static void serial_win32_close(void *data)
+{
+    SerialWin32 *s = data;
+    if (!s->port) return;
+    if (s->read_pending) {
+        DWORD read;
+        CancelIoEx(s->port, &s->read_ov);
+        GetOverlappedResult(s->port, &s->read_ov, &read, TRUE);
+        s->read_pending = false;
+    }
+    CloseHandle(s->port);
+    s->port = NULL;
+}
+
+static bool serial_win32_open(void *data, const char *name)
+{
+    SerialWin32 *s = data;
+    s->port = CreateFile(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL|FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_FLAG_OVERLAPPED, 0);
+    if (s->port == INVALID_HANDLE_VALUE) {
+        s->port = NULL;
+        return false;
+    }
+    // A read returns as soon as at least one byte is available, so that the pending read signals each arriving message immediately
+    COMMTIMEOUTS timeouts = {
+        .ReadIntervalTimeout         = MAXDWORD,
+        .ReadTotalTimeoutConstant    = MAXDWORD - 1,
+        .ReadTotalTimeoutMultiplier  = MAXDWORD,
+        .WriteTotalTimeoutConstant   = 50,
+        .WriteTotalTimeoutMultiplier = 10,
+    };
+    DCB dcb = {
+        .DCBlength       = sizeof(DCB),
+        .BaudRate        = BAUD_RATE,
+        .StopBits        = ONESTOPBIT,
+        .Parity          = (BYTE)PARITY_NONE,
+        .fOutX           = false,
+        .fInX            = false,
+        .EofChar         = EOF,
+        .ByteSize        = 8,
+        .fDtrControl     = DTR_CONTROL_DISABLE,
+        .fRtsControl     = RTS_CONTROL_DISABLE,
+        .fOutxCtsFlow    = 0,
+        .fOutxDsrFlow    = 0,
+        .fDsrSensitivity = 0,
+    };
+    if (SetCommTimeouts(s->port, &timeouts) && SetCommMask(s->port, EV_RXCHAR) && SetupComm(s->port, 4096, 4096) && SetCommState(s->port, &dcb)) return true;
+    serial_win32_close(s);
+    return false;
+}
+
+// @Note: The chunk requested by the first call, that finds no data, is only returned by a later call, so `cap` should stay the same between calls
+static i32 serial_win32_read(void *data, u8 *buf, u32 cap)
+{
+    SerialWin32 *s = data;
+    DWORD read;
+    if (s->read_pending) {
+        if (!GetOverlappedResult(s->port, &s->read_ov, &read, FALSE)) return GetLastError() == ERROR_IO_INCOMPLETE ? 0 : -1;
+        s->read_pending = false;
+    } else if (!ReadFile(s->port, s->read_buf, AIL_MIN(cap, SERIAL_READ_CHUNK_MAX), &read, &s->read_ov)) {
+        s->read_pending = GetLastError() == ERROR_IO_PENDING;
+        return s->read_pending ? 0 : -1;
+    }
+    AIL_ASSERT(read <= cap);
+    memcpy(buf, s->read_buf, read);
+    return read;
+}
+
+static bool serial_win32_write(void *data, const u8 *buf, u32 len)
+{
+    SerialWin32 *s = data;
+    DWORD written;
+    bool res = WriteFile(s->port, buf, len, &written, &s->write_ov);
+    if (!res && GetLastError() == ERROR_IO_PENDING) res = GetOverlappedResult(s->port, &s->write_ov, &written, TRUE);
+    return res && written == len;
+}
+
+static bool serial_win32_set_baud_rate(void *data, u32 baud_rate)
+{
+    SerialWin32 *s = data;
+    DCB dcb = { .DCBlength = sizeof(DCB) };
+    if (!FlushFileBuffers(s->port) || !GetCommState(s->port, &dcb)) return false;
+    u32 prev_baud_rate = dcb.BaudRate;
+    dcb.BaudRate = baud_rate;
+    if (SetCommState(s->port, &dcb)) return true;
+    // Some drivers only reject the baud rate after changing part of the state
+    dcb.BaudRate = prev_baud_rate;
+    SetCommState(s->port, &dcb);
+    return false;
+}
+
+static void serial_win32_wait(void *data, u32 timeout_ms)
+{
+    SerialWin32 *s = data;
+    HANDLE events[2] = { s->wakeup, s->read_ov.hEvent };
+    WaitForMultipleObjects(s->port ? 2 : 1, events, FALSE, timeout_ms);
+}
+
+static void serial_win32_wake(void *data)
+{
+    SerialWin32 *s = data;
+    SetEvent(s->wakeup);
+}
+
+// @Note: Ports are still opened one after the other, but that only takes long for ports, that don't exist anymore
+static i32 serial_win32_probe(void *data, const SerialPortName *names, u32 count, SerialProbe *probe)
+{
+    SerialWin32 *s = data;
+    HANDLE     ports[SERIAL_MAX_PORTS];
+    u32        idxs[SERIAL_MAX_PORTS]; // Index in `names` of each open port
+    OVERLAPPED ovs[SERIAL_MAX_PORTS] = { 0 };
+    HANDLE     events[SERIAL_MAX_PORTS];
+    bool       pending[SERIAL_MAX_PORTS];
+    u8         bufs[SERIAL_MAX_PORTS][SERIAL_READ_CHUNK_MAX];
+    u32        lens[SERIAL_MAX_PORTS];
+    u32 n = 0;
+    i32 found = -1;
+    for (u32 i = 0; i < count && n < SERIAL_MAX_PORTS; i++) {
+        if (!serial_win32_open(s, names[i].str)) continue;
+        if (!(ovs[n].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL)) || !serial_win32_write(s, probe->msg, probe->msg_len)) {
+            if (ovs[n].hEvent) CloseHandle(ovs[n].hEvent);
+            serial_win32_close(s);
+            continue;
+        }
+        ports[n]   = s->port;
+        idxs[n]    = i;
+        events[n]  = ovs[n].hEvent;
+        lens[n]    = 0;
+        pending[n] = ReadFile(ports[n], bufs[n], SERIAL_READ_CHUNK_MAX, NULL, &ovs[n]) || GetLastError() == ERROR_IO_PENDING;
+        s->port    = NULL;
+        n++;
+    }
+    f64 start = ail_time_clock_start();
+    while (n && found < 0) {
+        f64 elapsed_ms = ail_time_clock_elapsed(start)*1000.0;
+        if (elapsed_ms >= probe->timeout_ms) break;
+        DWORD res = WaitForMultipleObjects(n, events, FALSE, (DWORD)(probe->timeout_ms - elapsed_ms) + 1);
+        if (res >= WAIT_OBJECT_0 + n) break;
+        u32 j = res - WAIT_OBJECT_0;
+        DWORD read;
+        pending[j] = false;
+        // A port, that can't be read from anymore, keeps its event reset, so that it is never waited for again
+        if (!GetOverlappedResult(ports[j], &ovs[j], &read, FALSE)) {
+            ResetEvent(events[j]);
+            continue;
+        }
+        lens[j] += read;
+        if (serial_probe_match(probe, bufs[j], &lens[j])) found = j;
+        else pending[j] = ReadFile(ports[j], &bufs[j][lens[j]], SERIAL_READ_CHUNK_MAX - lens[j], NULL, &ovs[j]) || GetLastError() == ERROR_IO_PENDING;
+        if (!pending[j]) ResetEvent(events[j]);
+    }
+    for (u32 j = 0; j < n; j++) {
+        if (pending[j]) {
+            DWORD read;
+            CancelIoEx(ports[j], &ovs[j]);
+            GetOverlappedResult(ports[j], &ovs[j], &read, TRUE);
+        }
+        CloseHandle(events[j]);
+        if ((i32)j == found) {
+            s->port         = ports[j];
+            s->read_pending = false;
+        } else {
+            CloseHandle(ports[j]);
+        }
+    }
+    return found < 0 ? -1 : (i32)idxs[found];
+}
+
+static SerialWin32 serial_win32_state = { 0 };
+static SerialTransport serial_native  = {
+    .data          = &serial_win32_state,
+    .init          = serial_win32_init,
+    .list_ports    = serial_win32_list_ports,
+    .open          = serial_win32_open,
+    .close         = serial_win32_close,
+    .read          = serial_win32_read,
+    .write         = serial_win32_write,
+    .set_baud_rate = serial_win32_set_baud_rate,
+    .wait          = serial_win32_wait,
+    .wake          = serial_win32_wake,
+    .probe         = serial_win32_probe,
+};
+
+#else
+
+typedef struct SerialPosix {
+    int fd;
+    int wake_pipe[2]; // `wake` writes into wake_pipe[1], so that poll() returns for wake_pipe[0]
+} SerialPosix;
+
+static bool serial_posix_init(void *data)
+{
+    SerialPosix *s = data;
+    s->fd = -1;
+    if (pipe(s->wake_pipe) != 0) return false;
+    for (u32 i = 0; i < 2; i++) fcntl(s->wake_pipe[i], F_SETFL, fcntl(s->wake_pipe[i], F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+static int serial_posix_cmp_names(const void *a, const void *b)
+{
+    return strcmp(((const SerialPortName *)a)->str, ((const SerialPortName *)b)->str);
+}
+
+static u32 serial_posix_list_ports(void *data, AIL_Allocator *allocator, SerialPortName *names, u32 cap)
+{
+    AIL_UNUSED(data);
+    AIL_UNUSED(allocator);
+    // Arduinos show up as ttyACM* (native USB) or ttyUSB* (USB-serial converter) on Linux and as cu.usbmodem*/cu.usbserial* on macOS
+    static const char *prefixes[] = { "ttyACM", "ttyUSB", "cu.usbmodem", "cu.usbserial" };
+    u32 n = 0;
+    DIR *dir = opendir("/dev");
+    if (!dir) return 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) && n < cap) {
+        for (u32 i = 0; i < AIL_ARRLEN(prefixes); i++) {
+            if (strncmp(entry->d_name, prefixes[i], strlen(prefixes[i])) == 0) {
+                snprintf(names[n++].str, SERIAL_PORT_NAME_MAX, "/dev/%.*s", SERIAL_PORT_NAME_MAX - 6, entry->d_name);
+                break;
+            }
+        }
+    }
+    closedir(dir);
+    qsort(names, n, sizeof(SerialPortName), serial_posix_cmp_names);
+    return n;
+}
+
+static speed_t serial_posix_speed(u32 baud_rate)
+{
+    switch (baud_rate) {
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+#ifdef B460800
+        case 460800:  return B460800;
+#endif
+#ifdef B500000
+        case 500000:  return B500000;
+#endif
+#ifdef B1000000
+        case 1000000: return B1000000;
+#endif
+#ifdef B2000000
+        case 2000000: return B2000000;
+#endif
+        default:
+            return B0;
+    }
+}
+
+static void serial_posix_close(void *data)
+{
+    SerialPosix *s = data;
+    if (s->fd < 0) return;
+    close(s->fd);
+    s->fd = -1;
+}
+
+// Returns the file descriptor of the opened port or -1
+static int serial_posix_open_fd(const char *name)
+{
+    int fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return -1;
+    struct termios tty;
+    if (tcgetattr(fd, &tty) != 0) goto failed;
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~(CSTOPB | HUPCL); // Keeping DTR up after closing the port prevents the Arduino from resetting every time the port is opened again
+#ifdef CRTSCTS
+    tty.c_cflag &= ~CRTSCTS;
+#endif
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
+    // Reads return immediately with whatever is available, waiting for data is done via poll() instead
+    tty.c_cc[VMIN]  = 0;
+    tty.c_cc[VTIME] = 0;
+    cfsetispeed(&tty, serial_posix_speed(BAUD_RATE));
+    cfsetospeed(&tty, serial_posix_speed(BAUD_RATE));
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) goto failed;
+    tcflush(fd, TCIOFLUSH);
+#ifdef __linux__
+    // USB-serial converters otherwise hold back received bytes for several milliseconds - failing is fine, since not all drivers (e.g. ptys) support this
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+#endif
+    return fd;
+failed:
+    close(fd);
+    return -1;
+}
+
+static bool serial_posix_open(void *data, const char *name)
+{
+    SerialPosix *s = data;
+    s->fd = serial_posix_open_fd(name);
+    return s->fd >= 0;
+}
+
+static i32 serial_posix_read(void *data, u8 *buf, u32 cap)
+{
+    SerialPosix *s = data;
+    ssize_t n = read(s->fd, buf, cap);
+    if (n >= 0) return n;
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+}
+
+static bool serial_posix_write_fd(int fd, const u8 *buf, u32 len)
+{
+    u32 written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, &buf[written], len - written);
+        if (n >= 0) {
+            written += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, MSG_TIMEOUT) <= 0) return false;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool serial_posix_write(void *data, const u8 *buf, u32 len)
+{
+    SerialPosix *s = data;
+    return serial_posix_write_fd(s->fd, buf, len);
+}
+
+static bool serial_posix_set_baud_rate(void *data, u32 baud_rate)
+{
+    SerialPosix *s = data;
+    speed_t speed = serial_posix_speed(baud_rate);
+    struct termios tty;
+    if (speed == B0 || tcgetattr(s->fd, &tty) != 0) return false;
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    return tcsetattr(s->fd, TCSADRAIN, &tty) == 0;
+}
+
+static void serial_posix_wait(void *data, u32 timeout_ms)
+{
+    SerialPosix *s = data;
+    struct pollfd pfds[2] = {
+        { .fd = s->wake_pipe[0], .events = POLLIN },
+        { .fd = s->fd,           .events = POLLIN },
+    };
+    if (poll(pfds, s->fd >= 0 ? 2 : 1, timeout_ms) > 0 && (pfds[0].revents & POLLIN)) {
+        u8 buf[64];
+        while (read(s->wake_pipe[0], buf, sizeof(buf)) > 0) {}
+    }
+}
+
+static void serial_posix_wake(void *data)
+{
+    SerialPosix *s = data;
+    u8 b = 1;
+    if (write(s->wake_pipe[1], &b, 1) < 0) {} // If the pipe is full, poll() returns anyways
+}
+
+static i32 serial_posix_probe(void *data, const SerialPortName *names, u32 count, SerialProbe *probe)
+{
+    SerialPosix *s = data;
+    struct pollfd pfds[SERIAL_MAX_PORTS];
+    int fds[SERIAL_MAX_PORTS];
+    u32 idxs[SERIAL_MAX_PORTS]; // Index in `names` of each open port
+    u8  bufs[SERIAL_MAX_PORTS][SERIAL_READ_CHUNK_MAX];
+    u32 lens[SERIAL_MAX_PORTS];
+    u32 n = 0;
+    i32 found = -1;
+    for (u32 i = 0; i < count && n < SERIAL_MAX_PORTS; i++) {
+        int fd = serial_posix_open_fd(names[i].str);
+        if (fd < 0) continue;
+        if (!serial_posix_write_fd(fd, probe->msg, probe->msg_len)) {
+            close(fd);
+            continue;
+        }
+        pfds[n] = (struct pollfd){ .fd = fd, .events = POLLIN };
+        fds[n]  = fd;
+        idxs[n] = i;
+        lens[n] = 0;
+        n++;
+    }
+    f64 start = ail_time_clock_start();
+    while (n && found < 0) {
+        f64 elapsed_ms = ail_time_clock_elapsed(start)*1000.0;
+        if (elapsed_ms >= probe->timeout_ms) break;
+        if (poll(pfds, n, (int)(probe->timeout_ms - elapsed_ms) + 1) < 0 && errno != EINTR) break;
+        for (u32 j = 0; j < n && found < 0; j++) {
+            if (!pfds[j].revents) continue;
+            ssize_t read_len = read(fds[j], &bufs[j][lens[j]], SERIAL_READ_CHUNK_MAX - lens[j]);
+            if (read_len > 0) {
+                lens[j] += read_len;
+                if (serial_probe_match(probe, bufs[j], &lens[j])) found = j;
+            } else if (read_len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                pfds[j].fd = -1; // The port hung up, so poll() ignores it from now on
+            }
+        }
+    }
+    for (u32 j = 0; j < n; j++) {
+        if ((i32)j == found) s->fd = fds[j];
+        else close(fds[j]);
+    }
+    return found < 0 ? -1 : (i32)idxs[found];
+}
+
+static SerialPosix serial_posix_state = { 0 };
+static SerialTransport serial_native  = {
+    .data          = &serial_posix_state,
+    .init          = serial_posix_init,
+    .list_ports    = serial_posix_list_ports,
+    .open          = serial_posix_open,
+    .close         = serial_posix_close,
+    .read          = serial_posix_read,
+    .write         = serial_posix_write,
+    .set_baud_rate = serial_posix_set_baud_rate,
+    .wait          = serial_posix_wait,
+    .wake          = serial_posix_wake,
+    .probe         = serial_posix_probe,
+};
+
+#endif // _WIN32
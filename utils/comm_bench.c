@@ -0,0 +1,97 @@
+#include "../src/comm.c"
+
+// Measures how fast songs can be streamed to the Arduino
+// By default, the song's commands all have a delta time of 0, so that the Arduino requests the next chunk as fast as it can
+// With a delta time, the song is played in real time instead, which shows whether chunks arrive before the Arduino runs out of commands
+// To simulate dragging the volume slider, another thread can change the volume every drag_ms, like the UI does once per frame
+// Since the UI must never wait for the serial port, the longest time any of these calls took is reported as well
+// Uses the first port found by serial_list_ports - set SAM_PORT to choose a specific port (i.e. the one printed by sim_device)
+// With SAM_DIRECT set, the song is played in the direct-drive mode (see comm.c), in which case how late the keys were sent is reported
+//
+// Usage: comm_bench [cmds_count] [dt_ms] [speed] [drag_ms]
+static u32 bench_drag_ms = 0;
+static u64 bench_volume_changes = 0;
+static f64 bench_max_call_us    = 0; // Longest time, that a call from the UI's side took
+
+static void *bench_drag_main(void *args)
+{
+    AIL_UNUSED(args);
+    for (u32 i = 0; true; i++) {
+        f64 t = ail_time_clock_start();
+        set_volume((i%100)/50.0f); // Sweeps through the range of the slider in main.c
+        bench_max_call_us = AIL_MAX(bench_max_call_us, ail_time_clock_elapsed(t)*1e6);
+        bench_volume_changes++;
+        ail_time_sleep(bench_drag_ms);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    u32 cmds_count = argc > 1 ? atoi(argv[1]) : 4096;
+    u16 dt         = argc > 2 ? atoi(argv[2]) : 0;
+    f32 speed      = argc > 3 ? atof(argv[3]) : 1.0f;
+    bench_drag_ms  = argc > 4 ? atoi(argv[4]) : 0;
+
+    comm_init();
+    pthread_t comm_thread;
+    pthread_create(&comm_thread, NULL, comm_thread_main, NULL);
+    f64 t = ail_time_clock_start();
+    while (!comm_is_connected && ail_time_clock_elapsed(t) < 5.0) ail_time_sleep(10);
+    if (!comm_is_connected) {
+        printf("Failed to connect\n");
+        return 1;
+    }
+    // Give the Arduino time to announce its capabilities, so that a possible switch to a higher baud rate is over before measuring
+    ail_time_sleep(100);
+    while (comm_caps_pending) ail_time_sleep(10);
+    printf("Connected (max %u commands per message, %u baud)\n", comm_max_cmds_per_msg, comm_baud_rate);
+
+    set_speed(speed);
+    // The song is handed over like main.c does after loading it, including the contents of its PIDI-file
+    AIL_DA(PidiCmd) cmds = ail_da_new_with_cap(PidiCmd, cmds_count);
+    AIL_Buffer pidi      = ail_buf_new(PIDI_HEADER_SIZE + 4*cmds_count);
+    ail_buf_write4msb(&pidi, PIDI_MAGIC);
+    ail_buf_write4lsb(&pidi, cmds_count);
+    for (u32 i = 0; i < cmds_count; i++) {
+        ail_da_push(&cmds, ((PidiCmd){ .dt = dt, .len = 10, .velocity = 1 + i%MAX_VELOCITY, .octave = 0, .key = i%PIANO_KEY_AMOUNT }));
+        encode_cmd(&pidi, cmds.data[i]);
+    }
+    if (bench_drag_ms) {
+        pthread_t drag_thread;
+        pthread_create(&drag_thread, NULL, bench_drag_main, NULL);
+    }
+    u64 start_bytes    = comm_total_bytes_sent;
+    u64 start_controls = comm_control_frames;
+    t = ail_time_clock_start();
+    send_new_song(cmds, pidi, 0);
+    f64 song_call_us = ail_time_clock_elapsed(t)*1e6;
+    bool overloaded = false;
+    while (comm_cmds_idx < cmds_count && ail_time_clock_elapsed(t) < 120.0 + cmds_count*dt/1000.0) {
+        overloaded |= comm_link_overloaded;
+        ail_time_sleep(1);
+    }
+    f64 elapsed  = ail_time_clock_elapsed(t);
+    u64 bytes    = comm_total_bytes_sent - start_bytes;
+    u64 changes  = bench_volume_changes;
+    u64 controls = comm_control_frames - start_controls;
+    f64 max_call = AIL_MAX(bench_max_call_us, song_call_us);
+
+    // Stay connected until the song is over, so that the Arduino doesn't mistake the missing end of the song for a buffer underrun
+    // In the direct-drive mode, the last keys are only sent after they were scheduled
+    if (dt || comm_direct) ail_time_sleep(MSG_TIMEOUT);
+    if (overloaded) printf("Notes were skipped, since the song is too dense for the link at %.2fx speed\n", speed);
+
+    f64 line_rate = comm_baud_rate/10.0;
+    printf("Flow control: %s\n", comm_credit_flow ? "credit" : "none");
+    printf("Sent %u commands (%llu bytes) in %.3fs\n", comm_cmds_idx, (unsigned long long)bytes, elapsed);
+    printf("Throughput: %.0f bytes/s (%.1f%% of the line rate of %.0f bytes/s)\n", bytes/elapsed, 100.0*bytes/elapsed/line_rate, line_rate);
+    if (bench_drag_ms) printf("Changed the volume %llu times, which took %llu control messages\n", (unsigned long long)changes, (unsigned long long)controls);
+    printf("Longest call from the UI's side: %.1fus\n", max_call);
+    if (comm_direct_jitter.total) {
+        printf("Direct drive: sent %llu frames with keys, which were late by <=%.0fus (50%%), <=%.0fus (99%%) and %.0fus at most\n",
+               (unsigned long long)comm_direct_frames, rt_jitter_percentile(&comm_direct_jitter, 0.5), rt_jitter_percentile(&comm_direct_jitter, 0.99), comm_direct_jitter.max_us);
+    }
+    if (comm_clock_count) printf("Clock: compared %u round trips, drift of the Arduino's clock: %+.1fppm\n", comm_clock_count, comm_clock_drift*1e6);
+    return 0;
+}
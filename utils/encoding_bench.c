@@ -0,0 +1,152 @@
+#include "header.h"
+#include "midi.c"
+#include "compact.c"
+
+// Compares the compact encoding of CMSG_MUSIC_COMPACT (see compact.c) with encode_cmd, which CMSG_MUSIC uses
+// Songs are split into chunks of `chunk_cmds` commands, like comm.c does, since back-references only work within a single chunk
+// Reports the bytes per note including the chunk headers and the time it takes to encode and decode a note
+// "delta only" is the compact encoding without any back-references
+// "copy" is how comm.c gets plain chunks of songs loaded from a PIDI-file, which already holds the commands encoded with encode_cmd
+//
+// Usage: encoding_bench [-chunk n] <midi file>...
+#define BENCH_REPEATS 50
+
+typedef struct BenchTotals {
+    u64 notes;
+    u64 plain_bytes;
+    u64 delta_bytes;
+    u64 compact_bytes;
+    f64 plain_enc_s;
+    f64 plain_copy_s;
+    f64 plain_dec_s;
+    f64 compact_enc_s;
+    f64 compact_dec_s;
+} BenchTotals;
+
+static void bench_print(const char *name, BenchTotals t)
+{
+    if (!t.notes) {
+        printf("%-40s no notes\n", name);
+        return;
+    }
+    f64 n = (f64)t.notes*BENCH_REPEATS;
+    printf("%-40s %6llu notes | plain %.2f, delta only %.2f, compact %.2f bytes/note (%.1f%%) | encode %.1f (copy %.1f) vs %.1f ns/note | decode %.1f vs %.1f ns/note\n",
+           name, (unsigned long long)t.notes,
+           (f64)t.plain_bytes/t.notes, (f64)t.delta_bytes/t.notes, (f64)t.compact_bytes/t.notes, 100.0*t.compact_bytes/t.plain_bytes,
+           t.plain_enc_s*1e9/n, t.plain_copy_s*1e9/n, t.compact_enc_s*1e9/n, t.plain_dec_s*1e9/n, t.compact_dec_s*1e9/n);
+}
+
+int main(int argc, char **argv)
+{
+    u32 chunk_cmds = 64;
+    BenchTotals total = { 0 };
+    u32 files = 0;
+    for (int arg = 1; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "-chunk") && arg + 1 < argc) {
+            i32 n      = atoi(argv[++arg]);
+            chunk_cmds = AIL_CLAMP(n, 1, UINT16_MAX);
+            continue;
+        }
+        ParseMidiRes res = parse_midi(ail_buf_from_file(argv[arg]));
+        if (!res.succ) {
+            printf("Failed to parse '%s': %s\n", argv[arg], res.val.err);
+            continue;
+        }
+        AIL_DA(PidiCmd) cmds = res.val.song.cmds;
+        u64 cap          = 4 + 4*chunk_cmds + COMPACT_MAX_CMD_SIZE;
+        AIL_Buffer plain = { .data = malloc(cap), .idx = 0, .len = 0, .cap = cap };
+        AIL_Buffer enc   = { .data = malloc(cap), .idx = 0, .len = 0, .cap = cap };
+        PidiCmd *decoded = malloc(chunk_cmds*sizeof(PidiCmd));
+        BenchTotals t = { .notes = cmds.len };
+        AIL_Buffer pidi  = ail_buf_new(PIDI_HEADER_SIZE + 4*cmds.len);
+        ail_buf_write4msb(&pidi, PIDI_MAGIC);
+        ail_buf_write4lsb(&pidi, cmds.len);
+        for (u32 i = 0; i < cmds.len; i++) encode_cmd(&pidi, cmds.data[i]);
+
+        for (u32 start = 0; start < cmds.len; start += chunk_cmds) {
+            u32 n = AIL_MIN(chunk_cmds, cmds.len - start);
+            const PidiCmd *chunk = &cmds.data[start];
+
+            f64 clock = ail_time_clock_start();
+            for (u32 r = 0; r < BENCH_REPEATS; r++) {
+                plain.idx = plain.len = 0;
+                ail_buf_write2lsb(&plain, n);
+                for (u32 i = 0; i < n; i++) encode_cmd(&plain, chunk[i]);
+            }
+            t.plain_enc_s += ail_time_clock_elapsed(clock);
+            t.plain_bytes += plain.len;
+
+            clock = ail_time_clock_start();
+            for (u32 r = 0; r < BENCH_REPEATS; r++) {
+                plain.idx = plain.len = 0;
+                ail_buf_write2lsb(&plain, n);
+                ail_buf_writestr(&plain, (const char *)&pidi.data[PIDI_HEADER_SIZE + 4*start], 4*n);
+            }
+            t.plain_copy_s += ail_time_clock_elapsed(clock);
+
+            clock = ail_time_clock_start();
+            for (u32 r = 0; r < BENCH_REPEATS; r++) {
+                plain.idx = 2;
+                for (u32 i = 0; i < n; i++) decoded[i] = decode_cmd(&plain);
+            }
+            t.plain_dec_s += ail_time_clock_elapsed(clock);
+
+            bool encoded = true;
+            clock = ail_time_clock_start();
+            for (u32 r = 0; r < BENCH_REPEATS; r++) {
+                enc.idx = enc.len = 0;
+                ail_buf_write2lsb(&enc, n);
+                ail_buf_write2lsb(&enc, 0);
+                encoded = compact_encode_cmds(&enc, chunk, n, enc.cap - COMPACT_MAX_CMD_SIZE);
+            }
+            t.compact_enc_s += ail_time_clock_elapsed(clock);
+            // comm.c sends chunks with encode_cmd, whenever the compact encoding would be larger
+            if (!encoded || enc.len > plain.len) {
+                t.compact_bytes += plain.len;
+                t.delta_bytes   += plain.len;
+                continue;
+            }
+
+            bool decoded_ok = true;
+            clock = ail_time_clock_start();
+            for (u32 r = 0; r < BENCH_REPEATS; r++) {
+                enc.idx    = 4;
+                decoded_ok = compact_decode_cmds(&enc, enc.len, decoded, n);
+            }
+            t.compact_dec_s += ail_time_clock_elapsed(clock);
+            for (u32 i = 0; decoded_ok && i < n; i++) decoded_ok = compact_cmds_eq(decoded[i], chunk[i]);
+            if (!decoded_ok) {
+                printf("Round trip failed for '%s' in the chunk starting at command %u\n", argv[arg], start);
+                return 1;
+            }
+
+            u32 delta_len = 4;
+            for (u32 i = 0; i < n; i++) delta_len += compact_cmd_size(i ? chunk[i - 1] : (PidiCmd){ 0 }, chunk[i]);
+            t.compact_bytes += enc.len;
+            t.delta_bytes   += AIL_MIN(delta_len, plain.len);
+        }
+        bench_print(argv[arg], t);
+
+        total.notes         += t.notes;
+        total.plain_bytes   += t.plain_bytes;
+        total.delta_bytes   += t.delta_bytes;
+        total.compact_bytes += t.compact_bytes;
+        total.plain_enc_s   += t.plain_enc_s;
+        total.plain_copy_s  += t.plain_copy_s;
+        total.plain_dec_s   += t.plain_dec_s;
+        total.compact_enc_s += t.compact_enc_s;
+        total.compact_dec_s += t.compact_dec_s;
+        files++;
+        free(plain.data);
+        free(enc.data);
+        free(pidi.data);
+        free(decoded);
+    }
+    if (!files) {
+        printf("Usage: %s [-chunk n] <midi file>...\n", argv[0]);
+        return 1;
+    }
+    printf("Chunks of %u commands\n", chunk_cmds);
+    bench_print("Total", total);
+    return 0;
+}
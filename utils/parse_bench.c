@@ -0,0 +1,207 @@
+#include "../src/comm.c"
+
+// Measures how fast the replies of the Arduino are decoded from noisy byte streams
+// The stream consists of random replies (see sppp_decode), with noise in between, that makes up `noise` of all bytes.
+// The noise also contains parts of the magic, so that the decoder has to start over in the middle of it.
+// Both decoders have to find exactly the replies, that were put into the stream:
+// - sppp_decode gets the stream in pieces of random size, like the reader thread gets them from the port
+// - "ring buffer" is how replies were found before: 8 bytes at a time are read into a Ring Buffer, which is checked for the magic at every offset
+//
+// Usage: parse_bench [replies]
+#define BENCH_REPEATS 20
+
+typedef struct BenchStream {
+    AIL_DA(u8) bytes;
+    CommReply *replies;
+    u32 count;
+} BenchStream;
+
+static u32 bench_rand_state = 12345;
+static u32 bench_rand(void)
+{
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 17;
+    bench_rand_state ^= bench_rand_state << 5;
+    return bench_rand_state;
+}
+
+// Noise never contains the magic's bytes, except for the prefixes, that are added on purpose
+static u8 bench_noise_byte(const u8 *magic)
+{
+    u8 b;
+    do { b = bench_rand(); } while (b == magic[0] || b == magic[1] || b == magic[2]);
+    return b;
+}
+
+static BenchStream bench_stream(u32 count, f32 noise)
+{
+    static const ServerMsgType types[] = { SMSG_PONG, SMSG_SUCCESS, SMSG_REQUEST, SMSG_CREDIT, SMSG_ACK, SMSG_NAK, SMSG_CAPS };
+    const u8 magic[3] = { (u8)(SPPP_MAGIC >> 24), (u8)(SPPP_MAGIC >> 16), (u8)(SPPP_MAGIC >> 8) };
+    BenchStream stream = { .bytes = ail_da_new(u8), .replies = calloc(count, sizeof(CommReply)), .count = count };
+    u8 frame[SMSG_CAPS_SIZE];
+    for (u32 i = 0; i < count; i++) {
+        CommReply *r = &stream.replies[i];
+        r->type = types[bench_rand()%AIL_ARRLEN(types)];
+        AIL_Buffer buf = { .data = frame, .idx = 0, .len = 0, .cap = sizeof(frame) };
+        ail_buf_write4msb(&buf, SPPP_MAGIC | r->type);
+        switch ((u8)r->type) {
+            case SMSG_PONG:
+                r->data.max_cmds_per_msg = bench_rand();
+                ail_buf_write2lsb(&buf, r->data.max_cmds_per_msg);
+                break;
+            case SMSG_CREDIT:
+                r->data.credit.received = bench_rand();
+                r->data.credit.window   = bench_rand();
+                ail_buf_write2lsb(&buf, r->data.credit.received);
+                ail_buf_write2lsb(&buf, r->data.credit.window);
+                break;
+            case SMSG_ACK:
+                r->data.ack.seq   = bench_rand();
+                r->data.ack.reply = SMSG_SUCCESS;
+                ail_buf_write1(&buf, r->data.ack.seq);
+                ail_buf_write1(&buf, r->data.ack.reply);
+                break;
+            case SMSG_NAK:
+                r->data.nak_seq = bench_rand();
+                ail_buf_write1(&buf, r->data.nak_seq);
+                break;
+            case SMSG_CAPS:
+                r->data.caps.version       = bench_rand();
+                r->data.caps.features      = bench_rand();
+                r->data.caps.max_frame     = bench_rand();
+                r->data.caps.window        = bench_rand();
+                r->data.caps.max_baud_rate = bench_rand();
+                ail_buf_write1(&buf, r->data.caps.version);
+                ail_buf_write4lsb(&buf, r->data.caps.features);
+                ail_buf_write2lsb(&buf, r->data.caps.max_frame);
+                ail_buf_write2lsb(&buf, r->data.caps.window);
+                ail_buf_write4lsb(&buf, r->data.caps.max_baud_rate);
+                break;
+        }
+        // On average, the noise before each reply makes up `noise` of all bytes
+        u32 noise_len = noise > 0 ? bench_rand()%(u32)(2*buf.len*noise/(1 - noise) + 1) : 0;
+        for (u32 j = 0; j < noise_len; j++) {
+            if (bench_rand()%16 == 0) ail_da_pushn(&stream.bytes, magic, 1 + bench_rand()%2);
+            else ail_da_push(&stream.bytes, bench_noise_byte(magic));
+        }
+        ail_da_pushn(&stream.bytes, frame, buf.len);
+    }
+    return stream;
+}
+
+static bool bench_same_reply(CommReply a, CommReply b)
+{
+    a.time = b.time = 0;
+    return memcmp(&a, &b, sizeof(CommReply)) == 0;
+}
+
+// Returns the amount of replies, that matched the expected ones
+static u32 bench_decoder(BenchStream stream, CommReply *out)
+{
+    SpppDecoder d = { 0 };
+    u32 n = 0, idx = 0;
+    while (idx < stream.bytes.len && n < stream.count) {
+        u32 len = AIL_MIN(1 + bench_rand()%READING_CHUNK_SIZE, stream.bytes.len - idx);
+        u32 end = idx + len;
+        while (idx < end && n < stream.count) {
+            bool complete;
+            idx += sppp_decode(&d, &stream.bytes.data[idx], end - idx, &out[n], &complete);
+            if (complete) n++;
+        }
+    }
+    u32 matched = 0;
+    while (matched < n && bench_same_reply(out[matched], stream.replies[matched])) matched++;
+    return matched;
+}
+
+// The previous approach of listen_to_port and check_for_msg
+static u32 bench_ring(BenchStream stream, CommReply *out)
+{
+    AIL_RingBuffer rb = { 0 };
+    u32 n = 0, idx = 0;
+    while (n < stream.count) {
+        while (ail_ring_len(rb) < AIL_RING_SIZE/2 && idx < stream.bytes.len) {
+            u8 len = AIL_MIN(8, stream.bytes.len - idx);
+            ail_ring_writen(&rb, len, &stream.bytes.data[idx]);
+            idx += len;
+        }
+        while (ail_ring_len(rb) >= 4 && (ail_ring_peek4msb(rb) & 0xffffff00) != SPPP_MAGIC) ail_ring_pop(&rb);
+        if (ail_ring_len(rb) < 4) {
+            if (idx >= stream.bytes.len) break;
+            continue;
+        }
+        ServerMsgType type = ail_ring_peek_at(rb, 3);
+        u8 size = 4;
+        switch ((u8)type) {
+            case SMSG_PONG:   size = 6;                break;
+            case SMSG_CREDIT: size = SMSG_CREDIT_SIZE; break;
+            case SMSG_ACK:    size = SMSG_ACK_SIZE;    break;
+            case SMSG_NAK:    size = SMSG_NAK_SIZE;    break;
+            case SMSG_CAPS:   size = SMSG_CAPS_SIZE;   break;
+        }
+        if (ail_ring_len(rb) < size) {
+            if (idx >= stream.bytes.len) break;
+            continue;
+        }
+        ail_ring_popn(&rb, 4);
+        CommReply *r = &out[n++];
+        r->type = type;
+        switch ((u8)type) {
+            case SMSG_PONG:
+                r->data.max_cmds_per_msg = ail_ring_read2lsb(&rb);
+                break;
+            case SMSG_CREDIT:
+                r->data.credit.received = ail_ring_read2lsb(&rb);
+                r->data.credit.window   = ail_ring_read2lsb(&rb);
+                break;
+            case SMSG_ACK:
+                r->data.ack.seq   = ail_ring_read(&rb);
+                r->data.ack.reply = ail_ring_read(&rb);
+                break;
+            case SMSG_NAK:
+                r->data.nak_seq = ail_ring_read(&rb);
+                break;
+            case SMSG_CAPS:
+                r->data.caps.version       = ail_ring_read(&rb);
+                r->data.caps.features      = ail_ring_read4lsb(&rb);
+                r->data.caps.max_frame     = ail_ring_read2lsb(&rb);
+                r->data.caps.window        = ail_ring_read2lsb(&rb);
+                r->data.caps.max_baud_rate = ail_ring_read4lsb(&rb);
+                break;
+        }
+    }
+    u32 matched = 0;
+    while (matched < n && bench_same_reply(out[matched], stream.replies[matched])) matched++;
+    return matched;
+}
+
+int main(int argc, char **argv)
+{
+    u32 count = argc > 1 ? atoi(argv[1]) : 100000;
+    static const f32 noises[] = { 0.0f, 0.5f, 0.9f };
+    CommReply *out = malloc(count*sizeof(CommReply));
+    bool ok = true;
+    printf("%-8s %-14s %10s %10s %10s\n", "noise", "decoder", "MB/s", "replies/s", "correct");
+    for (u32 i = 0; i < AIL_ARRLEN(noises); i++) {
+        BenchStream stream = bench_stream(count, noises[i]);
+        struct { const char *name; u32 (*decode)(BenchStream, CommReply *); } decoders[] = {
+            { "sppp_decode", bench_decoder },
+            { "ring buffer", bench_ring },
+        };
+        for (u32 j = 0; j < AIL_ARRLEN(decoders); j++) {
+            u32 matched = 0;
+            f64 t = ail_time_clock_start();
+            for (u32 k = 0; k < BENCH_REPEATS; k++) {
+                memset(out, 0, count*sizeof(CommReply));
+                matched = decoders[j].decode(stream, out);
+            }
+            f64 elapsed = ail_time_clock_elapsed(t)/BENCH_REPEATS;
+            ok &= matched == count;
+            printf("%6.0f%%  %-14s %10.1f %10.0f %7u/%u\n", noises[i]*100, decoders[j].name, stream.bytes.len/elapsed/1e6, count/elapsed, matched, count);
+        }
+        ail_da_free(&stream.bytes);
+        free(stream.replies);
+    }
+    free(out);
+    return !ok;
+}
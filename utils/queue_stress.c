@@ -0,0 +1,134 @@
+#include "../src/comm.c"
+#include <sched.h>
+
+// Stress test for SpscQueue and the command queue between the UI and the communication thread
+// Meant to be run under ThreadSanitizer (which `make queue_stress` builds it with), which reports any data race between the two threads
+// 1. A producer pushes numbered elements with a payload derived from their number through a tiny queue, so that it is full and empty all the time.
+//    The consumer checks, that every element arrives exactly once, in order and in one piece.
+// 2. A fake UI thread calls set_volume, set_speed and set_paused like while dragging a slider, while this thread applies the commands with
+//    handle_cmds, just like the communication thread does. Afterwards the communication thread's values have to match the UI's latest ones.
+// 3. This thread keeps publishing the communication thread's state, while a fake UI thread polls it. Every field of a snapshot is derived from
+//    the same number, so a torn read shows up as a snapshot, whose fields don't match.
+//
+// Usage: queue_stress [elements]
+#define STRESS_QUEUE_SIZE 8
+#define STRESS_PAYLOAD    7
+
+typedef struct StressElem {
+    u32 idx;
+    u32 payload[STRESS_PAYLOAD];
+} StressElem;
+
+static StressElem stress_slots[STRESS_QUEUE_SIZE];
+static SpscQueue  stress_queue = SPSC_QUEUE_INIT(STRESS_QUEUE_SIZE);
+static u32        stress_count = 0;
+static u64        stress_full  = 0; // Amount of times the producer found the queue full
+static bool       stress_ui_done = false;
+static u64        stress_torn    = 0; // Amount of snapshots, that the UI got with fields from different states
+static u64        stress_polls   = 0;
+
+static void *stress_producer_main(void *args)
+{
+    AIL_UNUSED(args);
+    for (u32 i = 0; i < stress_count; i++) {
+        i64 slot;
+        while ((slot = spsc_queue_reserve(&stress_queue)) < 0) {
+            stress_full++;
+            sched_yield();
+        }
+        stress_slots[slot].idx = i;
+        for (u32 j = 0; j < STRESS_PAYLOAD; j++) stress_slots[slot].payload[j] = i*31 + j;
+        spsc_queue_publish(&stress_queue);
+    }
+    return NULL;
+}
+
+static void *stress_ui_main(void *args)
+{
+    AIL_UNUSED(args);
+    for (u32 i = 1; i <= stress_count; i++) {
+        set_volume(i/(f32)stress_count);
+        if (i%8 == 0) set_speed(i%16 ? 0.5f : 2.0f);
+        if (i%64 == 0) set_paused(i%128 == 0);
+        // Like the UI, only queue up to one command per control and frame - just with much shorter frames
+        if (i%4 == 0) ail_time_sleep(1);
+    }
+    __atomic_store_n(&stress_ui_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *stress_poll_main(void *args)
+{
+    AIL_UNUSED(args);
+    u32 last_id = 0;
+    while (last_id < stress_count) {
+        const CommState *state = comm_poll_state();
+        if (state->position_ms != state->song_id || state->connected != (state->song_id & 1) || state->song_id < last_id) stress_torn++;
+        last_id = state->song_id;
+        stress_polls++;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    stress_count = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    pthread_t producer;
+    f64 t = ail_time_clock_start();
+    pthread_create(&producer, NULL, stress_producer_main, NULL);
+    for (u32 expected = 0; expected < stress_count;) {
+        i64 slot = spsc_queue_peek(&stress_queue);
+        if (slot < 0) {
+            sched_yield();
+            continue;
+        }
+        StressElem e = stress_slots[slot];
+        spsc_queue_pop(&stress_queue);
+        bool ok = e.idx == expected;
+        for (u32 j = 0; ok && j < STRESS_PAYLOAD; j++) ok = e.payload[j] == expected*31 + j;
+        if (!ok) {
+            printf("Element %u arrived broken or out of order (got %u)\n", expected, e.idx);
+            return 1;
+        }
+        expected++;
+    }
+    pthread_join(producer, NULL);
+    f64 elapsed = ail_time_clock_elapsed(t);
+    printf("Passed %u elements through a queue of %u slots in %.3fs (%.0f elements/s, found it full %llu times)\n",
+           stress_count, STRESS_QUEUE_SIZE, elapsed, stress_count/elapsed, (unsigned long long)stress_full);
+
+    // The communication thread isn't started, so this thread can take its place
+    comm_init();
+    stress_count /= 100;
+    pthread_t ui;
+    pthread_create(&ui, NULL, stress_ui_main, NULL);
+    u64 handled = 0;
+    while (!__atomic_load_n(&stress_ui_done, __ATOMIC_ACQUIRE)) {
+        handle_cmds();
+        handled++;
+        comm_wait(1);
+    }
+    pthread_join(ui, NULL);
+    handle_cmds();
+    u32 last_speed = stress_count - stress_count%8;
+    u32 last_pause = stress_count - stress_count%64;
+    bool ok = comm_volume == 1.0f;
+    if (last_speed) ok &= comm_speed == (last_speed%16 ? 0.5f : 2.0f);
+    if (last_pause) ok &= comm_is_paused == (last_pause%128 == 0);
+    printf("Handled %u volume changes in %llu batches - the latest values %s\n", stress_count, (unsigned long long)handled, ok ? "arrived" : "got lost");
+
+    stress_count *= 10;
+    comm_is_music_playing = false; // The published position is just comm_time then
+    pthread_t poller;
+    pthread_create(&poller, NULL, stress_poll_main, NULL);
+    for (u32 i = 1; i <= stress_count; i++) {
+        comm_song_id      = i;
+        comm_time         = i;
+        comm_is_connected = i & 1;
+        publish_state();
+    }
+    pthread_join(poller, NULL);
+    printf("Published %u states, which the UI polled %llu times - %llu snapshots were torn\n", stress_count, (unsigned long long)stress_polls, (unsigned long long)stress_torn);
+    return !ok || stress_torn;
+}
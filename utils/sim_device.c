@@ -0,0 +1,506 @@
+// Simulated Arduino for testing SAM without the actual piano player (only works on POSIX systems)
+// It opens a pseudo-terminal and answers all SPPP messages like the Arduino would. Songs are "played" by waiting for as long as the received commands would take.
+// Like the Arduino, it buffers one chunk behind the playing one and requests the next chunk as soon as that one starts playing.
+// If a chunk ended before the next one arrived, a buffer underrun is reported.
+// To connect SAM with it, start SAM with the environment variable SAM_PORT set to the path that is printed on startup.
+//
+// Usage: sim_device [-legacy] [-plain] [-single] [-noresume] [-noclock] [-nodirect] [-drift ppm] [-baud n] [-badbaud] [-drop n] [-corrupt n]
+// -legacy:    Behave like older firmware, which doesn't support any of the SPPP extensions (see header.h)
+// -plain:     Don't announce support for CMSG_MUSIC_COMPACT
+// -single:    Don't announce support for CMSG_CONTROL, so that every control value needs its own message
+// -noresume:  Don't announce support for CMSG_STATUS_QUERY, so that SAM starts the song over after reconnecting
+// -noclock:   Don't report the playback position (see SMSG_CLOCK), so that SAM has to estimate it on its own
+// -nodirect:  Don't announce support for CMSG_KEYS, so that SAM streams chunks even if SAM_DIRECT is set
+// -drift ppm: Let the device's clock run this many millionths faster than the real time, like an imprecise crystal
+// -baud n:    Highest baud rate, that the device can switch to (default 1000000) or 0 to stay at BAUD_RATE
+// -badbaud:   Receive only garbage after switching to a higher baud rate, like with a cable, that can't carry it
+// -drop n:    Drop every n-th reply to test retransmissions
+// -corrupt n: Corrupt every n-th sequenced frame after receiving it to test CRC checks
+//
+// Like the Arduino, the simulated device only has a small receive buffer and bytes only arrive at the line rate given by the current baud rate.
+// Bytes that arrive while the receive buffer is full are lost.
+
+#define _XOPEN_SOURCE 600 // For posix_openpt and friends
+#include "header.h"
+#include "compact.c"
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h> // For seeding the session
+
+#define SIM_MAX_CMDS_PER_MSG 64
+#define SIM_IN_BUFFER_SIZE   512
+#define SIM_LINE_RATE(baud)  ((baud)/10) // Bytes per second with 8N1 framing
+#define SIM_MAX_BAUD_RATE    2000000
+
+static int sim_fd;
+static u32 sim_drop_every  = 0;
+static u32 sim_corrupt_every = 0;
+static u32 sim_seq_frames  = 0;    // Amount of sequenced frames received
+static u8  sim_last_seq    = 0;    // `seq` of the last executed sequenced frame
+static u32 sim_replies     = 0;
+static u32 sim_cmd_size    = 0;    // Size of a single encoded PidiCmd
+static u64 sim_playing_until = 0;  // Time in ms at which the playing chunk ends or 0 if nothing is playing
+static u64 sim_queued_ms   = 0;    // Play time of the chunk waiting behind the playing one
+static bool sim_has_queued = false;
+static bool sim_song_over  = true;
+static u64 sim_request_at  = 0;    // Time in ms at which an unanswered REQUEST is repeated or 0 if none is outstanding
+static u32 sim_underruns   = 0;
+static f32 sim_speed       = 1.0f;
+static u64 sim_cmds_played = 0;
+static bool sim_legacy     = false;
+static u32 sim_features    = SPPP_FEATURE_COMPACT_MUSIC | SPPP_FEATURE_CONTROL_BATCH | SPPP_FEATURE_RESUME | SPPP_FEATURE_CLOCK | SPPP_FEATURE_DIRECT;
+static u16 sim_session     = 0;    // Chosen randomly on startup (see SMSG_STATUS)
+static f64 sim_start       = 0;    // Time at which the device's clock started
+static f64 sim_drift       = 0;    // Relative error of the device's clock
+static u64 sim_clock_at    = 0;    // Time in ms at which the next periodic SMSG_CLOCK is sent or 0 if nothing is playing
+static u32 sim_control_msgs = 0;   // Amount of CMSG_VOLUME, CMSG_SPEED, CMSG_CONTINUE and CMSG_CONTROL messages executed
+static u64 sim_music_bytes = 0;    // Bytes of all music payloads received so far
+static u64 sim_key_presses = 0;    // Keys pressed by CMSG_KEYS so far
+static u64 sim_last_keys   = 0;    // Time in µs at which the last CMSG_KEYS arrived
+static u16 sim_received    = 0;    // Bytes received since the end of the last PING (mod 2^16)
+static u16 sim_credit_free = 0;    // Free bytes in the receive buffer when the last CREDIT was sent
+static u16 sim_credit_received = 0; // `received` of the last CREDIT
+static u64 sim_lost_bytes  = 0;
+static u32 sim_max_baud    = 1000000;
+static u32 sim_baud        = BAUD_RATE;
+static bool sim_bad_baud   = false;
+static u64 sim_confirm_at  = 0;    // Time in ms at which the device goes back to BAUD_RATE, unless a valid frame arrived, or 0
+static u64 sim_last_rx     = 0;    // Time in ms at which the last byte arrived
+
+static u64 sim_now_ms(void)
+{
+    return (u64)(ail_time_clock_start()*1000.0);
+}
+
+static void sim_credit(u16 window)
+{
+    if (sim_legacy) return;
+    u8 buf[SMSG_CREDIT_SIZE];
+    AIL_Buffer b = { .data = buf, .idx = 0, .len = 0, .cap = sizeof(buf) };
+    ail_buf_write4msb(&b, SPPP_MAGIC | SMSG_CREDIT);
+    ail_buf_write2lsb(&b, sim_received);
+    ail_buf_write2lsb(&b, window);
+    if (write(sim_fd, buf, b.len) != (ssize_t)b.len) printf("Failed to write credit\n");
+    sim_credit_free     = window;
+    sim_credit_received = sim_received;
+}
+
+static void sim_reply(ServerMsgType type, const u8 *payload, u8 payload_len)
+{
+    sim_replies++;
+    if (sim_drop_every && sim_replies % sim_drop_every == 0) {
+        printf("Dropping reply %u\n", sim_replies);
+        return;
+    }
+    u8 buf[32];
+    AIL_Buffer b = { .data = buf, .idx = 0, .len = 0, .cap = sizeof(buf) };
+    ail_buf_write4msb(&b, SPPP_MAGIC | type);
+    for (u8 i = 0; i < payload_len; i++) ail_buf_write1(&b, payload[i]);
+    if (write(sim_fd, buf, b.len) != (ssize_t)b.len) printf("Failed to write reply\n");
+}
+
+// Time in µs, after which the device runs out of music
+static u64 sim_buffered_us(f64 now_ms)
+{
+    if (!sim_playing_until) return 0;
+    return (u64)((AIL_MAX(sim_playing_until - now_ms, 0.0) + (sim_has_queued ? sim_queued_ms : 0))*1000.0);
+}
+
+// Reports where the device is in the music, either periodically (`query` 0) or as an answer to a CMSG_CLOCK_QUERY
+static void sim_clock(u8 query)
+{
+    if (sim_legacy || !(sim_features & SPPP_FEATURE_CLOCK)) return;
+    f64 now_ms = ail_time_clock_start()*1000.0;
+    u8 clock[SMSG_CLOCK_SIZE - 4];
+    AIL_Buffer cb = { .data = clock, .idx = 0, .len = 0, .cap = sizeof(clock) };
+    ail_buf_write1(&cb, query);
+    ail_buf_write1(&cb, sim_playing_until != 0);
+    ail_buf_write4lsb(&cb, (u32)(u64)((now_ms/1000.0 - sim_start)*(1.0 + sim_drift)*1e6));
+    ail_buf_write4lsb(&cb, (u32)sim_cmds_played);
+    ail_buf_write4lsb(&cb, (u32)sim_buffered_us(now_ms));
+    sim_reply(SMSG_CLOCK, clock, cb.len);
+}
+
+static void sim_request(u64 now)
+{
+    sim_reply(SMSG_REQUEST, NULL, 0);
+    // Ask again if the REQUEST or the following chunk got lost
+    sim_request_at = sim_legacy ? 0 : now + MSG_TIMEOUT;
+}
+
+// Starts playing the queued chunk or reports an underrun, once the playing chunk ended
+static void sim_update_playback(u64 now)
+{
+    if (!sim_playing_until || now < sim_playing_until) return;
+    if (sim_has_queued) {
+        sim_playing_until += sim_queued_ms;
+        sim_has_queued     = false;
+        sim_request(now);
+    } else {
+        sim_playing_until = 0;
+        sim_clock_at      = 0;
+        sim_clock(0);
+        if (!sim_song_over) printf("Buffer underrun (%u so far)\n", ++sim_underruns);
+    }
+}
+
+// Goes back to BAUD_RATE if the new baud rate wasn't confirmed in time or if nothing arrived for too long
+static void sim_update_baud(u64 now)
+{
+    if (sim_baud == BAUD_RATE) return;
+    bool unconfirmed = sim_confirm_at && now >= sim_confirm_at;
+    if (unconfirmed || now >= sim_last_rx + SPPP_BAUD_IDLE_MS) {
+        printf("%s, going back to %u baud\n", unconfirmed ? "New baud rate wasn't confirmed" : "Nothing arrived for too long", BAUD_RATE);
+        sim_baud       = BAUD_RATE;
+        sim_confirm_at = 0;
+    }
+}
+
+// Sequenced frames are answered with an ACK instead of the reply itself
+static void sim_answer(ServerMsgType reply, bool sequenced, u8 seq)
+{
+    if (sequenced) sim_reply(SMSG_ACK, (u8[]){ seq, reply }, 2);
+    else           sim_reply(reply, NULL, 0);
+}
+
+// Returns the size of the message at the start of `data` or 0 if the message wasn't received fully yet
+static u64 sim_handle_msg(u8 *data, u64 len)
+{
+    if (len < 4) return 0;
+    AIL_Buffer b = { .data = data, .idx = 0, .len = len, .cap = len };
+    u8   raw_type      = ail_buf_read4msb(&b) & 0xff;
+    bool sequenced     = !sim_legacy && (raw_type & CMSG_SEQ_FLAG);
+    u8   type          = sequenced ? raw_type & ~CMSG_SEQ_FLAG : raw_type;
+    u8   seq           = 0;
+    if (sequenced) {
+        if (len < 5) return 0;
+        seq = ail_buf_read1(&b);
+    }
+
+    // Find the end of the message before executing it, since sequenced frames need to be checked first
+    u16 cmds_count = 0;
+    u64 play_time  = 0;
+    u32 arg        = 0;
+    u64 payload_start = b.idx;
+    switch (type) {
+        case CMSG_NEW_MUSIC:
+        case CMSG_MUSIC: {
+            if (type == CMSG_NEW_MUSIC) {
+                if (b.len - b.idx < 1) return 0;
+                u8 pks_count = ail_buf_read1(&b);
+                b.idx += pks_count*SPPP_PK_ENCODED_SIZE;
+            }
+            if (b.len < b.idx + 2) return 0;
+            cmds_count = ail_buf_read2lsb(&b);
+            if (b.len < b.idx + cmds_count*sim_cmd_size) return 0;
+            for (u16 i = 0; i < cmds_count; i++) play_time += pidi_dt(decode_cmd(&b));
+        } break;
+        case CMSG_MUSIC_COMPACT: {
+            if (sim_legacy || !(sim_features & SPPP_FEATURE_COMPACT_MUSIC)) goto unknown;
+            if (b.len < b.idx + 4) return 0;
+            cmds_count   = ail_buf_read2lsb(&b);
+            u16 enc_size = ail_buf_read2lsb(&b);
+            if (b.len < b.idx + enc_size) return 0;
+            // Back-references copy from the commands, that were already decoded, so no other memory is needed
+            static PidiCmd cmds[SIM_MAX_CMDS_PER_MSG];
+            u64 end = b.idx + enc_size;
+            if (cmds_count <= SIM_MAX_CMDS_PER_MSG && compact_decode_cmds(&b, end, cmds, cmds_count)) {
+                for (u16 i = 0; i < cmds_count; i++) play_time += pidi_dt(cmds[i]);
+            } else {
+                printf("Failed to decode compact music\n");
+            }
+            b.idx = end;
+        } break;
+        case CMSG_CONTINUE:
+            if (b.len < b.idx + 1) return 0;
+            b.idx += 1;
+            break;
+        case CMSG_CONTROL: {
+            if (sim_legacy || !(sim_features & SPPP_FEATURE_CONTROL_BATCH)) goto unknown;
+            if (b.len < b.idx + 1) return 0;
+            u8 fields = ail_buf_read1(&b);
+            u64 size  = 4*!!(fields & SPPP_CONTROL_VOLUME) + 4*!!(fields & SPPP_CONTROL_SPEED) + !!(fields & SPPP_CONTROL_PLAY);
+            if (b.len < b.idx + size) return 0;
+            b.idx += size;
+        } break;
+        case CMSG_BAUD_RATE:
+            if (sim_legacy) goto unknown;
+            AIL_FALL_THROUGH();
+        case CMSG_PING:
+        case CMSG_VOLUME:
+        case CMSG_SPEED:
+            if (b.len < b.idx + 4) return 0;
+            arg = ail_buf_read4lsb(&b);
+            break;
+        case CMSG_ACK_QUERY:
+            if (sim_legacy) goto unknown;
+            break;
+        case CMSG_STATUS_QUERY:
+            if (sim_legacy || !(sim_features & SPPP_FEATURE_RESUME)) goto unknown;
+            break;
+        case CMSG_CLOCK_QUERY:
+            if (sim_legacy || !(sim_features & SPPP_FEATURE_CLOCK)) goto unknown;
+            if (b.len < b.idx + 1) return 0;
+            arg = ail_buf_read1(&b);
+            break;
+        case CMSG_KEYS:
+            if (sim_legacy || !(sim_features & SPPP_FEATURE_DIRECT)) goto unknown;
+            if (b.len < b.idx + 1) return 0;
+            arg = ail_buf_read1(&b);
+            if (b.len < b.idx + arg*SPPP_KEY_ENCODED_SIZE) return 0;
+            b.idx += arg*SPPP_KEY_ENCODED_SIZE;
+            break;
+        default:
+            goto unknown;
+    }
+    u64 payload_len = b.idx - payload_start;
+    if (sequenced) {
+        if (b.len < b.idx + SPPP_CRC_SIZE) return 0;
+        if (sim_corrupt_every && ++sim_seq_frames % sim_corrupt_every == 0) {
+            printf("Corrupting frame %u\n", seq);
+            data[b.idx - 1] ^= 0x55;
+        }
+        u16 crc = sppp_crc16(&data[3], b.idx - 3);
+        if (ail_buf_read2lsb(&b) != crc) {
+            u8 expected = sim_last_seq == UINT8_MAX ? 1 : sim_last_seq + 1;
+            printf("Broken frame, asking for %u again\n", expected);
+            sim_reply(SMSG_NAK, &expected, 1);
+            return b.idx;
+        }
+        if (seq == sim_last_seq) {
+            printf("Duplicate frame %u\n", seq);
+            sim_answer(SMSG_SUCCESS, true, seq);
+            return b.idx;
+        }
+        sim_last_seq = seq;
+    }
+
+    // A valid frame confirms the new baud rate
+    sim_confirm_at = 0;
+    switch (type) {
+        case CMSG_NEW_MUSIC:
+        case CMSG_MUSIC:
+        case CMSG_MUSIC_COMPACT: {
+            play_time = (u64)(play_time/sim_speed);
+            sim_cmds_played += cmds_count;
+            sim_music_bytes += payload_len;
+            const char *name = type == CMSG_MUSIC ? "MUSIC" : type == CMSG_NEW_MUSIC ? "NEW_MUSIC" : "MUSIC_COMPACT";
+            printf("Received %s with %u commands (%llums, %llu commands and %llu music bytes in total)\n", name, cmds_count, (unsigned long long)play_time,
+                   (unsigned long long)sim_cmds_played, (unsigned long long)sim_music_bytes);
+            sim_answer(SMSG_SUCCESS, sequenced, seq);
+            sim_request_at = 0;
+            sim_song_over  = !cmds_count;
+            if (!cmds_count) break;
+            u64 now = sim_now_ms();
+            if (type == CMSG_NEW_MUSIC || !sim_playing_until) {
+                sim_playing_until = now + AIL_MAX(play_time, 1);
+                sim_has_queued    = false;
+                sim_clock_at      = now;
+                sim_request(now);
+            } else {
+                sim_queued_ms  = (sim_has_queued ? sim_queued_ms : 0) + AIL_MAX(play_time, 1);
+                sim_has_queued = true;
+            }
+        } break;
+        case CMSG_PING:
+            sim_last_seq = 0;
+            sim_reply(SMSG_PONG, (u8[]){ SIM_MAX_CMDS_PER_MSG & 0xff, SIM_MAX_CMDS_PER_MSG >> 8 }, 2);
+            // Announce support for sequenced frames
+            if (!sim_legacy) sim_reply(SMSG_ACK, (u8[]){ 0, SMSG_PONG }, 2);
+            if (!sim_legacy) {
+                u8 caps[SMSG_CAPS_SIZE - 4];
+                AIL_Buffer cb = { .data = caps, .idx = 0, .len = 0, .cap = sizeof(caps) };
+                ail_buf_write1(&cb, SPPP_EXT_VERSION);
+                ail_buf_write4lsb(&cb, sim_features);
+                ail_buf_write2lsb(&cb, SIM_IN_BUFFER_SIZE);
+                ail_buf_write2lsb(&cb, SIM_IN_BUFFER_SIZE);
+                ail_buf_write4lsb(&cb, sim_max_baud);
+                sim_reply(SMSG_CAPS, caps, cb.len);
+            }
+            break;
+        case CMSG_ACK_QUERY:
+            sim_reply(SMSG_ACK, (u8[]){ sim_last_seq, SMSG_SUCCESS }, 2);
+            break;
+        case CMSG_STATUS_QUERY: {
+            u64 buffered = sim_buffered_us(sim_now_ms())/1000;
+            u8 status[SMSG_STATUS_SIZE - 4];
+            AIL_Buffer sb = { .data = status, .idx = 0, .len = 0, .cap = sizeof(status) };
+            ail_buf_write2lsb(&sb, sim_session);
+            ail_buf_write4lsb(&sb, (u32)sim_cmds_played);
+            ail_buf_write4lsb(&sb, (u32)buffered);
+            printf("Status: received %llu commands, %llums of music left\n", (unsigned long long)sim_cmds_played, (unsigned long long)buffered);
+            sim_reply(SMSG_STATUS, status, sb.len);
+        } break;
+        case CMSG_CLOCK_QUERY:
+            sim_clock(arg);
+            break;
+        case CMSG_KEYS: {
+            // Keys are played right away and never answered
+            u32 presses = 0;
+            for (u32 i = 0; i < arg; i++) presses += data[payload_start + 1 + i*SPPP_KEY_ENCODED_SIZE + 2] != 0;
+            sim_key_presses += presses;
+            u64 now_us    = (u64)(ail_time_clock_start()*1e6);
+            u64 gap_us    = sim_last_keys ? now_us - sim_last_keys : 0;
+            sim_last_keys = now_us;
+            printf("Received %u keys (%u pressed, %llu presses in total, %lluus after the previous keys)\n", arg, presses,
+                   (unsigned long long)sim_key_presses, (unsigned long long)gap_us);
+        } break;
+        case CMSG_BAUD_RATE:
+            if (arg > sim_max_baud) {
+                printf("Unsupported baud rate %u\n", arg);
+                break;
+            }
+            // The reply still goes out at the old baud rate
+            sim_answer(SMSG_SUCCESS, sequenced, seq);
+            sim_baud       = arg;
+            sim_confirm_at = sim_now_ms() + SPPP_BAUD_CONFIRM_MS;
+            printf("Switched to %u baud\n", sim_baud);
+            break;
+        case CMSG_SPEED:
+            memcpy(&sim_speed, &arg, sizeof(sim_speed));
+            printf("Playing at %.2fx speed (control message %u)\n", sim_speed, ++sim_control_msgs);
+            sim_answer(SMSG_SUCCESS, sequenced, seq);
+            break;
+        case CMSG_CONTROL: {
+            AIL_Buffer cb = { .data = data, .idx = payload_start, .len = b.idx, .cap = b.idx };
+            u8 fields = ail_buf_read1(&cb);
+            sim_control_msgs++;
+            if (fields & SPPP_CONTROL_VOLUME) ail_buf_read4lsb(&cb); // The volume doesn't change anything here
+            if (fields & SPPP_CONTROL_SPEED) {
+                u32 speed = ail_buf_read4lsb(&cb);
+                memcpy(&sim_speed, &speed, sizeof(sim_speed));
+                printf("Playing at %.2fx speed (control message %u)\n", sim_speed, sim_control_msgs);
+            }
+            if (fields & SPPP_CONTROL_PLAY) printf("%s (control message %u)\n", ail_buf_read1(&cb) ? "Playing" : "Paused", sim_control_msgs);
+            sim_answer(SMSG_SUCCESS, sequenced, seq);
+        } break;
+        case CMSG_VOLUME:
+        case CMSG_CONTINUE:
+            sim_control_msgs++;
+            sim_answer(SMSG_SUCCESS, sequenced, seq);
+            break;
+        default:
+            sim_answer(SMSG_SUCCESS, sequenced, seq);
+            break;
+    }
+    return b.idx;
+
+unknown:
+    printf("Unknown message type %d\n", raw_type);
+    return 1; // Skip the first byte to search for the next message
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-legacy")) sim_legacy = true;
+        else if (!strcmp(argv[i], "-plain")) sim_features &= ~SPPP_FEATURE_COMPACT_MUSIC;
+        else if (!strcmp(argv[i], "-single")) sim_features &= ~SPPP_FEATURE_CONTROL_BATCH;
+        else if (!strcmp(argv[i], "-noresume")) sim_features &= ~SPPP_FEATURE_RESUME;
+        else if (!strcmp(argv[i], "-noclock")) sim_features &= ~SPPP_FEATURE_CLOCK;
+        else if (!strcmp(argv[i], "-nodirect")) sim_features &= ~SPPP_FEATURE_DIRECT;
+        else if (!strcmp(argv[i], "-drift")   && i + 1 < argc) sim_drift         = atof(argv[++i])/1e6;
+        else if (!strcmp(argv[i], "-badbaud")) sim_bad_baud = true;
+        else if (!strcmp(argv[i], "-baud")    && i + 1 < argc) sim_max_baud      = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-drop")    && i + 1 < argc) sim_drop_every    = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-corrupt") && i + 1 < argc) sim_corrupt_every = atoi(argv[++i]);
+    }
+    sim_max_baud = AIL_MIN(sim_max_baud, SIM_MAX_BAUD_RATE);
+    srand((unsigned)time(NULL) ^ (unsigned)getpid());
+    sim_session = (u16)rand();
+    sim_start   = ail_time_clock_start();
+    u8 cmd_buf[16];
+    AIL_Buffer cmd_b = { .data = cmd_buf, .idx = 0, .len = 0, .cap = sizeof(cmd_buf) };
+    encode_cmd(&cmd_b, (PidiCmd){0});
+    sim_cmd_size = cmd_b.idx;
+
+    sim_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim_fd < 0 || grantpt(sim_fd) != 0 || unlockpt(sim_fd) != 0) {
+        printf("Failed to open pseudo-terminal\n");
+        return 1;
+    }
+    // Keeping the other side open ourselves means, that SAM can close and reopen the port without us seeing a hangup
+    char *port_name = ptsname(sim_fd);
+    int   slave_fd  = open(port_name, O_RDWR | O_NOCTTY);
+    struct termios tty;
+    tcgetattr(slave_fd, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(slave_fd, TCSANOW, &tty);
+    printf("Simulated device listening on %s\n", port_name);
+    printf("Start SAM with: SAM_PORT=%s\n", port_name);
+
+    static u8 in[SIM_IN_BUFFER_SIZE];
+    u64 in_len = 0;
+    f64 line_budget = 0; // Amount of bytes that could have arrived over the line since the last read
+    u64 last_read   = sim_now_ms();
+    while (true) {
+        u64 now = sim_now_ms();
+        sim_update_playback(now);
+        sim_update_baud(now);
+        if (sim_request_at && now >= sim_request_at) sim_request(now);
+        if (sim_clock_at && now >= sim_clock_at) {
+            sim_clock(0);
+            sim_clock_at = now + SPPP_CLOCK_INTERVAL_MS;
+        }
+        struct pollfd pfd = { .fd = sim_fd, .events = POLLIN };
+        u64 wake_at = sim_request_at;
+        if (sim_playing_until && (!wake_at || sim_playing_until < wake_at)) wake_at = sim_playing_until;
+        if (sim_clock_at && (!wake_at || sim_clock_at < wake_at)) wake_at = sim_clock_at;
+        if (sim_baud != BAUD_RATE) {
+            u64 baud_at = sim_confirm_at ? sim_confirm_at : sim_last_rx + SPPP_BAUD_IDLE_MS;
+            if (!wake_at || baud_at < wake_at) wake_at = baud_at;
+        }
+        int timeout = wake_at ? (int)(AIL_MAX(wake_at, now) - now) : -1;
+        if (poll(&pfd, 1, timeout) <= 0) continue;
+
+        // Only read as many bytes as could have arrived at the line rate
+        now          = sim_now_ms();
+        line_budget  = AIL_MIN(line_budget + (now - last_read)*SIM_LINE_RATE(sim_baud)/1000.0, SIM_LINE_RATE(sim_baud)/100.0); // At most 10ms worth of bytes can have piled up
+        last_read    = now;
+        u64 can_read = (u64)line_budget;
+        if (!can_read) {
+            ail_time_sleep(1);
+            continue;
+        }
+        static u8 line[SIM_LINE_RATE(SIM_MAX_BAUD_RATE)/100 + 1];
+        ssize_t n = read(sim_fd, line, can_read);
+        if (n <= 0) continue;
+        line_budget -= n;
+        sim_last_rx  = now;
+        if (sim_bad_baud && sim_baud != BAUD_RATE) {
+            for (ssize_t i = 0; i < n; i++) line[i] ^= 0xa5;
+        }
+        u64 fits = AIL_MIN((u64)n, SIM_IN_BUFFER_SIZE - in_len);
+        if (fits < (u64)n) {
+            sim_lost_bytes += n - fits;
+            printf("Receive buffer overflowed: lost %llu bytes so far\n", (unsigned long long)sim_lost_bytes);
+        }
+        memcpy(&in[in_len], line, fits);
+        in_len       += fits;
+        sim_received += fits;
+
+        u64 start = 0;
+        while (true) {
+            // Skip everything until the next magic bytes
+            while (in_len - start >= 4 && (((u32)in[start] << 24 | (u32)in[start+1] << 16 | (u32)in[start+2] << 8) != SPPP_MAGIC)) start++;
+            bool is_ping = in_len - start >= 4 && in[start+3] == CMSG_PING;
+            u32  replies = sim_replies;
+            u64  size    = sim_handle_msg(&in[start], in_len - start);
+            if (!size) break;
+            start += size;
+            // `received` counts from the end of the last PING
+            if (is_ping) sim_received = in_len - start;
+            if (sim_replies != replies) sim_credit(SIM_IN_BUFFER_SIZE - (in_len - start));
+        }
+        memmove(in, &in[start], in_len - start);
+        in_len -= start;
+        if (in_len == SIM_IN_BUFFER_SIZE) in_len = 0; // Only garbage can fill up the entire buffer
+        u16 free_bytes = SIM_IN_BUFFER_SIZE - in_len;
+        // The host may send `host_credit` more bytes, which frames, that aren't answered (i.e. CMSG_KEYS), use up without another CREDIT
+        i32 host_credit = (i32)sim_credit_free - (u16)(sim_received - sim_credit_received);
+        if (free_bytes >= host_credit + SIM_IN_BUFFER_SIZE/4) sim_credit(free_bytes);
+    }
+    return 0;
+}